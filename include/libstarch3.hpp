@@ -0,0 +1,252 @@
+#ifndef LIBSTARCH3_H_
+#define LIBSTARCH3_H_
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cinttypes>
+#include <sys/types.h>
+#include "bzlib.h"
+#include "jansson.h"
+#include "starch3chr.hpp"
+
+namespace starch3
+{
+    typedef enum status {
+        k_status_ok = 0,
+        k_status_end,
+        k_status_error
+    } status_t;
+
+    // how a chunk's transformed bytes are compressed
+    typedef enum codec {
+        k_bzip2_codec = 0,
+        k_gzip_codec,
+        k_codec_undefined
+    } codec_t;
+
+    typedef struct chunk_record {
+        off_t offset;                               // archive offset of the compressed chunk
+        size_t size;                                // compressed byte count
+        size_t tf_offset;                           // start of this chromosome's bytes in the decoded chunk, which small chromosomes share
+        size_t tf_size;                             // transformed (uncompressed) byte count
+        int64_t line_count;                         // records in the chunk
+        int64_t first_record;                       // archive-wide ordinal of the chunk's first record, counted from 0
+        int64_t min_start;                          // smallest start in the chunk
+        int64_t max_stop;                           // largest stop in the chunk; INT64_MAX when the archive predates chunk ranges
+        int64_t base_count;                         // summed record lengths; -1 when the archive predates base counts
+        int64_t unique_base_count;                  // bases covered by at least one record; -1 when unknown
+        uint32_t tf_crc32c;                         // CRC32C of the transformed bytes
+        uint32_t compressed_crc32c;                 // CRC32C of the compressed bytes
+        uint64_t tf_hash;                           // 64-bit hash of the transformed bytes; 0 when unknown or when the chunk is shared
+        codec_t codec;                              // compression of the chunk
+        int level;                                  // codec setting: bzip2 block size in units of 100k, or gzip level
+    } chunk_record_t;
+
+    typedef struct stream_record {
+        std::string chr;                            // chromosome name
+        int64_t line_count;                         // records across all chunks
+        uint64_t tf_size;                           // transformed bytes across all chunks
+        uint64_t size;                              // compressed bytes across all chunks
+        uint32_t tf_crc32c;                         // CRC32C of the whole transformed stream
+        uint32_t compressed_crc32c;                 // CRC32C of the whole compressed stream
+        std::vector<chunk_record_t> chunks;         // chunks in archive order
+    } stream_record_t;
+
+    // decoded record; pointers refer to reader-owned buffers and stay valid until the next call to Reader::next()
+    typedef struct record_view {
+        const char* chr;
+        size_t chr_length;
+        int64_t start;
+        int64_t stop;
+        const char* rem;
+        size_t rem_length;
+    } record_view_t;
+
+    // parsed records of one chromosome in struct-of-arrays layout, so per-record deltas vectorize over a batch
+    typedef struct record_batch {
+        std::vector<int64_t> starts;                // start coordinates
+        std::vector<int64_t> stops;                 // stop coordinates
+        std::vector<size_t> rem_offsets;            // offsets into rem; one more than the record count
+        std::vector<char> rem;                      // concatenated remainder fields
+    } record_batch_t;
+
+    // header of a columnar export, which holds the starts and stops of each chromosome as flat arrays that can be mapped in place
+    typedef struct columnar_header {
+        unsigned char magic[8];                     // Archive::columnar_magic_bytes
+        uint32_t version;                           // Archive::columnar_version; fields are in the writing host's byte order, so a mismatch here also flags a swapped file
+        uint32_t chr_count;                         // entries in the chromosome table
+        uint64_t record_count;                      // records across all chromosomes
+        uint64_t chrs_offset;                       // file offset of the chromosome table
+        uint64_t names_offset;                      // file offset of the chromosome names, each NUL-terminated
+    } columnar_header_t;
+
+    // chromosome table entry of a columnar export; an entry's index is the chromosome ID
+    typedef struct columnar_chr {
+        uint64_t name_offset;                       // file offset of the chromosome name
+        uint64_t record_count;                      // records of the chromosome, which is the length of both arrays
+        uint64_t starts_offset;                     // file offset of the start array, aligned to Archive::columnar_alignment
+        uint64_t stops_offset;                      // file offset of the stop array, aligned to Archive::columnar_alignment
+        uint32_t width;                             // bytes per coordinate: 4 (int32_t) when every stop fits, otherwise 8 (int64_t)
+        uint32_t reserved;                          // zero
+    } columnar_chr_t;
+
+    // archive layout shared by the starch3 client and the library
+    class Archive
+    {
+    public:
+        static const unsigned char header_magic_bytes[4];
+        static const int version_major = 3;
+        static const int version_minor = 4;
+        static const int version_revision = 0;
+        static const size_t footer_length = 32;
+        static const int footer_offset_length = 20;
+        static const size_t chunk_length = 1048576;
+        static const int default_bzip2_level = 9;
+        static const int default_gzip_level = 6;
+        static const unsigned char columnar_magic_bytes[8];
+        static const uint32_t columnar_version = 1;
+        static const size_t columnar_alignment = 64;
+
+        static json_t* metadata_to_json(const std::vector<stream_record_t>& streams, const std::string& note);
+        static status_t json_to_metadata(json_t* metadata, std::vector<stream_record_t>* streams, std::string* error);
+        static void format_footer(char* footer, off_t metadata_offset, uint32_t metadata_crc32c);
+        static status_t read_metadata(int fd, std::vector<stream_record_t>* streams, std::string* error);
+        static void append_chunk_record(std::vector<stream_record_t>* streams, const char* chr, size_t chr_length, const chunk_record_t& cr);
+        static bool chunk_overlaps(const chunk_record_t& cr, int64_t start, int64_t stop);
+        static size_t compressed_bound(size_t tf_size);
+        static std::string codec_name(codec_t codec, int level);
+        static bool parse_codec_name(const char* s, codec_t* codec, int* level);
+        static status_t compress_chunk(bz_stream* bzs, const char* tf, size_t tf_size, char* out, size_t out_capacity, size_t* out_size, std::string* error);
+        static status_t compress_chunk(codec_t codec, int level, const char* tf, size_t tf_size, char* out, size_t out_capacity, size_t* out_size, std::string* error);
+        static status_t decompress_chunk(codec_t codec, const char* compressed, size_t size, char* tf, size_t tf_size, std::string* error);
+        static status_t read_chunk(int fd, const chunk_record_t& cr, std::vector<char>* compressed, std::vector<char>* tf, std::string* error);
+        static status_t read_chunk_prefix(int fd, const chunk_record_t& cr, size_t tf_end, std::vector<char>* compressed, std::vector<char>* tf, std::string* error);
+        static status_t decode_chunk(const char* compressed, const chunk_record_t& cr, std::vector<char>* tf, std::string* error);
+        static status_t decode_chunk_prefix(const char* compressed, const chunk_record_t& cr, size_t tf_end, std::vector<char>* tf, std::string* error);
+    };
+
+    // transforms batches of sorted records; state starts over at each chunk boundary
+    class Encoder
+    {
+    public:
+        static const size_t batch_length = 4096;
+
+        // how a record's start is written; an "m<mode>" line in the stream switches modes
+        typedef enum gap_mode {
+            k_stop_gap_mode = 0,                    // start minus the previous stop
+            k_start_delta_mode,                     // start minus the previous start, for overlapping records
+            k_gap_mode_undefined
+        } gap_mode_t;
+
+        Encoder();
+        void reset(void);
+        size_t encode(const record_batch_t& batch, size_t from, std::vector<char>* tf);
+        int64_t line_count(void) const;
+        int64_t min_start(void) const;
+        int64_t max_stop(void) const;
+        int64_t base_count(void) const;
+        int64_t unique_base_count(void) const;
+        status_t finish_chunk(const std::vector<char>& tf, std::vector<char>* compressed, chunk_record_t* cr, std::string* error) const;
+        static void clear_batch(record_batch_t* batch);
+        static void append_to_batch(record_batch_t* batch, int64_t start, int64_t stop, const char* rem, size_t rem_length);
+
+    private:
+        int64_t _last_start;
+        int64_t _last_stop;
+        int64_t _last_coord_diff;
+        int64_t _line_count;
+        int64_t _min_start;
+        int64_t _max_stop;
+        int64_t _base_count;
+        int64_t _unique_base_count;
+        gap_mode_t _mode;
+        std::vector<int64_t> _gaps;
+        std::vector<int64_t> _start_deltas;
+        std::vector<int64_t> _coord_diffs;
+        std::vector<unsigned char> _coord_diff_changes;
+    };
+
+    // iterates the records of one decompressed chunk in place
+    class ChunkCursor
+    {
+    public:
+        ChunkCursor(const char* tf, size_t tf_size);
+        status_t next(int64_t* start, int64_t* stop, const char** rem, size_t* rem_length);
+
+    private:
+        const char* _pos;
+        const char* _end;
+        int64_t _last_start;
+        int64_t _last_stop;
+        int64_t _coord_diff;
+        Encoder::gap_mode_t _mode;
+    };
+
+    // writes sorted records to an archive without spawning threads or exiting on error
+    class Writer
+    {
+    public:
+        Writer();
+        ~Writer();
+        status_t open(const std::string& fn);
+        status_t open(int fd);
+        void set_note(const std::string& s);
+        status_t push(const char* chr, size_t chr_length, int64_t start, int64_t stop, const char* rem, size_t rem_length);
+        status_t push(const record_view_t& r);
+        status_t close(void);
+        const std::string& error(void) const;
+
+    private:
+        int _fd;
+        bool _owns_fd;
+        off_t _offset;
+        std::string _note;
+        std::string _error;
+        std::string _chr;
+        bool _has_chr;
+        ChrTable _chrs;
+        int64_t _last_start;
+        std::vector<char> _tf;
+        std::vector<char> _compressed;
+        record_batch_t _batch;
+        Encoder _encoder;
+        std::vector<stream_record_t> _streams;
+
+        status_t write_bytes(const char* buf, size_t len);
+        status_t encode_batch(void);
+        status_t flush_chunk(void);
+    };
+
+    // iterates decoded records of an archive, one chunk resident at a time
+    class Reader
+    {
+    public:
+        Reader();
+        ~Reader();
+        status_t open(const std::string& fn);
+        void close(void);
+        const std::vector<stream_record_t>& streams(void) const;
+        status_t select(const std::string& chr);
+        status_t select(const std::string& chr, int64_t start, int64_t stop);
+        status_t next(record_view_t* r);
+        const std::string& error(void) const;
+
+    private:
+        int _fd;
+        std::vector<stream_record_t> _streams;
+        size_t _stream_idx;
+        size_t _stream_end;
+        size_t _chunk_idx;
+        int64_t _start;
+        int64_t _stop;
+        bool _has_chunk;
+        off_t _tf_chunk_offset;
+        std::vector<char> _compressed;
+        std::vector<char> _tf;
+        ChunkCursor _cursor;
+        std::string _error;
+    };
+}
+
+#endif // LIBSTARCH3_H_
@@ -3,21 +3,46 @@
 
 #include <string>
 #include <vector>
+#include <set>
+#include <map>
+#include <deque>
+#include <algorithm>
+#include <random>
+#include <unordered_set>
 #include <new>
 #include <cstdio>
 #include <cstdlib>
 #include <cerrno>
 #include <cinttypes>
 #include <cstring>
+#include <cctype>
 #include <getopt.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
 #include <sys/stat.h>
 #include <pthread.h>
+#include <ctime>
+#include <csignal>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "bzlib.h"
 #include "jansson.h"
+#include "starch3crc32c.hpp"
+#include "starch3hash.hpp"
+#include "libstarch3.hpp"
+#include "starch3input.hpp"
+#include "starch3cache.hpp"
+#include "starch3chr.hpp"
+#include "starch3pool.hpp"
 
 namespace starch3
 {
+    class Starch;
+
+    extern Starch* self;
+
     class Starch 
     {
         typedef enum compression_method {
@@ -26,6 +51,14 @@ namespace starch3
             k_compression_method_undefined
         } compression_method_t;
 
+        // what --auto weighs when choosing each chromosome's compression
+        typedef enum optimize_objective {
+            k_optimize_ratio = 0,                       // smallest output
+            k_optimize_speed,                           // fastest compression
+            k_optimize_decode_speed,                    // fastest decompression
+            k_optimize_objective_undefined
+        } optimize_objective_t;
+
         typedef enum bed_token {
             k_chromosome_token = 0,
             k_start_token,
@@ -37,6 +70,8 @@ namespace starch3
         typedef struct bed {
             char*   chr;
             size_t  chr_capacity;
+            size_t  chr_length;
+            ChrTable::chr_id_t chr_id;
             char*   start_str;
             size_t  start_str_capacity;
             int64_t start;
@@ -50,11 +85,11 @@ namespace starch3
 
         typedef struct transform_state {
             int64_t line_count;
-            char*   last_chr;
+            ChrTable::chr_id_t last_chr_id;
             int64_t last_start;
             int64_t last_stop;
             int64_t last_coord_diff;
-            char*   current_chr;
+            ChrTable::chr_id_t current_chr_id;
             int64_t current_start;
             int64_t current_stop;
             int64_t current_coord_diff;
@@ -62,71 +97,445 @@ namespace starch3
             int64_t base_count_nonunique;
         } transform_state_t;
 
+        // one chromosome written as its own archive under --shard-dir
+        typedef struct shard_record {
+            std::string chr;                            // chromosome name
+            std::string fn;                             // archive path, which appears once the shard is complete
+            std::string tmp_fn;                         // path while the shard is being written
+            int fd;                                     // descriptor of the shard being written
+            off_t size;                                 // archive size, once complete
+        } shard_record_t;
+
+        // chunks of a reference archive under --reuse, by transformed hash and size
+        typedef std::map<std::pair<uint64_t, size_t>, chunk_record_t> reuse_index_t;
+
+        typedef struct compressed_block {
+            char* data;                                 // compressed bytes (owned by the write queue once enqueued)
+            size_t size;                                // compressed byte count
+            off_t offset;                               // absolute output offset, assigned when enqueued
+            int fd;                                     // output descriptor, assigned when enqueued
+            shard_record_t* shard;                      // shard to close and publish once this block is written, or NULL
+            char* checkpoint;                           // serialized checkpoint to commit once this block is durable, or NULL
+        } compressed_block_t;
+
+        typedef struct verify_job {
+            std::vector<std::pair<size_t, size_t> > parts; // (stream, chunk) records that refer to one compressed chunk, in archive order
+            uint32_t crc32c;                            // CRC32C of the chunk as read, written only by the claiming worker
+            int result;                                 // chunk result, written only by the claiming worker
+        } verify_job_t;
+
+        typedef struct verify_state {
+            pthread_mutex_t lock;                       // protects next_job
+            size_t next_job;                            // next chunk to be claimed by a worker
+            int in_fd;                                  // archive file descriptor
+            std::vector<stream_record_t>* streams;      // archive streams
+            std::vector<verify_job_t>* jobs;            // distinct compressed chunks
+        } verify_state_t;
+
+        typedef struct query_region {
+            int64_t start;                              // first base of the region
+            int64_t stop;                               // one past the last base of the region
+        } query_region_t;
+
+        typedef struct extract_part {
+            size_t stream_idx;                          // stream of the chunk
+            size_t chunk_idx;                           // chunk within the stream
+            const std::vector<query_region_t>* regions; // sorted, merged regions whose records are kept, or NULL for all records
+            const std::vector<query_region_t>* records; // sorted, merged ranges of archive-wide record ordinals that are kept, or NULL for all records
+        } extract_part_t;
+
+        typedef struct extract_job {
+            std::vector<extract_part_t> parts;          // selected chromosome spans of one compressed chunk, in archive order
+        } extract_job_t;
+
+        typedef struct extract_state {
+            pthread_mutex_t lock;                       // protects job claims and the reorder buffer
+            pthread_cond_t slot_is_ready;               // signaled when a worker has decoded a chunk into its slot
+            pthread_cond_t slot_is_free;                // signaled when the writer has emptied a slot
+            size_t next_job;                            // next job to be claimed by a worker
+            size_t next_out;                            // next job to be written, in archive order
+            bool is_failed;                             // a chunk could not be decoded, so workers and writer stop
+            int in_fd;                                  // archive file descriptor
+            std::vector<stream_record_t>* streams;      // archive streams
+            std::vector<extract_job_t>* jobs;           // selected chunks in archive order
+            std::vector<std::vector<char> >* slots;     // reorder buffer; job j decodes into slot (j % size)
+            std::vector<char>* slot_is_full;            // per-slot flag, set by the worker and cleared by the writer
+        } extract_state_t;
+
+        typedef struct export_part {
+            size_t stream_idx;                          // stream of the chunk
+            size_t chunk_idx;                           // chunk within the stream
+            off_t starts_offset;                        // output offset of the chunk's first start
+            off_t stops_offset;                         // output offset of the chunk's first stop
+            uint32_t width;                             // bytes per coordinate in the stream's arrays
+        } export_part_t;
+
+        typedef struct export_job {
+            std::vector<export_part_t> parts;           // selected chromosome spans of one compressed chunk, in archive order
+        } export_job_t;
+
+        typedef struct export_state {
+            pthread_mutex_t lock;                       // protects next_job and is_failed
+            size_t next_job;                            // next job to be claimed by a worker
+            bool is_failed;                             // a chunk could not be decoded or written, so workers stop
+            int in_fd;                                  // archive file descriptor
+            int out_fd;                                 // columnar output file descriptor
+            std::vector<stream_record_t>* streams;      // archive streams
+            std::vector<export_job_t>* jobs;            // selected chunks in archive order
+        } export_state_t;
+
+        typedef struct summary_totals {
+            int64_t count;                              // records overlapping the window
+            int64_t bases;                              // bases of those records that fall inside the window
+        } summary_totals_t;
+
+        typedef struct summary_job {
+            size_t stream_idx;                          // stream of the chunk
+            size_t chunk_idx;                           // chunk within the stream
+            const std::vector<query_region_t>* windows; // windows of the stream, sorted by start
+            size_t window_offset;                       // index of the stream's first window among all windows
+            int64_t max_window_length;                  // longest window of the stream, which bounds the overlap search
+        } summary_job_t;
+
+        typedef struct summary_state {
+            pthread_mutex_t lock;                       // protects next_job, next_worker and is_failed
+            size_t next_job;                            // next job to be claimed by a worker
+            size_t next_worker;                         // next set of totals to be claimed by a starting worker
+            bool is_failed;                             // a chunk could not be decoded
+            int in_fd;                                  // archive file descriptor
+            std::vector<stream_record_t>* streams;      // archive streams
+            std::vector<summary_job_t>* jobs;           // chunks that straddle a window boundary and must be decoded
+            std::vector<std::vector<summary_totals_t> >* worker_totals; // per-worker totals, indexed like all windows
+        } summary_state_t;
+
+        typedef struct served_archive {
+            std::string fn;                             // archive path, which also names it in requests
+            int fd;                                     // archive file descriptor
+            const char* map;                            // archive contents, mapped read-only
+            size_t map_size;                            // mapped byte count
+            std::vector<stream_record_t> streams;       // archive streams
+            ChrTable chrs;                              // chromosome names of the streams, which requests are resolved against
+            std::vector<ChrTable::chr_id_t> stream_chrs; // chromosome of each stream
+        } served_archive_t;
+
+        typedef struct serve_state {
+            pthread_mutex_t lock;                       // protects connections, active and is_stopping
+            pthread_cond_t connection_is_available;     // signaled when a connection is queued or the server stops
+            std::deque<int> connections;                // accepted sockets waiting for a worker
+            std::set<int> active;                       // sockets being served, shut down when the server stops
+            bool is_stopping;                           // workers finish once set
+            std::vector<served_archive_t>* archives;    // archives, in command-line order
+            ChunkCache* cache;                          // decoded chunks shared by all connections
+        } serve_state_t;
+
+        typedef struct merge_archive {
+            std::string fn;                             // archive path
+            int fd;                                     // archive file descriptor, shared by all workers through pread()
+            std::vector<stream_record_t> streams;       // archive streams
+        } merge_archive_t;
+
+        typedef struct merge_chunk {
+            off_t offset;                               // archive offset of the decoded chunk; -1 when none is held
+            std::vector<char> compressed;               // compressed bytes of the chunk
+            std::vector<char> tf;                       // transformed bytes of the chunk, as far as the last span that chromosomes of the group need
+        } merge_chunk_t;
+
+        typedef struct merge_source {
+            const merge_archive_t* archive;             // archive being read
+            size_t stream_idx;                          // the archive's stream for the chromosome being merged
+            size_t chunk_idx;                           // chunk being read
+            size_t archive_idx;                         // archive order, which breaks ties between equal records
+            merge_chunk_t* chunk;                       // the worker's decoded chunk of this archive, which chromosomes packed into it share
+            bool is_reading;                            // the cursor is over the span of chunk_idx
+            ChunkCursor cursor;                         // position in the chunk's span
+            int64_t start;                              // current record
+            int64_t stop;
+            const char* rem;
+            size_t rem_length;
+        } merge_source_t;
+
+        typedef struct merge_piece {
+            std::vector<char> data;                     // BED text, or a compressed chunk when writing an archive
+            chunk_record_t cr;                          // chunk description when writing an archive; the writer sets its offset
+            bool is_shared;                             // the chunk is the one written with the previous piece, so data is empty
+        } merge_piece_t;
+
+        typedef struct merge_output {
+            Encoder encoder;                            // transformation state of the chromosome being merged
+            record_batch_t batch;                       // records waiting to be transformed
+            std::vector<char> tf;                       // transformed bytes of the chunk being filled
+            size_t tf_chr_offset;                       // start of the current chromosome in tf; bytes before it are packed chromosomes
+            uint64_t chr_tf_flushed;                    // bytes of the current chromosome in chunks already queued
+            std::vector<std::pair<size_t, chunk_record_t> > packed_chrs; // chromosomes sharing tf ahead of the current one, with their spans
+            merge_piece_t piece;                        // piece being filled
+        } merge_output_t;
+
+        typedef struct merge_state {
+            pthread_mutex_t lock;                       // protects everything below that changes
+            pthread_cond_t piece_is_ready;              // signaled when a worker queues a piece or finishes a chromosome
+            pthread_cond_t piece_is_taken;              // signaled when the writer takes a piece
+            size_t next_group;                          // next group of chromosomes to be claimed by a worker
+            bool is_failed;                             // a chunk could not be read, so workers and writer stop
+            bool is_archive;                            // write compressed chunks rather than text
+            const ChrTable* chr_names;                  // chromosomes of all archives
+            std::vector<ChrTable::chr_id_t>* chrs;      // chromosomes of all archives, in sort order
+            std::vector<size_t>* group_starts;          // index into chrs where each group begins, followed by the chromosome count
+            std::vector<merge_archive_t>* archives;     // input archives
+            std::vector<std::vector<std::pair<size_t, size_t> > >* chr_streams; // (archive, stream) of each chromosome, indexed by chromosome ID
+            std::vector<std::deque<merge_piece_t> >* pieces; // per-chromosome pieces awaiting the writer
+            std::vector<char>* is_chr_done;             // per-chromosome flag, set when its worker has queued every piece
+        } merge_state_t;
+
+        typedef enum validation_error_kind {
+            k_malformed_line = 0,
+            k_negative_coordinate,
+            k_start_after_stop,
+            k_unsorted_chromosome,
+            k_repeated_chromosome,
+            k_unsorted_start,
+            k_validation_error_kind_undefined
+        } validation_error_kind_t;
+
+        typedef struct validation_error {
+            int64_t line;                               // input line number, counted from 1
+            validation_error_kind_t kind;               // which check failed
+            std::string chr;                            // chromosome field of the offending line
+        } validation_error_t;
+
+        // sort-order and format checks, made as each line is parsed
+        typedef struct validation_state {
+            int64_t line_count;                         // lines read so far
+            bool is_line_valid;                         // should the pending line be encoded?
+            ChrTable::chr_id_t last_chr_id;             // chromosome of the last encoded record, or ChrTable::no_chr
+            int64_t last_start;                         // start of the last encoded record
+            int64_t error_count;                        // all errors, including those past the itemized limit
+            std::vector<validation_error_t> errors;     // itemized errors
+        } validation_state_t;
+
+        // input position just past a record, from which a resumed compression reads on
+        typedef struct input_mark {
+            off_t offset;                               // input bytes through the record's line
+            int64_t line_count;                         // input lines through the record's line
+            int64_t start;                              // start of the record
+            int64_t error_count;                        // validation errors through the record's line, itemized or not
+        } input_mark_t;
+
+        // small chromosome whose transformed bytes wait in the tf buffer to share the next chunk
+        typedef struct packed_chr {
+            std::string chr;                            // chromosome name
+            chunk_record_t cr;                          // span and zone map; compressed fields are filled in when the chunk is written
+            input_mark_t tf_mark;                       // input position after the chromosome's last record
+        } packed_chr_t;
+
+        // progress restored from a --checkpoint file, and the input it must match
+        typedef struct checkpoint {
+            bool is_resuming;                           // was a checkpoint for this input and output found?
+            off_t input_size;                           // input size, taken once as the run starts
+            time_t input_mtime;                         // input modification time, taken once as the run starts
+            input_mark_t mark;                          // input already held by the archive's chunks
+            off_t output_offset;                        // archive bytes through the last durable chunk
+            std::vector<validation_error_t> errors;     // itemized validation errors through the mark
+        } checkpoint_t;
+
+        static const int out_queue_slots = 3;
+
+        // ring of compressed blocks between the compressor and the writer stage
+        typedef struct write_queue {
+            pthread_mutex_t lock;                       // protects the ring and offset bookkeeping
+            pthread_cond_t slot_is_available;           // to note when a ring slot is free to be filled
+            pthread_cond_t block_is_available;          // to note when a compressed block is ready to be written
+            compressed_block_t slots[out_queue_slots];  // triple-buffered compressed blocks
+            int next_in;                                // next available slot for input
+            int next_out;                               // next available slot for output
+            int count;                                  // occupied slots
+            bool is_eof;                                // no further blocks will be enqueued
+            int out_fd;                                 // output file descriptor of the staged bytes
+            bool out_fd_is_seekable;                    // write with pwrite() at known offsets?
+            int next_fd;                                // output file descriptor assigned to the next enqueued block
+            off_t next_offset;                          // offset assigned to the next enqueued block
+            char* staging;                              // aligned buffer coalescing blocks into large writes
+            size_t staging_size;                        // staging buffer size (used space)
+            off_t staging_offset;                       // output offset of the first staged byte
+            bool is_preallocating;                      // reserve disk space for the output ahead of its writes?
+            off_t preallocated_offset;                  // output disk space is reserved up to this offset
+            bool is_inline;                             // blocks are staged by the enqueueing thread, with no writer stage
+        } write_queue_t;
+
+        // a full tf buffer handed to the task pool, held until every earlier chunk has gone to the writer
+        typedef struct pending_chunk {
+            bool is_compressed;                         // set by the task pool once the chunk is compressed
+            std::vector<char> tf;                       // transformed bytes of the chunk
+            compressed_block_t cb;                      // compressed bytes, once is_compressed is set
+            chunk_record_t cr;                          // span and compression of the last chromosome in the chunk; its offset is filled in on commit
+            ChrTable::chr_id_t chr_id;                  // chromosome of cr
+            std::vector<packed_chr_t> packed_chrs;      // earlier chromosomes whose bytes precede it in the chunk
+            input_mark_t tf_mark;                       // input position after the chunk's last record
+        } pending_chunk_t;
+
         // cf. http://pages.cs.wisc.edu/~remzi/OSTEP/threads-cv.pdf
         typedef struct shared_buffer {
-            pthread_mutex_t lock;                       // protects the buffer and transformation state
-            pthread_cond_t new_line_is_available;       // to note when the buffer has raw BED data ready to process
-            pthread_cond_t new_line_is_empty;           // to note when the buffer is empty and ready to be filled with raw BED data
-            pthread_cond_t new_chromosome_is_available; // to note when a record is parsed that contains a new chromosome field name
-            pthread_cond_t new_tf_buffer_is_available;  // to note when a transformation buffer is available for processing
             char* in_line;                              // input line text
             size_t in_line_capacity;                    // input line capacity
-            int next_in;                                // next available line for input
-            int next_out;                               // next available line for output
-            bool is_new_line_available;                 // is line occupied?
-            bool is_new_chromosome_available;           // is new chromosome available?
-            bool is_new_tf_buffer_available;            // is a transformation buffer available for processing?
             bool is_eof;                                // are we at the end of the input file stream?
             FILE* in_stream;                            // input file stream
+            off_t in_offset;                            // input bytes read so far
             bed_t* bed;                                 // raw BED field components
+            ChrTable* chrs;                             // chromosome names, interned as records are validated; any name in it has been seen
             transform_state_t* tf_state;                // transformed BED state components
-            char* tf_line;                              // tf line text
-            size_t tf_line_capacity;                    // tf line text capacity
-            char* tf_buffer;                            // tf buffer
-            size_t tf_buffer_capacity;                  // tf buffer capacity
-            size_t tf_buffer_size;                      // tf buffer size (used space)
+            record_batch_t* batch;                      // parsed records waiting to be transformed
+            std::vector<input_mark_t>* batch_marks;     // input position after each batched record, kept only when checkpointing
+            input_mark_t tf_mark;                       // input position after the last record in the tf buffer
+            bool is_checkpointing;                      // are checkpoints recorded as chunks are written?
+            off_t in_size;                              // input size recorded in each checkpoint
+            time_t in_mtime;                            // input modification time recorded in each checkpoint
+            double checkpoint_due;                      // monotonic time, in seconds, before which no checkpoint is recorded
+            Encoder* encoder;                           // transforms batches into the tf buffer
+            std::vector<char>* tf_buffer;               // tf buffer
+            size_t tf_chr_offset;                       // start of the current chromosome's bytes in the tf buffer
+            uint64_t chr_tf_flushed;                    // bytes of the current chromosome in chunks already handed to the pool
+            std::vector<packed_chr_t>* packed_chrs;     // earlier chromosomes whose bytes precede it in the tf buffer
+            TaskPool* pool;                             // compresses full tf buffers
+            std::deque<pending_chunk_t*>* pending_chunks; // chunks handed to the pool, in archive order
+            size_t max_pending_chunks;                  // chunks in flight before encoding waits on the oldest
+            write_queue_t* out_queue;                   // compressed blocks waiting for the writer stage
+            std::vector<stream_record_t>* streams;      // per-chromosome metadata of written chunks
+            validation_state_t* validation;             // input checks and their errors
+            std::deque<shard_record_t>* shards;         // per-chromosome archives, or NULL when not sharding
+            shard_record_t* open_shard;                 // shard of the current chromosome, once its first chunk is written
+            const reuse_index_t* reuse_chunks;          // reference archive chunks whose compressed bytes can be copied, or NULL
+            int reuse_fd;                               // reference archive file descriptor
+            int64_t reused_chunk_count;                 // chunks copied from the reference archive
+            codec_t codec;                              // compression of the chunks being written
+            int level;                                  // codec setting of the chunks being written
+            bool is_auto;                               // is the compression chosen per chromosome by trial?
+            bool is_codec_chosen;                       // has it been chosen for the current chromosome?
         } shared_buffer_t;
 
+    public:
+        typedef enum client_mode {
+            k_compress_mode = 0,
+            k_verify_mode,
+            k_extract_mode,
+            k_summary_mode,
+            k_serve_mode,
+            k_merge_mode,
+            k_columnar_mode,
+            k_client_mode_undefined
+        } client_mode_t;
+
     private:
         std::string _input_fn;
+        std::string _output_fn;
+        std::string _report_fn;
+        std::string _shard_dir;
+        std::string _reuse_fn;
+        std::string _checkpoint_fn;
+        checkpoint_t _resume;
         std::string _note;
-        bz_stream* _bz_stream_ptr;
         FILE* _in_stream;
-        FILE* _out_stream;
+        int _out_fd;
         compression_method_t _compression_method;
+        bool _is_auto;
+        optimize_objective_t _optimize_objective;
+        client_mode_t _client_mode;
         unsigned char _header_magic_bytes[4];
+        std::set<std::string> _selected_chrs;
+        std::map<std::string, std::vector<query_region_t> > _query_regions;
+        std::string _serve_socket_fn;
+        std::string _columnar_fn;
+        std::vector<std::string> _archive_fns;
+        size_t _cache_size;
+        bool _is_small_input;
+        long _thread_count;
+        bool _is_pinned;
+        query_region_t _record_range;
+        int64_t _sample_size;
+        uint64_t _sample_seed;
 
     public:
         Starch();
         ~Starch();
 
-        pthread_t produce_line_thread;
-        pthread_t consume_line_thread;
-        pthread_t update_chr_thread;
-        pthread_t consume_tf_buffer_thread;
+        pthread_t write_blocks_thread;
 
         shared_buffer_t buffer;
+        write_queue_t out_queue;
+        std::vector<stream_record_t> streams;
+        ChrTable chrs;
+        TaskPool pool;
+        std::deque<shard_record_t> shards;
+        reuse_index_t reuse_chunks;
+        int reuse_fd;
+        volatile sig_atomic_t serve_is_stopping;
 
         void initialize_shared_buffer(starch3::Starch::shared_buffer_t* b);
         void delete_shared_buffer(starch3::Starch::shared_buffer_t* b);
         FILE* get_in_stream(void);
         void initialize_in_stream(void);
         void set_in_stream(FILE* ri_stream);
+        bool is_small_input(void);
         std::string get_input_fn(void);
         void set_input_fn(std::string s);
-        void set_out_stream(FILE* wo_stream);
-        FILE* get_out_stream(void);
+        std::string get_output_fn(void);
+        void set_output_fn(std::string s);
+        std::string get_report_fn(void);
+        void set_report_fn(std::string s);
+        int64_t report_validation(void);
+        std::string get_shard_dir(void);
+        void set_shard_dir(std::string s);
+        std::string get_reuse_fn(void);
+        void set_reuse_fn(std::string s);
+        void open_reuse_archive(void);
+        std::string get_checkpoint_fn(void);
+        void set_checkpoint_fn(std::string s);
+        void resume_from_checkpoint(void);
+        void remove_checkpoint(void);
+        void write_shard_manifest(void);
+        void delete_shards(void);
+        void set_out_fd(int fd);
+        int get_out_fd(void);
         void initialize_out_stream(void);
-        void initialize_out_compression_stream(void);
-        void delete_out_compression_stream(void);
+        void finalize_out_stream(void);
+        void initialize_write_queue(starch3::Starch::write_queue_t* wq);
+        void delete_write_queue(starch3::Starch::write_queue_t* wq);
         std::string get_note(void);
         void set_note(std::string s);
         Starch::compression_method_t get_compression_method(void);
         void set_compression_method(Starch::compression_method_t t);
-        void initialize_bz_stream_ptr(void);
-        void setup_bz_stream_callbacks(starch3::Starch* h);
-        void delete_bz_stream_ptr(void);
-        void bzip2_block_close_callback(void);
+        bool is_auto(void);
+        void set_auto(bool b);
+        Starch::optimize_objective_t get_optimize_objective(void);
+        void set_optimize_objective(std::string s);
+        Starch::client_mode_t get_client_mode(void);
+        void set_client_mode(Starch::client_mode_t m);
+        void write_archive_metadata(void);
+        void read_archive_metadata(int in_fd, std::vector<stream_record_t>* s);
+        int verify_archive(void);
+        int extract_archive(void);
+        int summarize_archive(void);
+        int serve_archives(void);
+        int merge_archives(void);
+        int export_archive(void);
+        std::string get_serve_socket_fn(void);
+        void set_serve_socket_fn(std::string s);
+        std::string get_columnar_fn(void);
+        void set_columnar_fn(std::string s);
+        void add_archive_fn(std::string s);
+        void set_cache_size(std::string s);
+        long get_thread_count(void);
+        void set_thread_count(std::string s);
+        bool is_pinned(void);
+        void set_pinned(bool b);
+        void add_selected_chr(std::string s);
+        void add_query(std::string s);
+        void read_query_regions(std::string fn);
+        void merge_query_regions(void);
+        bool is_record_range_set(void);
+        void set_record_range(std::string s);
+        int64_t get_sample_size(void);
+        void set_sample_size(std::string s);
+        void set_sample_seed(std::string s);
+        void select_records(std::vector<query_region_t>* records);
         void initialize_command_line_options(int argc, char** argv);
         void test_stdin_availability(void);
         void initialize_header_magic_bytes(void);
@@ -150,741 +559,3749 @@ namespace starch3
 
         static const int in_line_initial_length = 1024;
         static const int in_field_initial_length = 128;
-        static const int tf_line_initial_length = 1024;
-        static const int tf_buffer_initial_length = 1024;
+        static const size_t tf_buffer_chunk_length = Archive::chunk_length;
+        static const size_t packed_chr_max_length = tf_buffer_chunk_length / 4;
+        static const size_t out_staging_length = 4194304;
+        static const size_t out_staging_alignment = 4096;
+        static const size_t out_preallocation_length = 16777216;
+        static const size_t max_validation_errors = 1000;
+        static const size_t extract_slots_per_worker = 2;
+        static const long serve_min_workers = 4;
+        static const size_t serve_default_cache_size = 268435456;
+        static const size_t serve_max_request_length = 4096;
+        static const size_t merge_pieces_per_chr = 4;
+        static const size_t merge_memory_budget = 1073741824;
+        static const size_t small_input_length = 1048576;
+        static const int checkpoint_interval = 30;
+        static const int checkpoint_cost_ratio = 100;
+        static const size_t auto_sample_length = 131072;
         static const char field_delimiter = '\t';
         static const char line_delimiter = '\n';
         
-        static void* produce_line(void* arg) {
+        /*
+           Reads a line of data into the buffer, returning false at the end of input. A last line with
+           no newline is ended with one, so that it is encoded like any other.
+        */
+        static bool read_line(shared_buffer_t* sb) {
             size_t in_line_pos = 0;
             char* new_line = NULL;
-            shared_buffer_t* sb = static_cast<shared_buffer_t*>( arg );
-            
-            for (;;) {
-                pthread_mutex_lock(&sb->lock);
-                while (sb->is_new_line_available) { // && !sb->is_new_tf_buffer_available) {
-                    pthread_cond_wait(&sb->new_line_is_empty, &sb->lock);
-                }
-                in_line_pos = 0;
-                /* read a line of data into the buffer */
-                do {  
-                    if ((in_line_pos + 1) == sb->in_line_capacity) {
-                        new_line = NULL;
-                        new_line = static_cast<char*>( realloc(sb->in_line, sb->in_line_capacity * 2) );
-                        if (!new_line) {
-                            std::fprintf(stderr, "Error: Not enough memory for reallocation of shared_buffer_t line character buffer\n");
-                            std::exit(ENOMEM);
-                        }
-                        sb->in_line = new_line;
-                        sb->in_line_capacity *= 2;
-                    }
-                    if ((sb->in_line[in_line_pos++] = static_cast<char>( getc(sb->in_stream) )) == EOF) {
-                        sb->next_in = (sb->next_in == 0) ? 1 : 0;
-                        sb->is_new_line_available = true;
-                        sb->is_new_chromosome_available = true;
-                        sb->is_eof = true;
-                        pthread_cond_signal(&sb->new_line_is_available);
-                        pthread_mutex_unlock(&sb->lock);
-                        std::fprintf(stderr, "Debug: Calling EOF from produce_line()\n");
-                        pthread_exit(NULL);
-                    }
-                } while ((sb->in_line[in_line_pos-1] != line_delimiter));
-                sb->next_in = (sb->next_in == 0) ? 1 : 0;
-                sb->is_new_line_available = true;
-                sb->is_new_chromosome_available = false;
-                //sb->is_eof = false;
-                pthread_cond_signal(&sb->new_line_is_available);
-                pthread_mutex_unlock(&sb->lock);
-            }
+            int c = 0;
+            do {  
+                if ((in_line_pos + 1) == sb->in_line_capacity) {
+                    new_line = NULL;
+                    new_line = static_cast<char*>( realloc(sb->in_line, sb->in_line_capacity * 2) );
+                    if (!new_line) {
+                        std::fprintf(stderr, "Error: Not enough memory for reallocation of shared_buffer_t line character buffer\n");
+                        std::exit(ENOMEM);
+                    }
+                    sb->in_line = new_line;
+                    sb->in_line_capacity *= 2;
+                }
+                /* kept as an int, so that a 0xff byte is not taken for the end of input */
+                if ((c = getc(sb->in_stream)) == EOF) {
+                    if (in_line_pos == 0) {
+                        return false;
+                    }
+                    sb->in_offset += static_cast<off_t>( in_line_pos );
+                    sb->in_line[in_line_pos] = line_delimiter;
+                    return true;
+                }
+                sb->in_line[in_line_pos++] = static_cast<char>( c );
+            } while ((sb->in_line[in_line_pos-1] != line_delimiter));
+            sb->in_offset += static_cast<off_t>( in_line_pos );
+            return true;
         }
-        
-        static void* consume_line(void* arg) { 
+
+        /* splits the buffered line into its fields */
+        static void split_line(shared_buffer_t* sb) {
             size_t in_line_pos = 0;
             size_t in_elem_pos = 0;
-            shared_buffer_t* sb = static_cast<shared_buffer_t*>( arg );
             char* new_field = NULL;
-            
-            sb->bed->token = k_chromosome_token;
-            
-            for (;;) {
-                pthread_mutex_lock(&sb->lock);
-                while (!sb->is_new_line_available) {
-                    pthread_cond_wait(&sb->new_line_is_available, &sb->lock);
-                }
-                in_line_pos = 0;
-                sb->bed->chr[in_elem_pos] = '\0';
-                sb->bed->start_str[in_elem_pos] = '\0';
-                sb->bed->stop_str[in_elem_pos] = '\0';
-                sb->bed->rem[in_elem_pos] = '\0';
-                /* process next line of text from the buffer */
-                do {
-                    if ((sb->in_line[in_line_pos] == field_delimiter) && (sb->bed->token != k_remainder_token)) {
-                        in_elem_pos = 0;
-                        sb->bed->token++;
-                        in_line_pos++;
-                    }
-                    if (sb->in_line[in_line_pos] == EOF) {
-                        if (sb->bed->chr) {
-                            free(sb->bed->chr);
-                            sb->bed->chr = NULL;
-                        }
-                        sb->is_eof = true;
-                        sb->is_new_tf_buffer_available = true;
-                        pthread_cond_signal(&sb->new_tf_buffer_is_available);
-                        std::fprintf(stderr, "Debug: Calling EOF from consume_line()\n");
-                        pthread_mutex_unlock(&sb->lock);
-                        pthread_exit(NULL);
-                    }
-
-                    switch (sb->bed->token) {
-                    case k_chromosome_token:
-                        if ((in_elem_pos + 1) == sb->bed->chr_capacity) {
-                            new_field = NULL;
-                            new_field = static_cast<char*>( realloc(sb->bed->chr, sb->bed->chr_capacity * 2) );
-                            if (!new_field) {
-                                std::fprintf(stderr, "Error: Not enough memory for reallocation of buffer BED line chromosome field component\n");
-                                std::exit(ENOMEM);
-                            }
-                            sb->bed->chr = new_field;
-                            sb->bed->chr_capacity *= 2;
-                        }
-                        sb->bed->chr[in_elem_pos] = sb->in_line[in_line_pos++];
-                        sb->bed->chr[++in_elem_pos] = '\0';
-                        break;
-                    case k_start_token:
-                        if ((in_elem_pos + 1) == sb->bed->start_str_capacity) {
-                            new_field = NULL;
-                            new_field = static_cast<char*>( realloc(sb->bed->start_str, sb->bed->start_str_capacity * 2) );
-                            if (!new_field) {
-                                std::fprintf(stderr, "Error: Not enough memory for reallocation of buffer BED line start field component\n");
-                                std::exit(ENOMEM);
-                            }
-                            sb->bed->start_str = new_field;
-                            sb->bed->start_str_capacity *= 2;
-                        }
-                        sb->bed->start_str[in_elem_pos] = sb->in_line[in_line_pos++];
-                        sb->bed->start_str[++in_elem_pos] = '\0';
-                        break;
-                    case k_stop_token:
-                        if ((in_elem_pos + 1) == sb->bed->stop_str_capacity) {
-                            new_field = NULL;
-                            new_field = static_cast<char*>( realloc(sb->bed->stop_str, sb->bed->stop_str_capacity * 2) );
-                            if (!new_field) {
-                                std::fprintf(stderr, "Error: Not enough memory for reallocation of buffer BED line stop field component\n");
-                                std::exit(ENOMEM);
-                            }
-                            sb->bed->stop_str = new_field;
-                            sb->bed->stop_str_capacity *= 2;
+            sb->bed->chr_length = 0;
+            sb->bed->chr[in_elem_pos] = '\0';
+            sb->bed->start_str[in_elem_pos] = '\0';
+            sb->bed->stop_str[in_elem_pos] = '\0';
+            sb->bed->rem[in_elem_pos] = '\0';
+            /* process next line of text from the buffer */
+            do {
+                if ((sb->in_line[in_line_pos] == field_delimiter) && (sb->bed->token != k_remainder_token)) {
+                    in_elem_pos = 0;
+                    sb->bed->token++;
+                    in_line_pos++;
+                }
+
+                switch (sb->bed->token) {
+                case k_chromosome_token:
+                    if ((in_elem_pos + 1) == sb->bed->chr_capacity) {
+                        new_field = NULL;
+                        new_field = static_cast<char*>( realloc(sb->bed->chr, sb->bed->chr_capacity * 2) );
+                        if (!new_field) {
+                            std::fprintf(stderr, "Error: Not enough memory for reallocation of buffer BED line chromosome field component\n");
+                            std::exit(ENOMEM);
                         }
-                        sb->bed->stop_str[in_elem_pos] = sb->in_line[in_line_pos++];
-                        sb->bed->stop_str[++in_elem_pos] = '\0';
-                        break;
-                    case k_remainder_token:
-                        if ((in_elem_pos + 1) == sb->bed->rem_capacity) {
-                            new_field = NULL;
-                            new_field = static_cast<char*>( realloc(sb->bed->rem, sb->bed->rem_capacity * 2) );
-                            if (!new_field) {
-                                std::fprintf(stderr, "Error: Not enough memory for reallocation of buffer BED line remainder field component\n");
-                                std::exit(ENOMEM);
-                            }
-                            sb->bed->rem = new_field;
-                            sb->bed->rem_capacity *= 2;
+                        sb->bed->chr = new_field;
+                        sb->bed->chr_capacity *= 2;
+                    }
+                    sb->bed->chr[in_elem_pos] = sb->in_line[in_line_pos++];
+                    sb->bed->chr[++in_elem_pos] = '\0';
+                    sb->bed->chr_length = in_elem_pos;
+                    break;
+                case k_start_token:
+                    if ((in_elem_pos + 1) == sb->bed->start_str_capacity) {
+                        new_field = NULL;
+                        new_field = static_cast<char*>( realloc(sb->bed->start_str, sb->bed->start_str_capacity * 2) );
+                        if (!new_field) {
+                            std::fprintf(stderr, "Error: Not enough memory for reallocation of buffer BED line start field component\n");
+                            std::exit(ENOMEM);
                         }
-                        sb->bed->rem[in_elem_pos] = sb->in_line[in_line_pos++];
-                        sb->bed->rem[++in_elem_pos] = '\0';
-                        break;
+                        sb->bed->start_str = new_field;
+                        sb->bed->start_str_capacity *= 2;
                     }
-                } while (sb->in_line[in_line_pos-1] != line_delimiter);
-                switch (sb->bed->token) {
+                    sb->bed->start_str[in_elem_pos] = sb->in_line[in_line_pos++];
+                    sb->bed->start_str[++in_elem_pos] = '\0';
+                    break;
                 case k_stop_token:
-                    sb->bed->stop_str[--in_elem_pos] = '\0';
+                    if ((in_elem_pos + 1) == sb->bed->stop_str_capacity) {
+                        new_field = NULL;
+                        new_field = static_cast<char*>( realloc(sb->bed->stop_str, sb->bed->stop_str_capacity * 2) );
+                        if (!new_field) {
+                            std::fprintf(stderr, "Error: Not enough memory for reallocation of buffer BED line stop field component\n");
+                            std::exit(ENOMEM);
+                        }
+                        sb->bed->stop_str = new_field;
+                        sb->bed->stop_str_capacity *= 2;
+                    }
+                    sb->bed->stop_str[in_elem_pos] = sb->in_line[in_line_pos++];
+                    sb->bed->stop_str[++in_elem_pos] = '\0';
                     break;
                 case k_remainder_token:
-                    sb->bed->rem[--in_elem_pos] = '\0';
+                    if ((in_elem_pos + 1) == sb->bed->rem_capacity) {
+                        new_field = NULL;
+                        new_field = static_cast<char*>( realloc(sb->bed->rem, sb->bed->rem_capacity * 2) );
+                        if (!new_field) {
+                            std::fprintf(stderr, "Error: Not enough memory for reallocation of buffer BED line remainder field component\n");
+                            std::exit(ENOMEM);
+                        }
+                        sb->bed->rem = new_field;
+                        sb->bed->rem_capacity *= 2;
+                    }
+                    sb->bed->rem[in_elem_pos] = sb->in_line[in_line_pos++];
+                    sb->bed->rem[++in_elem_pos] = '\0';
                     break;
                 }
-                sscanf(sb->bed->start_str, "%" SCNd64, &sb->bed->start);
-                sscanf(sb->bed->stop_str, "%" SCNd64, &sb->bed->stop);
-                in_elem_pos = 0;
-                sb->bed->token = k_chromosome_token;
-                sb->next_out = (sb->next_out == 0) ? 1 : 0;
-                /*
-                    At the end of consuming a line, we need to do one of
-                    the following:
-
-                    1. if current chromosome is NULL, we update the
-                       chromosome name
-
-                    2. current chromosome and the input record chromosome 
-                       differ, so we process the transformation buffer and 
-                       update the chromosome name
-
-                    3. chromosome name is not NULL and has not changed, so
-                       we read in another line
-                */
-                if (sb->tf_state->current_chr == NULL) {
-                    sb->is_new_chromosome_available = true;
-                    sb->is_new_line_available = false;
-                    sb->is_new_tf_buffer_available = false;
-                    pthread_cond_signal(&sb->new_chromosome_is_available);
-                }
-                else if (std::strcmp(sb->bed->chr, sb->tf_state->current_chr) != 0) {
-                    sb->is_new_tf_buffer_available = true;
-                    pthread_cond_signal(&sb->new_tf_buffer_is_available);
+            } while (sb->in_line[in_line_pos-1] != line_delimiter);
+            switch (sb->bed->token) {
+            case k_stop_token:
+                sb->bed->stop_str[--in_elem_pos] = '\0';
+                break;
+            case k_remainder_token:
+                sb->bed->rem[--in_elem_pos] = '\0';
+                break;
+            }
+        }
+
+        /* parses a decimal coordinate, rejecting empty fields, stray characters and overflow */
+        static bool parse_coordinate(const char* s, int64_t* v) {
+            bool is_negative = false;
+            int64_t n = 0;
+            if (*s == '-') {
+                is_negative = true;
+                s++;
+            }
+            if (*s == '\0') {
+                return false;
+            }
+            for (; *s != '\0'; s++) {
+                if ((*s < '0') || (*s > '9') || (n > (INT64_MAX - (*s - '0')) / 10)) {
+                    return false;
+                }
+                n = (n * 10) + (*s - '0');
+            }
+            *v = is_negative ? -n : n;
+            return true;
+        }
+
+        static const char* validation_error_name(validation_error_kind_t k) {
+            static const char* _names[] = { "malformed_line", "negative_coordinate", "start_after_stop", "unsorted_chromosome", "repeated_chromosome", "unsorted_start" };
+            return (k < k_validation_error_kind_undefined) ? _names[k] : "undefined";
+        }
+
+        static const char* validation_error_message(validation_error_kind_t k) {
+            static const char* _messages[] = { "Line does not have integer start and stop fields",
+                                               "Coordinate is negative",
+                                               "Start is greater than stop",
+                                               "Chromosome sorts before the previous chromosome",
+                                               "Chromosome was already seen earlier in the input",
+                                               "Start is less than the previous start" };
+            return (k < k_validation_error_kind_undefined) ? _messages[k] : "Undefined error";
+        }
+
+        static void add_validation_error(validation_state_t* vs, validation_error_kind_t kind, const char* chr) {
+            validation_error_t e;
+            vs->error_count++;
+            if (vs->errors.size() < max_validation_errors) {
+                e.line = vs->line_count;
+                e.kind = kind;
+                e.chr = chr;
+                vs->errors.push_back(e);
+                std::fprintf(stderr, "Error: Line %" PRId64 ": %s [%s]\n", e.line, validation_error_message(kind), chr);
+            }
+        }
+
+        /*
+           Checks the parsed record against the previous one, in the same pass that
+           encodes it. Returns false for records that cannot be encoded; sort-order
+           errors are reported but their records are kept.
+        */
+        static bool validate_record(shared_buffer_t* sb) {
+            validation_state_t* vs = sb->validation;
+            bed_t* bed = sb->bed;
+            if ((bed->token < k_stop_token) || !parse_coordinate(bed->start_str, &bed->start) || !parse_coordinate(bed->stop_str, &bed->stop)) {
+                add_validation_error(vs, k_malformed_line, (bed->token > k_chromosome_token) ? bed->chr : "");
+                return false;
+            }
+            if ((bed->start < 0) || (bed->stop < 0)) {
+                add_validation_error(vs, k_negative_coordinate, bed->chr);
+                return false;
+            }
+            if (bed->start > bed->stop) {
+                add_validation_error(vs, k_start_after_stop, bed->chr);
+                return false;
+            }
+            /* most records share the last record's chromosome, which a length check and one compare confirm */
+            if ((vs->last_chr_id == ChrTable::no_chr) || !sb->chrs->matches(vs->last_chr_id, bed->chr, bed->chr_length)) {
+                ChrTable::chr_id_t id = sb->chrs->find(bed->chr, bed->chr_length);
+                if (id != ChrTable::no_chr) {
+                    add_validation_error(vs, k_repeated_chromosome, bed->chr);
                 }
                 else {
-                    fprintf(stderr, "Debug: [%s] [%" PRId64 "] [%" PRId64 "] [%s]\n", sb->bed->chr, sb->bed->start, sb->bed->stop, sb->bed->rem);
-                    update_transformation_state(sb);
-                    sb->is_new_chromosome_available = false;
-                    sb->is_new_line_available = false;
-                    sb->is_new_tf_buffer_available = false;
-                    pthread_cond_signal(&sb->new_line_is_empty);
+                    if ((vs->last_chr_id != ChrTable::no_chr) && (std::strcmp(sb->chrs->name(vs->last_chr_id), bed->chr) > 0)) {
+                        add_validation_error(vs, k_unsorted_chromosome, bed->chr);
+                    }
+                    id = sb->chrs->intern(bed->chr, bed->chr_length);
                 }
-                pthread_mutex_unlock(&sb->lock);
+                vs->last_chr_id = id;
+            }
+            else if (bed->start < vs->last_start) {
+                add_validation_error(vs, k_unsorted_start, bed->chr);
             }
+            bed->chr_id = vs->last_chr_id;
+            vs->last_start = bed->start;
+            return true;
         }
 
-        static void* update_chr(void* arg) {
-            shared_buffer_t* sb = static_cast<shared_buffer_t*>( arg );
-            for (;;) {
-                pthread_mutex_lock(&sb->lock);
-                if (sb->is_eof) {
-                    std::fprintf(stderr, "Debug: Calling EOF from update_chr()\n");
-                    pthread_mutex_unlock(&sb->lock);
-                    pthread_exit(NULL);
+        /*
+           Parses, validates and transforms the input on the calling thread, which is inherently one
+           record after another, and hands each full tf buffer to the task pool as a compression task.
+           Chunks are independent, so compression, by far the costliest stage, spreads over the pool,
+           and the calling thread compresses chunks itself whenever it waits for one.
+        */
+        static void compress_input(shared_buffer_t* sb) {
+            sb->bed->token = k_chromosome_token;
+            while (read_line(sb)) {
+                sb->validation->line_count++;
+                split_line(sb);
+                sb->validation->is_line_valid = validate_record(sb);
+                sb->bed->token = k_chromosome_token;
+                if (!sb->validation->is_line_valid) {
+                    continue;
                 }
-                while (!sb->is_new_chromosome_available) {
-                    pthread_cond_wait(&sb->new_chromosome_is_available, &sb->lock);
+                if (sb->bed->chr_id != sb->tf_state->current_chr_id) {
+                    if (sb->tf_state->current_chr_id != ChrTable::no_chr) {
+                        finish_chromosome(sb);
+                    }
+                    sb->tf_state->last_chr_id = sb->tf_state->current_chr_id;
+                    sb->tf_state->current_chr_id = sb->bed->chr_id;
                 }
-                std::fprintf(stderr, "Debug: New chromosome is available\n");
-                update_str(&sb->tf_state->last_chr, sb->tf_state->current_chr);
-                update_str(&sb->tf_state->current_chr, sb->bed->chr);
-                std::fprintf(stderr, "Debug: Chromosome state updated (was [%s] - now [%s])\n", sb->tf_state->last_chr, sb->tf_state->current_chr);
-                sb->is_new_tf_buffer_available = false;
-                sb->is_new_chromosome_available = false;
-                sb->is_new_line_available = true;
-                pthread_cond_signal(&sb->new_line_is_available);
-                pthread_mutex_unlock(&sb->lock);
+                append_record(sb);
             }
+            sb->is_eof = true;
+            finish_chromosome(sb);
+            commit_pending_chunks(sb, 0);
         }
 
-        static void* consume_tf_buffer(void* arg) {
-            shared_buffer_t* sb = static_cast<shared_buffer_t*>( arg );
+        static void* write_blocks(void* arg) {
+            write_queue_t* wq = static_cast<write_queue_t*>( arg );
+            compressed_block_t cb;
             for (;;) {
-                pthread_mutex_lock(&sb->lock);
-                if (sb->is_eof) {
-                    std::fprintf(stderr, "Debug: Calling EOF from consume_tf_buffer()\n");
-                    pthread_mutex_unlock(&sb->lock);
+                pthread_mutex_lock(&wq->lock);
+                while ((wq->count == 0) && (!wq->is_eof)) {
+                    pthread_cond_wait(&wq->block_is_available, &wq->lock);
+                }
+                if (wq->count == 0) {
+                    pthread_mutex_unlock(&wq->lock);
+                    flush_staging_buffer(wq);
+#ifdef DEBUG
+                    std::fprintf(stderr, "Debug: Calling EOF from write_blocks()\n");
+#endif
                     pthread_exit(NULL);
                 }
-                while (!sb->is_new_tf_buffer_available) {
-                    pthread_cond_wait(&sb->new_tf_buffer_is_available, &sb->lock);
+                cb = wq->slots[wq->next_out];
+                wq->next_out = (wq->next_out + 1) % out_queue_slots;
+                wq->count--;
+                pthread_cond_signal(&wq->slot_is_available);
+                pthread_mutex_unlock(&wq->lock);
+                /* stage and write outside the lock, so that compression of the next block can proceed */
+                stage_compressed_block(wq, &cb);
+                free(cb.data);
+                if (cb.shard) {
+                    publish_shard(wq, &cb);
+                }
+                if (cb.checkpoint) {
+                    commit_checkpoint(wq, &cb);
                 }
-                std::fprintf(stderr, "Debug: New transformation buffer is available for processing\n");
-                process_tf_buffer(sb);
-                sb->is_new_tf_buffer_available = false;
-                sb->is_new_chromosome_available = true;
-                sb->is_new_line_available = false;
-                pthread_cond_signal(&sb->new_chromosome_is_available);
-                pthread_mutex_unlock(&sb->lock);
             }
         }
 
-        static void process_tf_buffer(shared_buffer_t* sb) {
-            if (sb->tf_buffer) {
-                std::fprintf(stderr, "Chromosome [%s]\nLines [%" PRId64 "]\nContent [%s]\n", sb->tf_state->current_chr, sb->tf_state->line_count, sb->tf_buffer);
-                reset_transformation_state(&sb->tf_state);
-                free(sb->tf_buffer);
-                sb->tf_buffer = NULL;
-                sb->tf_buffer = static_cast<char*>( std::calloc(tf_buffer_initial_length, sizeof(*sb->tf_buffer)) );
-                if (!sb->tf_buffer) {
-                    std::fprintf(stderr, "Error: Not enough memory for shared_buffer_t transformation buffer\n");
-                    std::exit(ENOMEM);
+        static void enqueue_compressed_block(write_queue_t* wq, compressed_block_t* cb) {
+            if (wq->is_inline) {
+                cb->offset = wq->next_offset;
+                cb->fd = wq->next_fd;
+                wq->next_offset += static_cast<off_t>( cb->size );
+                stage_compressed_block(wq, cb);
+                free(cb->data);
+                cb->data = NULL;
+                if (cb->shard) {
+                    publish_shard(wq, cb);
                 }
-                sb->tf_buffer_capacity = tf_buffer_initial_length;
-                sb->tf_buffer_size = 0;
+                if (cb->checkpoint) {
+                    commit_checkpoint(wq, cb);
+                }
+                return;
             }
+            pthread_mutex_lock(&wq->lock);
+            while (wq->count == out_queue_slots) {
+                pthread_cond_wait(&wq->slot_is_available, &wq->lock);
+            }
+            cb->offset = wq->next_offset;
+            cb->fd = wq->next_fd;
+            wq->next_offset += static_cast<off_t>( cb->size );
+            wq->slots[wq->next_in] = *cb;
+            wq->next_in = (wq->next_in + 1) % out_queue_slots;
+            wq->count++;
+            pthread_cond_signal(&wq->block_is_available);
+            pthread_mutex_unlock(&wq->lock);
         }
 
-        static void append_tf_line_to_buffer(shared_buffer_t* sb) {
-            char* new_tf_buffer = NULL;
-            size_t tf_line_len = strlen(sb->tf_line);
-            /* resize tf_buffer, if necessary */
-            if (sb->tf_buffer_capacity < (sb->tf_buffer_size + tf_line_len)) {
-                new_tf_buffer = NULL;
-                new_tf_buffer = static_cast<char*> ( realloc(sb->tf_buffer, sb->tf_buffer_capacity * 2) );
-                if (!new_tf_buffer) {
-                    std::fprintf(stderr, "Error: Not enough memory for reallocation of transformation buffer\n");
-                    std::exit(ENOMEM);
-                }
-                sb->tf_buffer = new_tf_buffer;
-                sb->tf_buffer_capacity *= 2;
-            }
-            /* copy data to end of buffer */
-            std::memcpy(sb->tf_buffer + sb->tf_buffer_size, sb->tf_line, tf_line_len);
-            sb->tf_buffer_size += tf_line_len;
-        }
-
-        static void update_transformation_state(shared_buffer_t* sb) {
-            char* new_tf_line = NULL;
-            size_t tf_line_len = 0;
-            int64_t last_start_diff = 0;
-            int64_t rem_len = 0;
-            sb->tf_state->current_start = sb->bed->start;
-            sb->tf_state->current_stop = sb->bed->stop;
-            sb->tf_state->current_coord_diff = sb->bed->stop - sb->bed->start;
-            /* resize tf_line, if necessary */
-            /* encode data */
-            if (sb->tf_state->current_coord_diff != sb->tf_state->last_coord_diff) {
-                sb->tf_state->last_coord_diff = sb->tf_state->current_coord_diff;
-                tf_line_len = static_cast<size_t>( 2 + n_digits(sb->tf_state->current_coord_diff) );
-                if (sb->tf_line_capacity < tf_line_len) {
-                    new_tf_line = NULL;
-                    new_tf_line = static_cast<char*> ( realloc(sb->tf_line, sb->tf_line_capacity * 2) );
-                    if (!new_tf_line) {
-                        std::fprintf(stderr, "Error: Not enough memory for reallocation of transformation buffer line\n");
-                        std::exit(ENOMEM);
-                    }
-                    sb->tf_line = new_tf_line;
-                    sb->tf_line_capacity *= 2;
-                }
-                sprintf(sb->tf_line, "p%" PRId64 "\n", sb->tf_state->current_coord_diff);
-                sb->tf_line[tf_line_len] = '\0';
-                //fprintf(stderr, "Encoding: [%s]\n", sb->tf_line);
-                append_tf_line_to_buffer(sb);
-            }
-            if (sb->tf_state->last_stop != 0) {
-                last_start_diff = sb->tf_state->current_start - sb->tf_state->last_stop;
-                rem_len = (sb->bed->rem) ? static_cast<int64_t>( strlen(sb->bed->rem) ) : 0;
-                tf_line_len = static_cast<size_t>( n_digits(last_start_diff) + 2 + rem_len );
-                if (sb->tf_line_capacity < tf_line_len) {
-                    new_tf_line = NULL;
-                    new_tf_line = static_cast<char*> ( realloc(sb->tf_line, sb->tf_line_capacity * 2) );
-                    if (!new_tf_line) {
-                        std::fprintf(stderr, "Error: Not enough memory for reallocation of transformation buffer line\n");
-                        std::exit(ENOMEM);
-                    }
-                    sb->tf_line = new_tf_line;
-                    sb->tf_line_capacity *= 2;
+        /* directs blocks enqueued from now on to the start of another file */
+        static void switch_output_file(write_queue_t* wq, int fd) {
+            pthread_mutex_lock(&wq->lock);
+            wq->next_fd = fd;
+            wq->next_offset = 0;
+            pthread_mutex_unlock(&wq->lock);
+        }
+
+        /* writes out a finished shard and renames it into place, so readers never see a partial archive */
+        static void publish_shard(write_queue_t* wq, compressed_block_t* cb) {
+            shard_record_t* shard = cb->shard;
+            flush_staging_buffer(wq);
+            /* descriptor numbers are reused, so the next shard must not look like a continuation of this one */
+            wq->out_fd = -1;
+            if (close(shard->fd) == -1) {
+                int errsv = errno;
+                std::fprintf(stderr, "Error: Could not close shard [%s] (%s)\n", shard->tmp_fn.c_str(), std::strerror(errsv));
+                std::exit(errsv);
+            }
+            if (rename(shard->tmp_fn.c_str(), shard->fn.c_str()) == -1) {
+                int errsv = errno;
+                std::fprintf(stderr, "Error: Could not rename shard [%s] to [%s] (%s)\n", shard->tmp_fn.c_str(), shard->fn.c_str(), std::strerror(errsv));
+                std::exit(errsv);
+            }
+            shard->fd = -1;
+            shard->size = cb->offset;
+#ifdef DEBUG
+            std::fprintf(stderr, "Debug: Published shard [%s] of [%jd] bytes\n", shard->fn.c_str(), static_cast<intmax_t>( shard->size ));
+#endif
+        }
+
+        /*
+           Makes the archive durable through the blocks written so far, then replaces the checkpoint file
+           with the one carried by this block. The checkpoint is renamed into place, so an interruption
+           leaves either it or the previous one, and neither runs ahead of the archive.
+        */
+        static void commit_checkpoint(write_queue_t* wq, compressed_block_t* cb) {
+            std::string checkpoint_fn = self->get_checkpoint_fn();
+            std::string checkpoint_tmp_fn = checkpoint_fn + ".tmp";
+            size_t len = std::strlen(cb->checkpoint);
+            size_t written = 0;
+            ssize_t res = 0;
+            int checkpoint_fd = -1;
+            flush_staging_buffer(wq);
+            if (fdatasync(wq->out_fd) == -1) {
+                int errsv = errno;
+                std::fprintf(stderr, "Error: Could not flush output to disk (%s)\n", std::strerror(errsv));
+                std::exit(errsv);
+            }
+            checkpoint_fd = open(checkpoint_tmp_fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            while ((checkpoint_fd != -1) && (written < len)) {
+                res = write(checkpoint_fd, cb->checkpoint + written, len - written);
+                if ((res < 0) && (errno == EINTR)) {
+                    continue;
                 }
-                if (rem_len > 0) {
-                    sprintf(sb->tf_line, "%" PRId64 "%c%s\n", last_start_diff, field_delimiter, sb->bed->rem);
+                if (res < 0) {
+                    break;
                 }
-                else {
-                    sprintf(sb->tf_line, "%" PRId64 "\n", last_start_diff);
+                written += static_cast<size_t>( res );
+            }
+            if ((checkpoint_fd == -1) || (written < len) || (fsync(checkpoint_fd) == -1) || (close(checkpoint_fd) == -1) || (rename(checkpoint_tmp_fn.c_str(), checkpoint_fn.c_str()) == -1)) {
+                int errsv = errno;
+                std::fprintf(stderr, "Error: Could not write checkpoint [%s] (%s)\n", checkpoint_fn.c_str(), std::strerror(errsv));
+                std::exit(errsv);
+            }
+            free(cb->checkpoint);
+            cb->checkpoint = NULL;
+#ifdef DEBUG
+            std::fprintf(stderr, "Debug: Committed checkpoint at output offset [%jd]\n", static_cast<intmax_t>( cb->offset ));
+#endif
+        }
+
+        static void stage_compressed_block(write_queue_t* wq, compressed_block_t* cb) {
+            size_t block_pos = 0;
+            size_t staging_remaining = 0;
+            size_t n = 0;
+            struct stat out_stats;
+            if (cb->fd != wq->out_fd) {
+                flush_staging_buffer(wq);
+                wq->out_fd = cb->fd;
+                wq->out_fd_is_seekable = (fstat(wq->out_fd, &out_stats) == 0) && S_ISREG(out_stats.st_mode) && !(fcntl(wq->out_fd, F_GETFL) & O_APPEND);
+                wq->staging_offset = cb->offset;
+            }
+            /* blocks arrive in offset order, so they always extend the staged range */
+            while (block_pos < cb->size) {
+                staging_remaining = out_staging_length - wq->staging_size;
+                n = ((cb->size - block_pos) < staging_remaining) ? (cb->size - block_pos) : staging_remaining;
+                std::memcpy(wq->staging + wq->staging_size, cb->data + block_pos, n);
+                wq->staging_size += n;
+                block_pos += n;
+                if (wq->staging_size == out_staging_length) {
+                    flush_staging_buffer(wq);
                 }
-                //fprintf(stderr, "Encoding: [%s]\n", sb->tf_line);
-                append_tf_line_to_buffer(sb);
             }
-            else {
-                rem_len = (sb->bed->rem) ? static_cast<int64_t>( strlen(sb->bed->rem) ) : 0;
-                tf_line_len = static_cast<size_t>( n_digits(sb->tf_state->current_start) + 2 + rem_len );
-                if (sb->tf_line_capacity < tf_line_len) {
-                    new_tf_line = NULL;
-                    new_tf_line = static_cast<char*> ( realloc(sb->tf_line, sb->tf_line_capacity * 2) );
-                    if (!new_tf_line) {
-                        std::fprintf(stderr, "Error: Not enough memory for reallocation of transformation buffer line\n");
-                        std::exit(ENOMEM);
-                    }
-                    sb->tf_line = new_tf_line;
-                    sb->tf_line_capacity *= 2;
+        }
+
+        static void flush_staging_buffer(write_queue_t* wq) {
+            size_t written = 0;
+            ssize_t res = 0;
+#ifdef __linux__
+            /*
+               Space is reserved one step ahead of the writes, so that the archive is laid out contiguously.
+               FALLOC_FL_KEEP_SIZE leaves the file size to the writes themselves, so an interrupted run
+               leaves no more than the archive written so far, and the unused reservation is released by
+               ftruncate() in finalize_out_stream(). Filesystems that cannot preallocate (some network
+               mounts) are simply written without it.
+            */
+            while (wq->is_preallocating && (wq->preallocated_offset < wq->staging_offset + static_cast<off_t>( wq->staging_size ))) {
+                if (fallocate(wq->out_fd, FALLOC_FL_KEEP_SIZE, wq->preallocated_offset, static_cast<off_t>( out_preallocation_length )) != 0) {
+#ifdef DEBUG
+                    std::fprintf(stderr, "Debug: Preallocation of output at [%jd] failed (%s)\n", static_cast<intmax_t>( wq->preallocated_offset ), std::strerror(errno));
+#endif
+                    wq->is_preallocating = false;
+                    break;
                 }
-                if (rem_len > 0) {
-                    sprintf(sb->tf_line, "%" PRId64 "%c%s\n", sb->tf_state->current_start, field_delimiter, sb->bed->rem);
+                wq->preallocated_offset += static_cast<off_t>( out_preallocation_length );
+            }
+#endif
+            while (written < wq->staging_size) {
+                if (wq->out_fd_is_seekable) {
+                    res = pwrite(wq->out_fd, wq->staging + written, wq->staging_size - written, wq->staging_offset + static_cast<off_t>( written ));
                 }
                 else {
-                    sprintf(sb->tf_line, "%" PRId64 "\n", sb->tf_state->current_start);
+                    res = write(wq->out_fd, wq->staging + written, wq->staging_size - written);
+                }
+                if (res < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    int errsv = errno;
+                    std::fprintf(stderr, "Error: Could not write compressed data to output (%s)\n", std::strerror(errsv));
+                    std::exit(errsv);
                 }
-                //fprintf(stderr, "Encoding: [%s]\n", sb->tf_line);
-                append_tf_line_to_buffer(sb);
+                written += static_cast<size_t>( res );
             }
-            sb->tf_state->last_start = sb->tf_state->current_start;
-            sb->tf_state->last_stop = sb->tf_state->current_stop;
-            sb->tf_state->line_count++;
+            wq->staging_offset += static_cast<off_t>( wq->staging_size );
+            wq->staging_size = 0;
         }
 
-        static void initialize_transformation_state(starch3::Starch::transform_state_t** tfs) {
-            (*tfs)->line_count = 0;
-            (*tfs)->last_start = 0;
-            (*tfs)->last_stop = 0;
-            (*tfs)->last_coord_diff = 0;
-            (*tfs)->last_chr = NULL;
-            (*tfs)->current_start = 0;
-            (*tfs)->current_stop = 0;
-            (*tfs)->current_coord_diff = 0;
-            (*tfs)->current_chr = NULL;
-            (*tfs)->base_count_unique = 0;
-            (*tfs)->base_count_nonunique = 0;
-#ifdef DEBUG
-            std::fprintf(stderr, "--- starch3::Starch::initialize_transformation_state() ---\n");
-#endif
+        /* serializes metadata for the given streams, then the footer that locates it */
+        static void enqueue_archive_metadata(write_queue_t* wq, const std::vector<stream_record_t>& s, const std::string& note) {
+            compressed_block_t metadata_block;
+            compressed_block_t footer_block;
+            json_t* metadata = Archive::metadata_to_json(s, note);
+            char* metadata_str = json_dumps(metadata, JSON_COMPACT | JSON_PRESERVE_ORDER);
+            json_decref(metadata);
+            if (!metadata_str) {
+                std::fprintf(stderr, "Error: Could not serialize archive metadata\n");
+                std::exit(ENOMEM);
+            }
+            /* ownership of the json_dumps() buffer passes to the writer, which releases it with free() */
+            metadata_block.data = metadata_str;
+            metadata_block.size = std::strlen(metadata_str);
+            metadata_block.shard = NULL;
+            metadata_block.checkpoint = NULL;
+            uint32_t metadata_crc32c = CRC32C::update(0, metadata_block.data, metadata_block.size);
+            enqueue_compressed_block(wq, &metadata_block);
+            footer_block.data = static_cast<char*>( malloc(Archive::footer_length + 1) );
+            if (!footer_block.data) {
+                std::fprintf(stderr, "Error: Not enough memory for archive footer\n");
+                std::exit(ENOMEM);
+            }
+            Archive::format_footer(footer_block.data, metadata_block.offset, metadata_crc32c);
+            footer_block.size = Archive::footer_length;
+            footer_block.shard = NULL;
+            footer_block.checkpoint = NULL;
+            enqueue_compressed_block(wq, &footer_block);
         }
 
-        static void reset_transformation_state(starch3::Starch::transform_state_t** tfs) {
-            (*tfs)->line_count = 0;
-            (*tfs)->last_start = 0;
-            (*tfs)->last_stop = 0;
-            (*tfs)->last_coord_diff = 0;
-            (*tfs)->current_start = 0;
-            (*tfs)->current_stop = 0;
-            (*tfs)->current_coord_diff = 0;
-            (*tfs)->base_count_unique = 0;
-            (*tfs)->base_count_nonunique = 0;
-#ifdef DEBUG
-            std::fprintf(stderr, "--- starch3::Starch::reset_transformation_state() ---\n");
-#endif
+        static void enqueue_header_magic_bytes(write_queue_t* wq) {
+            compressed_block_t header_block;
+            header_block.data = static_cast<char*>( malloc(sizeof(Archive::header_magic_bytes)) );
+            if (!header_block.data) {
+                std::fprintf(stderr, "Error: Not enough memory for archive header\n");
+                std::exit(ENOMEM);
+            }
+            std::memcpy(header_block.data, Archive::header_magic_bytes, sizeof(Archive::header_magic_bytes));
+            header_block.size = sizeof(Archive::header_magic_bytes);
+            header_block.shard = NULL;
+            header_block.checkpoint = NULL;
+            enqueue_compressed_block(wq, &header_block);
         }
 
-        static void delete_transformation_state(starch3::Starch::transform_state_t** tfs) {
-            if ((*tfs)->last_chr)    { free((*tfs)->last_chr);    }
-            if ((*tfs)->current_chr) { free((*tfs)->current_chr); }
+        /* file name for a chromosome's shard; characters unsafe in paths are replaced, and collisions numbered */
+        static std::string shard_fn(const std::deque<shard_record_t>& shards, const char* chr) {
+            std::string base;
+            std::string fn;
+            char suffix[32] = {0};
+            for (const char* c = chr; *c != '\0'; c++) {
+                base.push_back((std::isalnum(static_cast<unsigned char>( *c )) || (*c == '_') || (*c == '-') || ((*c == '.') && (c != chr))) ? *c : '_');
+            }
+            fn = base + ".starch";
+            for (int n = 1; ; n++) {
+                bool is_taken = false;
+                for (std::deque<shard_record_t>::const_iterator s = shards.begin(); s != shards.end(); ++s) {
+                    if (s->fn.compare(s->fn.size() - std::min(s->fn.size(), fn.size() + 1), std::string::npos, "/" + fn) == 0) {
+                        is_taken = true;
+                        break;
+                    }
+                }
+                if (!is_taken) {
+                    return fn;
+                }
+                std::snprintf(suffix, sizeof(suffix), ".%d", n);
+                fn = base + suffix + ".starch";
+            }
         }
 
-        static inline void update_str(char** dest, char* src) {
-            if (*dest) {
-                free(*dest);
-                *dest = NULL;
+        /* opens the chromosome's shard and directs the writer stage to it */
+        static void begin_shard(shared_buffer_t* sb, ChrTable::chr_id_t chr_id) {
+            shard_record_t shard;
+            shard.chr = sb->chrs->name_str(chr_id);
+            shard.fn = self->get_shard_dir() + "/" + shard_fn(*sb->shards, shard.chr.c_str());
+            shard.tmp_fn = shard.fn + ".tmp";
+            shard.size = 0;
+            shard.fd = open(shard.tmp_fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (shard.fd == -1) {
+                int errsv = errno;
+                std::fprintf(stderr, "Error: Shard file handle could not be created [%s] (%s)\n", shard.tmp_fn.c_str(), std::strerror(errsv));
+                std::exit(errsv);
             }
-            if (!src) {
+            sb->shards->push_back(shard);
+            sb->open_shard = &sb->shards->back();
+            switch_output_file(sb->out_queue, shard.fd);
+            enqueue_header_magic_bytes(sb->out_queue);
+        }
+
+        /* completes the current chromosome's shard with its own metadata, then has the writer publish it */
+        static void finish_shard(shared_buffer_t* sb) {
+            compressed_block_t close_block;
+            if (!sb->shards) {
                 return;
             }
-            *dest = static_cast<char*>( std::malloc(std::strlen(src) + 1) );
-            if (!*dest) {
-                std::fprintf(stderr, "Error: Not enough memory for allocation of transformation buffer chromosome\n");
-                std::exit(ENOMEM);
+            /* the shard is opened as its first chunk is committed, and its metadata needs every chunk */
+            commit_pending_chunks(sb, 0);
+            if (!sb->open_shard) {
+                return;
             }
-            std::strncpy(*dest, src, std::strlen(src) + 1);
+            std::vector<stream_record_t> shard_streams(1, sb->streams->back());
+            enqueue_archive_metadata(sb->out_queue, shard_streams, self->get_note());
+            close_block.data = NULL;
+            close_block.size = 0;
+            close_block.shard = sb->open_shard;
+            close_block.checkpoint = NULL;
+            enqueue_compressed_block(sb->out_queue, &close_block);
+            sb->open_shard = NULL;
         }
 
-        static inline short n_digits(int64_t i) {
-            // IN64_MAX = 9223372036854775808LL;
-            if (i < 0) i = -i;
-            if (i <                  10) return  1;
-            if (i <                 100) return  2;
-            if (i <                1000) return  3;
-            if (i <               10000) return  4;
-            if (i <              100000) return  5;
-            if (i <             1000000) return  6;      
-            if (i <            10000000) return  7;
-            if (i <           100000000) return  8;
-            if (i <          1000000000) return  9;
-            if (i <         10000000000) return 10;
-            if (i <        100000000000) return 11;
-            if (i <       1000000000000) return 12;
-            if (i <      10000000000000) return 13;
-            if (i <     100000000000000) return 14;
-            if (i <    1000000000000000) return 15;
-            if (i <   10000000000000000) return 16;
-            if (i <  100000000000000000) return 17;
-            if (i < 1000000000000000000) return 18;
-            return 19;
+        /* adds the parsed record to the pending batch, noting where its line ends when checkpointing */
+        static void append_record(shared_buffer_t* sb) {
+            Encoder::append_to_batch(sb->batch, sb->bed->start, sb->bed->stop, sb->bed->rem, std::strlen(sb->bed->rem));
+            if (sb->is_checkpointing) {
+                input_mark_t mark = { sb->in_offset, sb->validation->line_count, sb->bed->start, sb->validation->error_count };
+                sb->batch_marks->push_back(mark);
+            }
+            if (sb->batch->starts.size() >= Encoder::batch_length) {
+                encode_batch(sb);
+            }
         }
 
-        static void bzip2_block_close_static_callback(void* s);
-    };
+        static double monotonic_seconds(void) {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return static_cast<double>( ts.tv_sec ) + (static_cast<double>( ts.tv_nsec ) / 1e9);
+        }
 
-    void Starch::initialize_shared_buffer(starch3::Starch::shared_buffer_t* sb) {
-        sb->next_in = 0;
-        sb->next_out = 0;
-        sb->is_new_line_available = false;
-        sb->is_new_chromosome_available = false;
-        sb->is_new_tf_buffer_available = false;
-        sb->is_eof = false;
-        sb->in_line = NULL;
-        sb->in_line = static_cast<char*>( malloc(starch3::Starch::in_line_initial_length) );
-        if (!sb->in_line) {
-            std::fprintf(stderr, "Error: Not enough memory for shared_buffer_t line character buffer\n");
-            std::exit(ENOMEM);
+        /*
+           Records progress through the chunk just enqueued: where the input resumes, how far the archive
+           reaches, and the metadata and validation errors so far. The writer commits it once the chunk is
+           on disk. Serializing the metadata grows with the archive, so checkpoints are spaced out to keep
+           their cost a small fraction of the run.
+        */
+        static void enqueue_checkpoint(shared_buffer_t* sb, const input_mark_t& tf_mark, off_t output_offset) {
+            compressed_block_t checkpoint_block;
+            double began = monotonic_seconds();
+            if (began < sb->checkpoint_due) {
+                return;
+            }
+            json_t* checkpoint = json_object();
+            json_t* progress = json_object();
+            json_t* error_array = json_array();
+            for (std::vector<validation_error_t>::const_iterator e = sb->validation->errors.begin(); e != sb->validation->errors.end(); ++e) {
+                /* lines past the mark are read again on resuming, and report their own errors then */
+                if (e->line > tf_mark.line_count) {
+                    continue;
+                }
+                json_t* error = json_object();
+                json_object_set_new(error, "line", json_integer(static_cast<json_int_t>( e->line )));
+                json_object_set_new(error, "type", json_string(validation_error_name(e->kind)));
+                json_object_set_new(error, "chromosome", json_string(e->chr.c_str()));
+                json_array_append_new(error_array, error);
+            }
+            json_object_set_new(progress, "input", json_string(self->get_input_fn().c_str()));
+            json_object_set_new(progress, "input_size", json_integer(static_cast<json_int_t>( sb->in_size )));
+            json_object_set_new(progress, "input_mtime", json_integer(static_cast<json_int_t>( sb->in_mtime )));
+            json_object_set_new(progress, "output", json_string(self->get_output_fn().c_str()));
+            json_object_set_new(progress, "input_offset", json_integer(static_cast<json_int_t>( tf_mark.offset )));
+            json_object_set_new(progress, "line_count", json_integer(static_cast<json_int_t>( tf_mark.line_count )));
+            json_object_set_new(progress, "last_start", json_integer(static_cast<json_int_t>( tf_mark.start )));
+            json_object_set_new(progress, "output_offset", json_integer(static_cast<json_int_t>( output_offset )));
+            json_object_set_new(progress, "error_count", json_integer(static_cast<json_int_t>( tf_mark.error_count )));
+            json_object_set_new(progress, "errors", error_array);
+            json_object_set_new(checkpoint, "checkpoint", progress);
+            json_object_set_new(checkpoint, "metadata", Archive::metadata_to_json(*sb->streams, self->get_note()));
+            checkpoint_block.checkpoint = json_dumps(checkpoint, JSON_COMPACT | JSON_PRESERVE_ORDER);
+            json_decref(checkpoint);
+            if (!checkpoint_block.checkpoint) {
+                std::fprintf(stderr, "Error: Could not serialize checkpoint\n");
+                std::exit(ENOMEM);
+            }
+            checkpoint_block.data = NULL;
+            checkpoint_block.size = 0;
+            checkpoint_block.shard = NULL;
+            enqueue_compressed_block(sb->out_queue, &checkpoint_block);
+            sb->checkpoint_due = monotonic_seconds();
+            sb->checkpoint_due += std::max(static_cast<double>( checkpoint_interval ), (sb->checkpoint_due - began) * checkpoint_cost_ratio);
         }
-        sb->in_line_capacity = starch3::Starch::in_line_initial_length;
-        sb->bed = static_cast<bed_t*>( malloc(sizeof(bed_t)) );
-        if (!sb->bed) {
-            std::fprintf(stderr, "Error: Could not allocate space for buffer BED line components\n");
-            std::exit(ENOMEM);
+
+        /*
+           Transforms the pending batch, compressing a chunk each time the tf buffer fills. Chromosomes
+           packed ahead of the current one go out first once it fills the buffer or grows too large to be
+           packed, so that no chromosome shares a chunk unless all of it fits there.
+        */
+        static void encode_batch(shared_buffer_t* sb) {
+            size_t from = 0;
+            while (from < sb->batch->starts.size()) {
+                from = sb->encoder->encode(*sb->batch, from, sb->tf_buffer);
+                sb->tf_state->line_count = sb->encoder->line_count();
+                if (sb->is_checkpointing && (from > 0)) {
+                    sb->tf_mark = (*sb->batch_marks)[from - 1];
+                }
+                if ((sb->tf_chr_offset > 0) && ((sb->tf_buffer->size() >= tf_buffer_chunk_length) || (sb->tf_buffer->size() - sb->tf_chr_offset >= packed_chr_max_length))) {
+                    flush_packed_chrs(sb);
+                }
+                if (sb->tf_buffer->size() >= tf_buffer_chunk_length) {
+                    sb->chr_tf_flushed += sb->tf_buffer->size();
+                    process_tf_buffer(sb);
+                }
+            }
+            Encoder::clear_batch(sb->batch);
+            sb->batch_marks->clear();
         }
-        sb->bed->chr = NULL;
-        sb->bed->chr = static_cast<char*>( malloc(starch3::Starch::in_field_initial_length) );
-        if (!sb->bed->chr) {
-            std::fprintf(stderr, "Error: Could not allocate space for buffer BED line chromosome field component\n");
-            std::exit(ENOMEM);
+
+        /*
+           Copies a reference archive chunk with the same transformed bytes instead of compressing them
+           again. The copy is only used if its checksums match the reference metadata.
+        */
+        static bool reuse_tf_buffer(shared_buffer_t* sb, chunk_record_t* cr, compressed_block_t* cb) {
+            reuse_index_t::const_iterator ref;
+            ssize_t res = 0;
+            size_t n = 0;
+            if (!sb->reuse_chunks) {
+                return false;
+            }
+            ref = sb->reuse_chunks->find(std::make_pair(cr->tf_hash, sb->tf_buffer->size()));
+            if ((ref == sb->reuse_chunks->end()) || (ref->second.tf_crc32c != cr->tf_crc32c)) {
+                return false;
+            }
+            cb->data = static_cast<char*>( malloc(ref->second.size) );
+            if (!cb->data) {
+                std::fprintf(stderr, "Error: Not enough memory for compressed block\n");
+                std::exit(ENOMEM);
+            }
+            while (n < ref->second.size) {
+                res = pread(sb->reuse_fd, cb->data + n, ref->second.size - n, ref->second.offset + static_cast<off_t>( n ));
+                if ((res < 0) && (errno == EINTR)) {
+                    continue;
+                }
+                if (res <= 0) {
+                    break;
+                }
+                n += static_cast<size_t>( res );
+            }
+            if ((n != ref->second.size) || (CRC32C::update(0, cb->data, n) != ref->second.compressed_crc32c)) {
+                free(cb->data);
+                cb->data = NULL;
+                return false;
+            }
+            cb->size = n;
+            cb->offset = 0;
+            cb->shard = NULL;
+            cb->checkpoint = NULL;
+            /* the copy keeps whatever compression the reference archive chose */
+            cr->codec = ref->second.codec;
+            cr->level = ref->second.level;
+            sb->reused_chunk_count++;
+            return true;
         }
-        sb->bed->chr_capacity = starch3::Starch::in_field_initial_length;
+
+        /* describes the current chromosome's span of the tf buffer, with its zone map from the encoder */
+        static void describe_chr_span(shared_buffer_t* sb, chunk_record_t* cr) {
+            cr->tf_offset = sb->tf_chr_offset;
+            cr->tf_size = sb->tf_buffer->size() - sb->tf_chr_offset;
+            cr->line_count = sb->encoder->line_count();
+            cr->min_start = sb->encoder->min_start();
+            cr->max_stop = sb->encoder->max_stop();
+            cr->base_count = sb->encoder->base_count();
+            cr->unique_base_count = sb->encoder->unique_base_count();
+            cr->tf_crc32c = CRC32C::update(0, sb->tf_buffer->data() + cr->tf_offset, cr->tf_size);
+            cr->tf_hash = 0;
+        }
+
+        /*
+           Ends the current chromosome. A chromosome smaller than packed_chr_max_length is left in the tf
+           buffer to share the next chunk, so that assemblies of many small contigs are not written as many
+           tiny bzip2 streams. Each chromosome keeps its own span and zone map in the metadata, and its
+           transformation state starts over, so it decodes alone. Larger chromosomes, tail included, get
+           chunks of their own, which keep the hashes that --reuse matches.
+        */
+        static void finish_chromosome(shared_buffer_t* sb) {
+            packed_chr_t pc;
+            encode_batch(sb);
+            sb->is_codec_chosen = false;
+            if (sb->is_eof || sb->shards || (sb->chr_tf_flushed + (sb->tf_buffer->size() - sb->tf_chr_offset) >= packed_chr_max_length)) {
+                process_tf_buffer(sb);
+                finish_shard(sb);
+                sb->chr_tf_flushed = 0;
+                return;
+            }
+            if (sb->tf_buffer->size() > sb->tf_chr_offset) {
+                pc.chr = sb->chrs->name_str(sb->tf_state->current_chr_id);
+                describe_chr_span(sb, &pc.cr);
+                pc.tf_mark = sb->tf_mark;
+                sb->packed_chrs->push_back(pc);
+                sb->tf_chr_offset = sb->tf_buffer->size();
+            }
+            reset_transformation_state(&sb->tf_state);
+            sb->encoder->reset();
+        }
+
+        /*
+           Hands the chromosomes packed ahead of the current one to the pool as a chunk of their own. The
+           current chromosome's bytes move to the start of the next chunk, as if it had begun there.
+        */
+        static void flush_packed_chrs(shared_buffer_t* sb) {
+            std::vector<char> chr_bytes(sb->tf_buffer->begin() + static_cast<std::ptrdiff_t>( sb->tf_chr_offset ), sb->tf_buffer->end());
+            sb->tf_buffer->resize(sb->tf_chr_offset);
+            submit_tf_buffer(sb, sb->packed_chrs->back().tf_mark);
+            /* under --auto, the packed chunk's choice of compression is not the current chromosome's */
+            sb->is_codec_chosen = false;
+            sb->packed_chrs->clear();
+            sb->tf_buffer->assign(chr_bytes.begin(), chr_bytes.end());
+            sb->tf_chr_offset = 0;
+        }
+
+        /* hands the tf buffer to the task pool as a chunk, and starts the next chunk */
+        static void process_tf_buffer(shared_buffer_t* sb) {
+            if (sb->tf_buffer) {
+                if (!sb->tf_buffer->empty()) {
+                    submit_tf_buffer(sb, sb->tf_mark);
+                }
+                sb->packed_chrs->clear();
+                sb->tf_chr_offset = 0;
+                reset_transformation_state(&sb->tf_state);
+                sb->encoder->reset();
+                sb->tf_buffer->clear();
+            }
+        }
+
+        /*
+           Hands the tf buffer to the task pool to be compressed, unless a reference archive already holds
+           the same bytes compressed, leaving the buffer empty. The chunk's records are completed once it
+           reaches the writer; tf_mark is where the input resumes after its last record.
+        */
+        static void submit_tf_buffer(shared_buffer_t* sb, const input_mark_t& tf_mark) {
+            pending_chunk_t* pc = new (std::nothrow) pending_chunk_t;
+            if (!pc) {
+                std::fprintf(stderr, "Error: Not enough memory for pending chunk\n");
+                std::exit(ENOMEM);
+            }
+            pc->is_compressed = false;
+            pc->chr_id = sb->tf_state->current_chr_id;
+            pc->tf_mark = tf_mark;
+            pc->cr.tf_crc32c = CRC32C::update(0, sb->tf_buffer->data(), sb->tf_buffer->size());
+            pc->cr.tf_hash = Hash64::hash(sb->tf_buffer->data(), sb->tf_buffer->size());
+            if (reuse_tf_buffer(sb, &pc->cr, &pc->cb)) {
+                pc->cr.compressed_crc32c = CRC32C::update(0, pc->cb.data, pc->cb.size);
+                pc->is_compressed = true;
+            }
+            else {
+                if (sb->is_auto && !sb->is_codec_chosen) {
+                    choose_codec(sb);
+                }
+                pc->cr.codec = sb->codec;
+                pc->cr.level = sb->level;
+            }
+            /* a chunk of one chromosome keeps its hash, so that --reuse can find it later */
+            if (sb->packed_chrs->empty()) {
+                pc->cr.tf_offset = 0;
+                pc->cr.tf_size = sb->tf_buffer->size();
+                pc->cr.line_count = sb->encoder->line_count();
+                pc->cr.min_start = sb->encoder->min_start();
+                pc->cr.max_stop = sb->encoder->max_stop();
+                pc->cr.base_count = sb->encoder->base_count();
+                pc->cr.unique_base_count = sb->encoder->unique_base_count();
+            }
+            else {
+                describe_chr_span(sb, &pc->cr);
+            }
+            pc->packed_chrs.swap(*sb->packed_chrs);
+            pc->tf.swap(*sb->tf_buffer);
+            sb->tf_buffer->reserve(tf_buffer_chunk_length * 2);
+            sb->pending_chunks->push_back(pc);
+            if (!pc->is_compressed) {
+                sb->pool->submit(compress_pending_chunk, pc, &pc->is_compressed);
+            }
+            commit_pending_chunks(sb, sb->max_pending_chunks);
+        }
+
+        /* task pool entry point: compresses a pending chunk with the codec chosen for it */
+        static void compress_pending_chunk(void* arg) {
+            pending_chunk_t* pc = static_cast<pending_chunk_t*>( arg );
+            std::string compress_error;
+            size_t out_capacity = Archive::compressed_bound(pc->tf.size());
+            pc->cb.data = static_cast<char*>( malloc(out_capacity) );
+            if (!pc->cb.data) {
+                std::fprintf(stderr, "Error: Not enough memory for compressed block\n");
+                std::exit(ENOMEM);
+            }
+            pc->cb.offset = 0;
+            pc->cb.shard = NULL;
+            pc->cb.checkpoint = NULL;
+            if (Archive::compress_chunk(pc->cr.codec, pc->cr.level, pc->tf.data(), pc->tf.size(), pc->cb.data, out_capacity, &pc->cb.size, &compress_error) != k_status_ok) {
+                std::fprintf(stderr, "Error: %s\n", compress_error.c_str());
+                std::exit(EINVAL);
+            }
+            pc->cr.compressed_crc32c = CRC32C::update(0, pc->cb.data, pc->cb.size);
+        }
+
+        /*
+           Passes compressed chunks to the writer in archive order, completing their metadata now that
+           their offsets are known. Chunks that are ready go straight away; while more than keep are
+           still pending, this waits on the oldest, compressing queued chunks in the meantime.
+        */
+        static void commit_pending_chunks(shared_buffer_t* sb, size_t keep) {
+            while (!sb->pending_chunks->empty()) {
+                pending_chunk_t* pc = sb->pending_chunks->front();
+                if (sb->pending_chunks->size() > keep) {
+                    sb->pool->wait(&pc->is_compressed);
+                }
+                else if (!sb->pool->is_done(&pc->is_compressed)) {
+                    break;
+                }
+                sb->pending_chunks->pop_front();
+#ifdef DEBUG
+                std::fprintf(stderr, "Debug: Chromosome [%s] lines [%" PRId64 "] transformed bytes [%zu] compressed bytes [%zu] shared with [%zu] earlier chromosome(s)\n", sb->chrs->name(pc->chr_id), pc->cr.line_count, pc->tf.size(), pc->cb.size, pc->packed_chrs.size());
+#endif
+                if (sb->shards && !sb->open_shard) {
+                    begin_shard(sb, pc->chr_id);
+                }
+                enqueue_compressed_block(sb->out_queue, &pc->cb);
+                pc->cr.offset = pc->cb.offset;
+                pc->cr.size = pc->cb.size;
+                for (std::vector<packed_chr_t>::iterator p = pc->packed_chrs.begin(); p != pc->packed_chrs.end(); ++p) {
+                    p->cr.offset = pc->cb.offset;
+                    p->cr.size = pc->cb.size;
+                    p->cr.compressed_crc32c = pc->cr.compressed_crc32c;
+                    p->cr.codec = pc->cr.codec;
+                    p->cr.level = pc->cr.level;
+                    Archive::append_chunk_record(sb->streams, p->chr.data(), p->chr.size(), p->cr);
+                }
+                /* the chunk's last chromosome may have had no valid records of its own */
+                if (pc->cr.tf_size > 0) {
+                    Archive::append_chunk_record(sb->streams, sb->chrs->name(pc->chr_id), sb->chrs->length(pc->chr_id), pc->cr);
+                }
+                if (sb->is_checkpointing && !sb->is_eof) {
+                    enqueue_checkpoint(sb, pc->tf_mark, pc->cb.offset + static_cast<off_t>( pc->cb.size ));
+                }
+                delete pc;
+            }
+        }
+
+        /*
+           Checks compressed chunks against their recorded checksums. Chromosomes packed into one chunk
+           each refer to it, but it is read and checksummed once, and the result goes to all of them.
+        */
+        static void* verify_chunks(void* arg) {
+            verify_state_t* vs = static_cast<verify_state_t*>( arg );
+            char* chunk_buffer = NULL;
+            size_t chunk_buffer_capacity = 0;
+            size_t job_idx = 0;
+            size_t chunk_pos = 0;
+            ssize_t res = 0;
+            for (;;) {
+                pthread_mutex_lock(&vs->lock);
+                job_idx = vs->next_job++;
+                pthread_mutex_unlock(&vs->lock);
+                if (job_idx >= vs->jobs->size()) {
+                    break;
+                }
+                verify_job_t& job = (*vs->jobs)[job_idx];
+                const chunk_record_t& cr = (*vs->streams)[job.parts.front().first].chunks[job.parts.front().second];
+                job.result = EXIT_SUCCESS;
+                if (chunk_buffer_capacity < cr.size) {
+                    free(chunk_buffer);
+                    chunk_buffer = static_cast<char*>( malloc(cr.size) );
+                    if (!chunk_buffer) {
+                        std::fprintf(stderr, "Error: Not enough memory for verification buffer\n");
+                        std::exit(ENOMEM);
+                    }
+                    chunk_buffer_capacity = cr.size;
+                }
+                for (chunk_pos = 0; chunk_pos < cr.size; chunk_pos += static_cast<size_t>( res )) {
+                    res = pread(vs->in_fd, chunk_buffer + chunk_pos, cr.size - chunk_pos, cr.offset + static_cast<off_t>( chunk_pos ));
+                    if (res <= 0) {
+                        if ((res < 0) && (errno == EINTR)) {
+                            res = 0;
+                            continue;
+                        }
+                        break;
+                    }
+                }
+                if (chunk_pos != cr.size) {
+                    std::fprintf(stderr, "Error: Chunk of [%s] at offset [%jd] is truncated\n", (*vs->streams)[job.parts.front().first].chr.c_str(), static_cast<intmax_t>( cr.offset ));
+                    job.result = EXIT_FAILURE;
+                    continue;
+                }
+                job.crc32c = CRC32C::update(0, chunk_buffer, cr.size);
+                for (std::vector<std::pair<size_t, size_t> >::const_iterator p = job.parts.begin(); p != job.parts.end(); ++p) {
+                    const stream_record_t& s = (*vs->streams)[p->first];
+                    if (job.crc32c != s.chunks[p->second].compressed_crc32c) {
+                        std::fprintf(stderr, "Error: Chunk of [%s] at offset [%jd] has checksum [%08x] (expected [%08x])\n", s.chr.c_str(), static_cast<intmax_t>( cr.offset ), job.crc32c, s.chunks[p->second].compressed_crc32c);
+                        job.result = EXIT_FAILURE;
+                    }
+                }
+            }
+            free(chunk_buffer);
+            return NULL;
+        }
+
+        /* writes the decimal form of a coordinate onto the end of a text buffer */
+        static inline void append_coordinate(std::vector<char>* out, int64_t v) {
+            size_t pos = out->size();
+            short len = n_digits(v);
+            uint64_t u = (v < 0) ? (~static_cast<uint64_t>( v ) + 1) : static_cast<uint64_t>( v );
+            if (v < 0) {
+                out->push_back('-');
+                pos++;
+            }
+            out->resize(pos + static_cast<size_t>( len ));
+            for (char* c = out->data() + pos + len - 1; ; c--) {
+                *c = static_cast<char>( '0' + (u % 10) );
+                u /= 10;
+                if (u == 0) {
+                    break;
+                }
+            }
+        }
+
+        static bool query_region_is_before(const query_region_t& a, const query_region_t& b) {
+            return (a.start < b.start) || ((a.start == b.start) && (a.stop < b.stop));
+        }
+
+        static bool query_region_stop_is_before(const query_region_t& r, int64_t start) {
+            return r.stop <= start;
+        }
+
+        /* whether any of the sorted, merged regions overlaps the chunk's coordinate range */
+        static bool overlaps_query_regions(const chunk_record_t& cr, const std::vector<query_region_t>& regions) {
+            std::vector<query_region_t>::const_iterator r = std::lower_bound(regions.begin(), regions.end(), cr.min_start, query_region_stop_is_before);
+            return (r != regions.end()) && Archive::chunk_overlaps(cr, r->start, r->stop);
+        }
+
+        static inline void append_bed_record(const std::string& chr, int64_t start, int64_t stop, const char* rem, size_t rem_length, std::vector<char>* out) {
+            out->insert(out->end(), chr.begin(), chr.end());
+            out->push_back(static_cast<char>( field_delimiter ));
+            append_coordinate(out, start);
+            out->push_back(static_cast<char>( field_delimiter ));
+            append_coordinate(out, stop);
+            if (rem_length > 0) {
+                out->push_back(static_cast<char>( field_delimiter ));
+                out->insert(out->end(), rem, rem + rem_length);
+            }
+            out->push_back(static_cast<char>( line_delimiter ));
+        }
+
+        /* appends a decoded chunk's records as BED text, keeping only those overlapping the sorted, merged regions, if given */
+        static status_t append_bed_records(const std::string& chr, const char* tf, size_t tf_size, int64_t line_count, const std::vector<query_region_t>* regions, std::vector<char>* out) {
+            std::vector<query_region_t>::const_iterator region;
+            int64_t start = 0;
+            int64_t stop = 0;
+            const char* rem = NULL;
+            size_t rem_length = 0;
+            status_t res = k_status_ok;
+            /* decoded text is roughly the transformed size plus the chromosome name on every line */
+            if (!regions) {
+                out->reserve(out->size() + tf_size + static_cast<size_t>( line_count ) * (chr.size() + 2 * n_digits(INT32_MAX)));
+            }
+            else {
+                region = regions->begin();
+            }
+            ChunkCursor cursor(tf, tf_size);
+            while ((res = cursor.next(&start, &stop, &rem, &rem_length)) == k_status_ok) {
+                if (regions) {
+                    /* records are sorted by start, so regions ending at or before this start are done with */
+                    while ((region != regions->end()) && (region->stop <= start)) {
+                        ++region;
+                    }
+                    if (region == regions->end()) {
+                        break;
+                    }
+                    if (region->start >= stop) {
+                        continue;
+                    }
+                }
+                append_bed_record(chr, start, stop, rem, rem_length, out);
+            }
+            return (res == k_status_error) ? k_status_error : k_status_ok;
+        }
+
+        /* whether any of the sorted, merged ordinal ranges holds one of the chunk's records */
+        static bool overlaps_record_ranges(const chunk_record_t& cr, const std::vector<query_region_t>& records) {
+            std::vector<query_region_t>::const_iterator r = std::lower_bound(records.begin(), records.end(), cr.first_record, query_region_stop_is_before);
+            return (r != records.end()) && (r->start < cr.first_record + cr.line_count);
+        }
+
+        /* appends the decoded chunk's records whose archive-wide ordinals fall in the sorted, merged ranges */
+        static status_t append_selected_bed_records(const std::string& chr, const char* tf, size_t tf_size, int64_t first_record, const std::vector<query_region_t>& records, std::vector<char>* out) {
+            std::vector<query_region_t>::const_iterator r = std::lower_bound(records.begin(), records.end(), first_record, query_region_stop_is_before);
+            int64_t start = 0;
+            int64_t stop = 0;
+            const char* rem = NULL;
+            size_t rem_length = 0;
+            status_t res = k_status_ok;
+            ChunkCursor cursor(tf, tf_size);
+            /* records are delta-coded, so those before a kept one are decoded but not written */
+            for (int64_t ordinal = first_record; (r != records.end()) && ((res = cursor.next(&start, &stop, &rem, &rem_length)) == k_status_ok); ordinal++) {
+                if (ordinal < r->start) {
+                    continue;
+                }
+                append_bed_record(chr, start, stop, rem, rem_length, out);
+                if (ordinal + 1 == r->stop) {
+                    ++r;
+                }
+            }
+            return (res == k_status_error) ? k_status_error : k_status_ok;
+        }
+
+        /* reads, checks and decodes one chunk back to BED text, once for all the chromosome spans it holds */
+        static bool extract_chunk(extract_state_t* es, const extract_job_t& job, std::vector<char>* compressed, std::vector<char>* tf, std::vector<char>* out) {
+            std::string chunk_error;
+            size_t tf_end = 0;
+            status_t res = k_status_ok;
+            out->clear();
+            for (std::vector<extract_part_t>::const_iterator p = job.parts.begin(); p != job.parts.end(); ++p) {
+                const chunk_record_t& cr = (*es->streams)[p->stream_idx].chunks[p->chunk_idx];
+                tf_end = std::max(tf_end, cr.tf_offset + cr.tf_size);
+            }
+            const extract_part_t& first = job.parts.front();
+            const stream_record_t& fs = (*es->streams)[first.stream_idx];
+            if (Archive::read_chunk_prefix(es->in_fd, fs.chunks[first.chunk_idx], tf_end, compressed, tf, &chunk_error) != k_status_ok) {
+                std::fprintf(stderr, "Error: Chunk of [%s] at offset [%jd] could not be read (%s)\n", fs.chr.c_str(), static_cast<intmax_t>( fs.chunks[first.chunk_idx].offset ), chunk_error.c_str());
+                return false;
+            }
+            for (std::vector<extract_part_t>::const_iterator p = job.parts.begin(); p != job.parts.end(); ++p) {
+                const stream_record_t& s = (*es->streams)[p->stream_idx];
+                const chunk_record_t& cr = s.chunks[p->chunk_idx];
+                if (CRC32C::update(0, tf->data() + cr.tf_offset, cr.tf_size) != cr.tf_crc32c) {
+                    std::fprintf(stderr, "Error: Chunk of [%s] at offset [%jd] could not be read (Transformed chunk checksum does not match metadata)\n", s.chr.c_str(), static_cast<intmax_t>( cr.offset ));
+                    return false;
+                }
+                if (p->records) {
+                    res = append_selected_bed_records(s.chr, tf->data() + cr.tf_offset, cr.tf_size, cr.first_record, *p->records, out);
+                }
+                else {
+                    res = append_bed_records(s.chr, tf->data() + cr.tf_offset, cr.tf_size, cr.line_count, p->regions, out);
+                }
+                if (res != k_status_ok) {
+                    std::fprintf(stderr, "Error: Chunk of [%s] at offset [%jd] is malformed\n", s.chr.c_str(), static_cast<intmax_t>( cr.offset ));
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        /* claims chunks in archive order and decodes each into its reorder slot, once the writer has freed it */
+        static void* extract_chunks(void* arg) {
+            extract_state_t* es = static_cast<extract_state_t*>( arg );
+            std::vector<char> compressed;
+            std::vector<char> tf;
+            size_t job_idx = 0;
+            size_t n_slots = es->slots->size();
+            for (;;) {
+                pthread_mutex_lock(&es->lock);
+                job_idx = es->next_job++;
+                while (!es->is_failed && (job_idx < es->jobs->size()) && (job_idx >= es->next_out + n_slots)) {
+                    pthread_cond_wait(&es->slot_is_free, &es->lock);
+                }
+                if (es->is_failed || (job_idx >= es->jobs->size())) {
+                    pthread_mutex_unlock(&es->lock);
+                    break;
+                }
+                pthread_mutex_unlock(&es->lock);
+                /* the slot's previous job has been written, so this worker owns it until the flag is set */
+                bool is_decoded = extract_chunk(es, (*es->jobs)[job_idx], &compressed, &tf, &(*es->slots)[job_idx % n_slots]);
+                pthread_mutex_lock(&es->lock);
+                if (is_decoded) {
+                    (*es->slot_is_full)[job_idx % n_slots] = 1;
+                }
+                else {
+                    es->is_failed = true;
+                    pthread_cond_broadcast(&es->slot_is_free);
+                }
+                pthread_cond_broadcast(&es->slot_is_ready);
+                pthread_mutex_unlock(&es->lock);
+            }
+            return NULL;
+        }
+
+        /* rounds up to the alignment of columnar arrays, which suits vector loads from a mapped file */
+        static inline uint64_t align_columnar_offset(uint64_t offset) {
+            return (offset + Archive::columnar_alignment - 1) & ~static_cast<uint64_t>( Archive::columnar_alignment - 1 );
+        }
+
+        static bool pwrite_fully(int fd, const char* buf, size_t len, off_t offset) {
+            ssize_t res = 0;
+            while (len > 0) {
+                res = pwrite(fd, buf, len, offset);
+                if (res < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return false;
+                }
+                buf += res;
+                len -= static_cast<size_t>( res );
+                offset += static_cast<off_t>( res );
+            }
+            return true;
+        }
+
+        /* decodes one chunk's coordinates and writes them to their fixed places in the columnar arrays, once for all the chromosome spans it holds */
+        static bool export_chunk(export_state_t* es, const export_job_t& job, std::vector<char>* compressed, std::vector<char>* tf, std::vector<int64_t>* starts, std::vector<int64_t>* stops, std::vector<int32_t>* narrowed) {
+            std::string chunk_error;
+            size_t tf_end = 0;
+            int64_t start = 0;
+            int64_t stop = 0;
+            const char* rem = NULL;
+            size_t rem_length = 0;
+            status_t res = k_status_ok;
+            for (std::vector<export_part_t>::const_iterator p = job.parts.begin(); p != job.parts.end(); ++p) {
+                const chunk_record_t& cr = (*es->streams)[p->stream_idx].chunks[p->chunk_idx];
+                tf_end = std::max(tf_end, cr.tf_offset + cr.tf_size);
+            }
+            const export_part_t& first = job.parts.front();
+            const stream_record_t& fs = (*es->streams)[first.stream_idx];
+            if (Archive::read_chunk_prefix(es->in_fd, fs.chunks[first.chunk_idx], tf_end, compressed, tf, &chunk_error) != k_status_ok) {
+                std::fprintf(stderr, "Error: Chunk of [%s] at offset [%jd] could not be read (%s)\n", fs.chr.c_str(), static_cast<intmax_t>( fs.chunks[first.chunk_idx].offset ), chunk_error.c_str());
+                return false;
+            }
+            for (std::vector<export_part_t>::const_iterator p = job.parts.begin(); p != job.parts.end(); ++p) {
+                const stream_record_t& s = (*es->streams)[p->stream_idx];
+                const chunk_record_t& cr = s.chunks[p->chunk_idx];
+                if (CRC32C::update(0, tf->data() + cr.tf_offset, cr.tf_size) != cr.tf_crc32c) {
+                    std::fprintf(stderr, "Error: Chunk of [%s] at offset [%jd] could not be read (Transformed chunk checksum does not match metadata)\n", s.chr.c_str(), static_cast<intmax_t>( cr.offset ));
+                    return false;
+                }
+                starts->clear();
+                stops->clear();
+                ChunkCursor cursor(tf->data() + cr.tf_offset, cr.tf_size);
+                while ((res = cursor.next(&start, &stop, &rem, &rem_length)) == k_status_ok) {
+                    starts->push_back(start);
+                    stops->push_back(stop);
+                }
+                /* the arrays were laid out from the metadata's counts, so a chunk that disagrees would overwrite its neighbours */
+                if ((res == k_status_error) || (static_cast<int64_t>( starts->size() ) != cr.line_count)) {
+                    std::fprintf(stderr, "Error: Chunk of [%s] at offset [%jd] is malformed\n", s.chr.c_str(), static_cast<intmax_t>( cr.offset ));
+                    return false;
+                }
+                bool is_written = true;
+                if (p->width == sizeof(int32_t)) {
+                    narrowed->resize(starts->size());
+                    for (size_t idx = 0; idx < starts->size(); idx++) {
+                        (*narrowed)[idx] = static_cast<int32_t>( (*starts)[idx] );
+                    }
+                    is_written = pwrite_fully(es->out_fd, reinterpret_cast<const char*>( narrowed->data() ), narrowed->size() * sizeof(int32_t), p->starts_offset);
+                    for (size_t idx = 0; idx < stops->size(); idx++) {
+                        (*narrowed)[idx] = static_cast<int32_t>( (*stops)[idx] );
+                    }
+                    is_written = is_written && pwrite_fully(es->out_fd, reinterpret_cast<const char*>( narrowed->data() ), narrowed->size() * sizeof(int32_t), p->stops_offset);
+                }
+                else {
+                    is_written = pwrite_fully(es->out_fd, reinterpret_cast<const char*>( starts->data() ), starts->size() * sizeof(int64_t), p->starts_offset)
+                        && pwrite_fully(es->out_fd, reinterpret_cast<const char*>( stops->data() ), stops->size() * sizeof(int64_t), p->stops_offset);
+                }
+                if (!is_written) {
+                    int errsv = errno;
+                    std::fprintf(stderr, "Error: Could not write columnar output (%s)\n", std::strerror(errsv));
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        /* claims chunks in archive order; every chunk has its own place in the output, so workers write without waiting on each other */
+        static void* export_chunks(void* arg) {
+            export_state_t* es = static_cast<export_state_t*>( arg );
+            std::vector<char> compressed;
+            std::vector<char> tf;
+            std::vector<int64_t> starts;
+            std::vector<int64_t> stops;
+            std::vector<int32_t> narrowed;
+            size_t job_idx = 0;
+            for (;;) {
+                pthread_mutex_lock(&es->lock);
+                job_idx = es->next_job++;
+                if (es->is_failed || (job_idx >= es->jobs->size())) {
+                    pthread_mutex_unlock(&es->lock);
+                    break;
+                }
+                pthread_mutex_unlock(&es->lock);
+                if (!export_chunk(es, (*es->jobs)[job_idx], &compressed, &tf, &starts, &stops, &narrowed)) {
+                    pthread_mutex_lock(&es->lock);
+                    es->is_failed = true;
+                    pthread_mutex_unlock(&es->lock);
+                    break;
+                }
+            }
+            return NULL;
+        }
+
+        /* whether a chunk lies inside the window, so the chunk's zone map answers for it without decoding */
+        static inline bool window_contains_chunk(const query_region_t& w, const chunk_record_t& cr) {
+            return (cr.base_count >= 0) && (w.start <= cr.min_start) && (w.stop >= cr.max_stop);
+        }
+
+        /* index of the first window that could overlap a record starting at start */
+        static inline size_t first_candidate_window(const std::vector<query_region_t>& windows, int64_t start, int64_t max_window_length) {
+            query_region_t key;
+            key.start = start - max_window_length;
+            key.stop = INT64_MIN;
+            return static_cast<size_t>( std::lower_bound(windows.begin(), windows.end(), key, query_region_is_before) - windows.begin() );
+        }
+
+        /* decodes chunks that straddle window boundaries, tallying their records against the windows they overlap */
+        static void* summarize_chunks(void* arg) {
+            summary_state_t* ss = static_cast<summary_state_t*>( arg );
+            std::vector<char> compressed;
+            std::vector<char> tf;
+            std::string chunk_error;
+            off_t tf_chunk_offset = -1;
+            bool chunk_is_readable = true;
+            size_t job_idx = 0;
+            int64_t start = 0;
+            int64_t stop = 0;
+            const char* rem = NULL;
+            size_t rem_length = 0;
+            status_t res = k_status_ok;
+            pthread_mutex_lock(&ss->lock);
+            std::vector<summary_totals_t>& totals = (*ss->worker_totals)[ss->next_worker++];
+            pthread_mutex_unlock(&ss->lock);
+            for (;;) {
+                pthread_mutex_lock(&ss->lock);
+                job_idx = ss->next_job++;
+                if (ss->is_failed || (job_idx >= ss->jobs->size())) {
+                    pthread_mutex_unlock(&ss->lock);
+                    break;
+                }
+                pthread_mutex_unlock(&ss->lock);
+                const summary_job_t& job = (*ss->jobs)[job_idx];
+                const stream_record_t& s = (*ss->streams)[job.stream_idx];
+                const chunk_record_t& cr = s.chunks[job.chunk_idx];
+                const std::vector<query_region_t>& windows = *job.windows;
+                /* a chunk shared by packed chromosomes is decoded once, through the last of them, and kept for their jobs */
+                if ((cr.offset != tf_chunk_offset) || (cr.tf_offset + cr.tf_size > tf.size())) {
+                    size_t tf_end = cr.tf_offset + cr.tf_size;
+                    for (size_t idx = job.stream_idx + 1; (idx < ss->streams->size()) && ((*ss->streams)[idx].chunks.size() > 0) && ((*ss->streams)[idx].chunks[0].offset == cr.offset); idx++) {
+                        tf_end = std::max(tf_end, (*ss->streams)[idx].chunks[0].tf_offset + (*ss->streams)[idx].chunks[0].tf_size);
+                    }
+                    tf_chunk_offset = -1;
+                    if (Archive::read_chunk_prefix(ss->in_fd, cr, tf_end, &compressed, &tf, &chunk_error) != k_status_ok) {
+                        chunk_is_readable = false;
+                    }
+                    else {
+                        tf_chunk_offset = cr.offset;
+                    }
+                }
+                if (chunk_is_readable && (CRC32C::update(0, tf.data() + cr.tf_offset, cr.tf_size) != cr.tf_crc32c)) {
+                    chunk_error.assign("Transformed chunk checksum does not match metadata");
+                    chunk_is_readable = false;
+                }
+                if (!chunk_is_readable) {
+                    std::fprintf(stderr, "Error: Chunk of [%s] at offset [%jd] could not be read (%s)\n", s.chr.c_str(), static_cast<intmax_t>( cr.offset ), chunk_error.c_str());
+                    pthread_mutex_lock(&ss->lock);
+                    ss->is_failed = true;
+                    pthread_mutex_unlock(&ss->lock);
+                    break;
+                }
+                ChunkCursor cursor(tf.data() + cr.tf_offset, cr.tf_size);
+                size_t lo = first_candidate_window(windows, cr.min_start, job.max_window_length);
+                while ((res = cursor.next(&start, &stop, &rem, &rem_length)) == k_status_ok) {
+                    /* starts are sorted, so windows too far behind this record are behind all later ones */
+                    while ((lo < windows.size()) && (windows[lo].start < start - job.max_window_length)) {
+                        lo++;
+                    }
+                    for (size_t w = lo; (w < windows.size()) && (windows[w].start < stop); w++) {
+                        if ((windows[w].stop <= start) || window_contains_chunk(windows[w], cr)) {
+                            continue;
+                        }
+                        totals[job.window_offset + w].count++;
+                        totals[job.window_offset + w].bases += std::min(stop, windows[w].stop) - std::max(start, windows[w].start);
+                    }
+                }
+                if (res == k_status_error) {
+                    std::fprintf(stderr, "Error: Chunk of [%s] at offset [%jd] is malformed\n", s.chr.c_str(), static_cast<intmax_t>( cr.offset ));
+                    pthread_mutex_lock(&ss->lock);
+                    ss->is_failed = true;
+                    pthread_mutex_unlock(&ss->lock);
+                    break;
+                }
+            }
+            return NULL;
+        }
+
+        /* parses "start-stop", ignoring thousands separators, into a non-empty half-open range */
+        static bool parse_range(const std::string& s, query_region_t* r) {
+            std::string range;
+            char* end_ptr = NULL;
+            for (std::string::size_type idx = 0; idx < s.size(); idx++) {
+                if (s[idx] != ',') {
+                    range.push_back(s[idx]);
+                }
+            }
+            errno = 0;
+            r->start = std::strtoll(range.c_str(), &end_ptr, 10);
+            if ((end_ptr == range.c_str()) || (*end_ptr != '-') || (errno != 0)) {
+                return false;
+            }
+            const char* stop_str = end_ptr + 1;
+            r->stop = std::strtoll(stop_str, &end_ptr, 10);
+            return (end_ptr != stop_str) && (*end_ptr == '\0') && (errno == 0) && (r->start >= 0) && (r->start < r->stop);
+        }
+
+        /* parses chr:start-stop, with optional thousands separators, or a bare chr for the whole chromosome */
+        static bool parse_query_region(std::string s, std::string* chr, query_region_t* r) {
+            std::string::size_type colon = s.rfind(':');
+            r->start = 0;
+            r->stop = INT64_MAX;
+            if (colon != std::string::npos) {
+                if (!parse_range(s.substr(colon + 1), r)) {
+                    return false;
+                }
+                s.erase(colon);
+            }
+            chr->assign(s);
+            return !chr->empty();
+        }
+
+        static void handle_serve_signal(int) {
+            self->serve_is_stopping = 1;
+        }
+
+        static bool send_fully(int fd, const char* buf, size_t len) {
+            ssize_t res = 0;
+            while (len > 0) {
+                res = send(fd, buf, len, 0);
+                if (res < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return false;
+                }
+                buf += res;
+                len -= static_cast<size_t>( res );
+            }
+            return true;
+        }
+
+        /* returns a chunk's decoded bytes, from the cache or by decoding it from the mapped archive */
+        static status_t fetch_served_chunk(serve_state_t* ss, size_t archive_idx, const chunk_record_t& cr, ChunkCache::chunk_ptr_t* chunk, std::string* error) {
+            const served_archive_t& a = (*ss->archives)[archive_idx];
+            ChunkCache::chunk_key_t key(archive_idx, std::make_pair(cr.offset, cr.tf_offset));
+            *chunk = ss->cache->acquire(key);
+            if (*chunk) {
+                return k_status_ok;
+            }
+            if ((cr.offset < 0) || (static_cast<size_t>( cr.offset ) + cr.size > a.map_size)) {
+                error->assign("Chunk lies outside the archive");
+                ss->cache->abandon(key);
+                return k_status_error;
+            }
+            std::shared_ptr<std::vector<char> > tf = std::make_shared<std::vector<char> >();
+            if (Archive::decode_chunk(a.map + cr.offset, cr, tf.get(), error) != k_status_ok) {
+                ss->cache->abandon(key);
+                return k_status_error;
+            }
+            *chunk = tf;
+            ss->cache->insert(key, *chunk);
+            return k_status_ok;
+        }
+
+        /*
+           Answers one request line. Requests are:
+
+             query [archive] chr:start-stop   records overlapping the region
+             streams [archive]                chromosome, line count, chunk count, transformed and compressed
+                                              sizes, and count of chunks shared with other chromosomes
+             stats                            decoded-chunk cache counters
+
+           A chunk shared by packed chromosomes counts toward the compressed size of only the first
+           stream that holds it, so that the sizes sum to the archive's chunks. The archive defaults to
+           the first one served. A reply is "OK <length>" and a newline,
+           followed by exactly that many bytes, or "ERR <message>" and a newline.
+        */
+        static void answer_request(serve_state_t* ss, const std::string& request, std::vector<char>* reply) {
+            std::vector<std::string> args;
+            std::vector<char> body;
+            std::string error;
+            std::string chr;
+            std::vector<query_region_t> regions(1);
+            size_t archive_idx = 0;
+            char header[64] = {0};
+            for (std::string::size_type pos = request.find_first_not_of(" \t"); pos != std::string::npos; pos = request.find_first_not_of(" \t", pos)) {
+                std::string::size_type end = request.find_first_of(" \t", pos);
+                args.push_back(request.substr(pos, end - pos));
+                pos = end;
+            }
+            if (((args.size() == 3) && (args[0] == "query")) || ((args.size() == 2) && (args[0] == "streams"))) {
+                for (archive_idx = 0; archive_idx < ss->archives->size(); archive_idx++) {
+                    if ((*ss->archives)[archive_idx].fn == args[1]) {
+                        break;
+                    }
+                }
+                if (archive_idx == ss->archives->size()) {
+                    error.assign("Archive is not served");
+                }
+                args.erase(args.begin() + 1);
+            }
+            if (!error.empty()) {
+                /* reported below */
+            }
+            else if ((args.size() == 2) && (args[0] == "query")) {
+                if (!parse_query_region(args[1], &chr, &regions[0])) {
+                    error.assign("Query is not of the form chr:start-stop");
+                }
+                const served_archive_t& a = (*ss->archives)[archive_idx];
+                ChrTable::chr_id_t chr_id = a.chrs.find(chr);
+                for (std::vector<stream_record_t>::const_iterator s = a.streams.begin(); error.empty() && (s != a.streams.end()); ++s) {
+                    if (a.stream_chrs[s - a.streams.begin()] != chr_id) {
+                        continue;
+                    }
+                    for (std::vector<chunk_record_t>::const_iterator c = s->chunks.begin(); c != s->chunks.end(); ++c) {
+                        ChunkCache::chunk_ptr_t chunk;
+                        if (!Archive::chunk_overlaps(*c, regions[0].start, regions[0].stop)) {
+                            continue;
+                        }
+                        if (fetch_served_chunk(ss, archive_idx, *c, &chunk, &error) != k_status_ok) {
+                            break;
+                        }
+                        if (append_bed_records(s->chr, chunk->data(), chunk->size(), c->line_count, &regions, &body) != k_status_ok) {
+                            error.assign("Chunk is malformed");
+                            break;
+                        }
+                    }
+                }
+            }
+            else if ((args.size() == 1) && (args[0] == "streams")) {
+                const served_archive_t& a = (*ss->archives)[archive_idx];
+                std::map<off_t, size_t> chunk_refs;
+                for (std::vector<stream_record_t>::const_iterator s = a.streams.begin(); s != a.streams.end(); ++s) {
+                    for (std::vector<chunk_record_t>::const_iterator c = s->chunks.begin(); c != s->chunks.end(); ++c) {
+                        chunk_refs[c->offset]++;
+                    }
+                }
+                for (std::vector<stream_record_t>::const_iterator s = a.streams.begin(); s != a.streams.end(); ++s) {
+                    char line[512] = {0};
+                    uint64_t size = 0;
+                    size_t shared_chunks = 0;
+                    for (std::vector<chunk_record_t>::const_iterator c = s->chunks.begin(); c != s->chunks.end(); ++c) {
+                        size_t& refs = chunk_refs[c->offset];
+                        shared_chunks += (refs != 1) ? 1 : 0;
+                        if (refs > 0) {
+                            size += c->size;
+                            /* later streams holding the chunk find it counted */
+                            refs = 0;
+                        }
+                    }
+                    int n = std::snprintf(line, sizeof(line), "%s\t%" PRId64 "\t%zu\t%" PRIu64 "\t%" PRIu64 "\t%zu\n", s->chr.c_str(), s->line_count, s->chunks.size(), s->tf_size, size, shared_chunks);
+                    body.insert(body.end(), line, line + std::min(static_cast<size_t>( n ), sizeof(line) - 1));
+                }
+            }
+            else if ((args.size() == 1) && (args[0] == "stats")) {
+                ChunkCache::stats_t cs = ss->cache->stats();
+                char lines[512] = {0};
+                uint64_t lookups = cs.hits + cs.misses;
+                int n = std::snprintf(lines, sizeof(lines), "hits\t%" PRIu64 "\nmisses\t%" PRIu64 "\nhit_rate\t%.4f\nevictions\t%" PRIu64 "\nentries\t%zu\nsize\t%zu\ncapacity\t%zu\n",
+                                      cs.hits, cs.misses, (lookups > 0) ? static_cast<double>( cs.hits ) / static_cast<double>( lookups ) : 0.0, cs.evictions, cs.entries, cs.size, cs.capacity);
+                body.insert(body.end(), lines, lines + std::min(static_cast<size_t>( n ), sizeof(lines) - 1));
+            }
+            else {
+                error.assign("Unknown request");
+            }
+            reply->clear();
+            if (!error.empty()) {
+                error.insert(0, "ERR ");
+                error.push_back('\n');
+                reply->insert(reply->end(), error.begin(), error.end());
+                return;
+            }
+            std::snprintf(header, sizeof(header), "OK %zu\n", body.size());
+            reply->insert(reply->end(), header, header + std::strlen(header));
+            reply->insert(reply->end(), body.begin(), body.end());
+        }
+
+        /* serves queued connections one request line at a time, until the client hangs up or the server stops */
+        static void* serve_connections(void* arg) {
+            serve_state_t* ss = static_cast<serve_state_t*>( arg );
+            std::vector<char> reply;
+            std::string pending;
+            char buf[4096];
+            ssize_t res = 0;
+            int fd = -1;
+            for (;;) {
+                pthread_mutex_lock(&ss->lock);
+                while (!ss->is_stopping && ss->connections.empty()) {
+                    pthread_cond_wait(&ss->connection_is_available, &ss->lock);
+                }
+                if (ss->is_stopping) {
+                    pthread_mutex_unlock(&ss->lock);
+                    break;
+                }
+                fd = ss->connections.front();
+                ss->connections.pop_front();
+                ss->active.insert(fd);
+                pthread_mutex_unlock(&ss->lock);
+                pending.clear();
+                bool is_open = true;
+                while (is_open && ((res = recv(fd, buf, sizeof(buf), 0)) != 0)) {
+                    if (res < 0) {
+                        if (errno == EINTR) {
+                            continue;
+                        }
+                        break;
+                    }
+                    pending.append(buf, static_cast<size_t>( res ));
+                    std::string::size_type eol = 0;
+                    while (is_open && ((eol = pending.find('\n')) != std::string::npos)) {
+                        std::string request = pending.substr(0, eol);
+                        pending.erase(0, eol + 1);
+                        if (!request.empty() && (request[request.size() - 1] == '\r')) {
+                            request.erase(request.size() - 1);
+                        }
+                        if (request == "quit") {
+                            is_open = false;
+                            break;
+                        }
+                        answer_request(ss, request, &reply);
+                        is_open = send_fully(fd, reply.data(), reply.size());
+                    }
+                    if (pending.size() > serve_max_request_length) {
+                        static const char too_long[] = "ERR Request is too long\n";
+                        send_fully(fd, too_long, sizeof(too_long) - 1);
+                        is_open = false;
+                    }
+                }
+                pthread_mutex_lock(&ss->lock);
+                ss->active.erase(fd);
+                pthread_mutex_unlock(&ss->lock);
+                close(fd);
+            }
+            return NULL;
+        }
+
+        /*
+           Moves a source to its next record, reading the next chunk when the current one is used up. A
+           chunk that small chromosomes share is decoded once, as far as the last of their spans, and left
+           in the worker's buffer for the chromosomes after this one.
+        */
+        static status_t advance_merge_source(merge_source_t* src, std::string* error) {
+            status_t res = k_status_ok;
+            const std::vector<stream_record_t>& streams = src->archive->streams;
+            for (;;) {
+                if (src->is_reading) {
+                    res = src->cursor.next(&src->start, &src->stop, &src->rem, &src->rem_length);
+                    if (res != k_status_end) {
+                        if (res == k_status_error) {
+                            error->assign("Malformed transformed data");
+                        }
+                        return res;
+                    }
+                    src->is_reading = false;
+                    src->chunk_idx++;
+                }
+                if (src->chunk_idx >= streams[src->stream_idx].chunks.size()) {
+                    return k_status_end;
+                }
+                const chunk_record_t& cr = streams[src->stream_idx].chunks[src->chunk_idx];
+                if ((src->chunk->offset != cr.offset) || (src->chunk->tf.size() < cr.tf_offset + cr.tf_size)) {
+                    size_t tf_end = cr.tf_offset + cr.tf_size;
+                    for (size_t s = src->stream_idx + 1; (s < streams.size()) && !streams[s].chunks.empty() && (streams[s].chunks.front().offset == cr.offset); s++) {
+                        tf_end = std::max(tf_end, streams[s].chunks.front().tf_offset + streams[s].chunks.front().tf_size);
+                    }
+                    src->chunk->offset = -1;
+                    if (Archive::read_chunk_prefix(src->archive->fd, cr, tf_end, &src->chunk->compressed, &src->chunk->tf, error) != k_status_ok) {
+                        return k_status_error;
+                    }
+                    src->chunk->offset = cr.offset;
+                }
+                if (CRC32C::update(0, src->chunk->tf.data() + cr.tf_offset, cr.tf_size) != cr.tf_crc32c) {
+                    error->assign("Transformed chunk checksum does not match metadata");
+                    return k_status_error;
+                }
+                src->cursor = ChunkCursor(src->chunk->tf.data() + cr.tf_offset, cr.tf_size);
+                src->is_reading = true;
+            }
+        }
+
+        /* heap order, so that the front of the heap holds the smallest record; ties go to the earlier archive */
+        typedef struct merge_source_is_after {
+            const std::vector<merge_source_t>* sources;
+            bool operator()(size_t a, size_t b) const {
+                const merge_source_t& x = (*sources)[a];
+                const merge_source_t& y = (*sources)[b];
+                if (x.start != y.start) {
+                    return x.start > y.start;
+                }
+                if (x.stop != y.stop) {
+                    return x.stop > y.stop;
+                }
+                return x.archive_idx > y.archive_idx;
+            }
+        } merge_source_is_after_t;
+
+        /* hands a finished piece to the writer, waiting while this chromosome already has enough queued */
+        static void queue_merge_piece(merge_state_t* ms, size_t chr_idx, merge_piece_t* piece) {
+            std::deque<merge_piece_t>& q = (*ms->pieces)[chr_idx];
+            pthread_mutex_lock(&ms->lock);
+            while (!ms->is_failed && (q.size() >= merge_pieces_per_chr)) {
+                pthread_cond_wait(&ms->piece_is_taken, &ms->lock);
+            }
+            q.push_back(merge_piece_t());
+            q.back().data.swap(piece->data);
+            q.back().cr = piece->cr;
+            q.back().is_shared = piece->is_shared;
+            pthread_cond_broadcast(&ms->piece_is_ready);
+            pthread_mutex_unlock(&ms->lock);
+            piece->data.clear();
+            piece->is_shared = false;
+        }
+
+        /* tells the writer that every piece of the chromosome is queued */
+        static void finish_merge_chr(merge_state_t* ms, size_t chr_idx) {
+            pthread_mutex_lock(&ms->lock);
+            (*ms->is_chr_done)[chr_idx] = 1;
+            pthread_cond_broadcast(&ms->piece_is_ready);
+            pthread_mutex_unlock(&ms->lock);
+        }
+
+        /*
+           Transforms the batched records, queueing a compressed piece whenever a chunk fills. As in
+           compression, chromosomes packed ahead of the current one go out first once it fills the chunk or
+           grows too large to be packed.
+        */
+        static bool encode_merge_batch(merge_state_t* ms, size_t chr_idx, merge_output_t* out) {
+            size_t from = 0;
+            while (from < out->batch.starts.size()) {
+                from = out->encoder.encode(out->batch, from, &out->tf);
+                if ((out->tf_chr_offset > 0) && ((out->tf.size() >= Archive::chunk_length) || (out->tf.size() - out->tf_chr_offset >= packed_chr_max_length)) && !queue_merge_packed_chrs(ms, out)) {
+                    return false;
+                }
+                if (out->tf.size() >= Archive::chunk_length) {
+                    out->chr_tf_flushed += out->tf.size();
+                    if (!queue_merge_chunk(ms, chr_idx, out)) {
+                        return false;
+                    }
+                }
+            }
+            Encoder::clear_batch(&out->batch);
+            return true;
+        }
+
+        /* compresses the encoded records of the current chromosome, which has the chunk to itself, into a piece and starts a new chunk */
+        static bool queue_merge_chunk(merge_state_t* ms, size_t chr_idx, merge_output_t* out) {
+            std::string chunk_error;
+            if (out->tf.empty()) {
+                return true;
+            }
+            if (out->encoder.finish_chunk(out->tf, &out->piece.data, &out->piece.cr, &chunk_error) != k_status_ok) {
+                std::fprintf(stderr, "Error: %s\n", chunk_error.c_str());
+                return false;
+            }
+            queue_merge_piece(ms, chr_idx, &out->piece);
+            out->tf.clear();
+            out->encoder.reset();
+            return true;
+        }
+
+        /*
+           Compresses the chromosomes packed ahead of the current one into a chunk they share. The first
+           one's piece carries the chunk and the others refer back to it; the current chromosome's bytes
+           move to the start of the next chunk.
+        */
+        static bool queue_merge_packed_chrs(merge_state_t* ms, merge_output_t* out) {
+            std::string chunk_error;
+            std::vector<char> compressed;
+            size_t compressed_size = 0;
+            if (out->packed_chrs.empty()) {
+                return true;
+            }
+            compressed.resize(Archive::compressed_bound(out->tf_chr_offset));
+            if (Archive::compress_chunk(k_bzip2_codec, Archive::default_bzip2_level, out->tf.data(), out->tf_chr_offset, compressed.data(), compressed.size(), &compressed_size, &chunk_error) != k_status_ok) {
+                std::fprintf(stderr, "Error: %s\n", chunk_error.c_str());
+                return false;
+            }
+            compressed.resize(compressed_size);
+            uint32_t compressed_crc32c = CRC32C::update(0, compressed.data(), compressed.size());
+            for (std::vector<std::pair<size_t, chunk_record_t> >::iterator p = out->packed_chrs.begin(); p != out->packed_chrs.end(); ++p) {
+                out->piece.cr = p->second;
+                out->piece.cr.size = compressed_size;
+                out->piece.cr.compressed_crc32c = compressed_crc32c;
+                /* a chunk of one chromosome keeps its hash, so that --reuse can find it later */
+                if (out->packed_chrs.size() == 1) {
+                    out->piece.cr.tf_hash = Hash64::hash(out->tf.data(), out->tf_chr_offset);
+                }
+                out->piece.is_shared = (p != out->packed_chrs.begin());
+                if (!out->piece.is_shared) {
+                    out->piece.data.swap(compressed);
+                }
+                queue_merge_piece(ms, p->first, &out->piece);
+                finish_merge_chr(ms, p->first);
+            }
+            out->packed_chrs.clear();
+            out->tf.erase(out->tf.begin(), out->tf.begin() + static_cast<std::ptrdiff_t>( out->tf_chr_offset ));
+            out->tf_chr_offset = 0;
+            return true;
+        }
+
+        /*
+           Ends a merged chromosome. One smaller than packed_chr_max_length stays in tf to share the next
+           chunk with the chromosomes after it, and its pieces are queued when that chunk is; larger ones,
+           tail included, get chunks of their own.
+        */
+        static bool finish_merge_chromosome(merge_state_t* ms, size_t chr_idx, merge_output_t* out) {
+            if (!encode_merge_batch(ms, chr_idx, out)) {
+                return false;
+            }
+            if (out->chr_tf_flushed + (out->tf.size() - out->tf_chr_offset) >= packed_chr_max_length) {
+                if (!queue_merge_chunk(ms, chr_idx, out)) {
+                    return false;
+                }
+                finish_merge_chr(ms, chr_idx);
+            }
+            else if (out->tf.size() > out->tf_chr_offset) {
+                chunk_record_t cr;
+                cr.offset = 0;
+                cr.tf_offset = out->tf_chr_offset;
+                cr.tf_size = out->tf.size() - out->tf_chr_offset;
+                cr.line_count = out->encoder.line_count();
+                cr.first_record = 0;
+                cr.min_start = out->encoder.min_start();
+                cr.max_stop = out->encoder.max_stop();
+                cr.base_count = out->encoder.base_count();
+                cr.unique_base_count = out->encoder.unique_base_count();
+                cr.tf_crc32c = CRC32C::update(0, out->tf.data() + cr.tf_offset, cr.tf_size);
+                cr.tf_hash = 0;
+                cr.codec = k_bzip2_codec;
+                cr.level = Archive::default_bzip2_level;
+                out->packed_chrs.push_back(std::make_pair(chr_idx, cr));
+                out->tf_chr_offset = out->tf.size();
+            }
+            else {
+                finish_merge_chr(ms, chr_idx);
+            }
+            out->encoder.reset();
+            out->chr_tf_flushed = 0;
+            return true;
+        }
+
+        /* merges one chromosome's records from every archive that has it */
+        static bool merge_chromosome(merge_state_t* ms, size_t chr_idx, std::vector<merge_chunk_t>* chunks, merge_output_t* out, std::string* error) {
+            std::vector<merge_source_t> sources;
+            std::vector<size_t> heap;
+            merge_source_is_after_t is_after;
+            bool is_ok = true;
+            is_after.sources = &sources;
+            const std::string& chr = ms->chr_names->name_str((*ms->chrs)[chr_idx]);
+            const std::vector<std::pair<size_t, size_t> >& chr_streams = (*ms->chr_streams)[(*ms->chrs)[chr_idx]];
+            for (std::vector<std::pair<size_t, size_t> >::const_iterator cs = chr_streams.begin(); cs != chr_streams.end(); ++cs) {
+                merge_source_t src = { &(*ms->archives)[cs->first], cs->second, 0, cs->first, &(*chunks)[cs->first], false, ChunkCursor(NULL, 0), 0, 0, NULL, 0 };
+                sources.push_back(src);
+            }
+            for (size_t idx = 0; is_ok && (idx < sources.size()); idx++) {
+                status_t res = advance_merge_source(&sources[idx], error);
+                if (res == k_status_ok) {
+                    heap.push_back(idx);
+                }
+                is_ok = (res != k_status_error);
+            }
+            std::make_heap(heap.begin(), heap.end(), is_after);
+            while (is_ok && !heap.empty()) {
+                std::pop_heap(heap.begin(), heap.end(), is_after);
+                merge_source_t& src = sources[heap.back()];
+                if (ms->is_archive) {
+                    Encoder::append_to_batch(&out->batch, src.start, src.stop, src.rem, src.rem_length);
+                    if (out->batch.starts.size() >= Encoder::batch_length) {
+                        is_ok = encode_merge_batch(ms, chr_idx, out);
+                    }
+                }
+                else {
+                    append_bed_record(chr, src.start, src.stop, src.rem, src.rem_length, &out->piece.data);
+                    if (out->piece.data.size() >= Archive::chunk_length) {
+                        queue_merge_piece(ms, chr_idx, &out->piece);
+                    }
+                }
+                /* the record's remainder lives in the source's chunk, so it is copied before the source moves on */
+                status_t res = advance_merge_source(&src, error);
+                if (res == k_status_ok) {
+                    std::push_heap(heap.begin(), heap.end(), is_after);
+                }
+                else {
+                    heap.pop_back();
+                    is_ok = (res != k_status_error);
+                }
+            }
+            if (!is_ok) {
+                return false;
+            }
+            if (ms->is_archive) {
+                return finish_merge_chromosome(ms, chr_idx, out);
+            }
+            if (!out->piece.data.empty()) {
+                queue_merge_piece(ms, chr_idx, &out->piece);
+            }
+            finish_merge_chr(ms, chr_idx);
+            return true;
+        }
+
+        /*
+           Claims groups of chromosomes and merges them in order. A group holds chromosomes that share an
+           input chunk, which the worker decodes once for all of them, and runs of small chromosomes, which
+           it packs into shared output chunks.
+        */
+        static void* merge_chromosomes(void* arg) {
+            merge_state_t* ms = static_cast<merge_state_t*>( arg );
+            std::vector<merge_chunk_t> chunks(ms->archives->size());
+            merge_output_t out;
+            std::string chunk_error;
+            size_t group_idx = 0;
+            size_t chr_idx = 0;
+            bool is_ok = true;
+            for (std::vector<merge_chunk_t>::iterator c = chunks.begin(); c != chunks.end(); ++c) {
+                c->offset = -1;
+            }
+            for (;;) {
+                pthread_mutex_lock(&ms->lock);
+                group_idx = ms->next_group++;
+                if (ms->is_failed || (group_idx + 1 >= ms->group_starts->size())) {
+                    pthread_mutex_unlock(&ms->lock);
+                    break;
+                }
+                pthread_mutex_unlock(&ms->lock);
+                Encoder::clear_batch(&out.batch);
+                out.encoder.reset();
+                out.tf.clear();
+                out.tf_chr_offset = 0;
+                out.chr_tf_flushed = 0;
+                out.packed_chrs.clear();
+                out.piece.data.clear();
+                out.piece.is_shared = false;
+                for (chr_idx = (*ms->group_starts)[group_idx]; is_ok && (chr_idx < (*ms->group_starts)[group_idx + 1]); chr_idx++) {
+                    is_ok = merge_chromosome(ms, chr_idx, &chunks, &out, &chunk_error);
+                }
+                /* the packed chromosomes left at the end of the group share its last chunk */
+                if (is_ok && ms->is_archive) {
+                    is_ok = queue_merge_packed_chrs(ms, &out);
+                }
+                if (!is_ok) {
+                    pthread_mutex_lock(&ms->lock);
+                    std::fprintf(stderr, "Error: Could not merge chromosome [%s] (%s)\n", ms->chr_names->name((*ms->chrs)[chr_idx - 1]), chunk_error.c_str());
+                    ms->is_failed = true;
+                    pthread_cond_broadcast(&ms->piece_is_taken);
+                    pthread_cond_broadcast(&ms->piece_is_ready);
+                    pthread_mutex_unlock(&ms->lock);
+                    break;
+                }
+            }
+            return NULL;
+        }
+
+        static void write_merged_bytes(int fd, const char* buf, size_t len) {
+            ssize_t res = 0;
+            while (len > 0) {
+                res = write(fd, buf, len);
+                if (res < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    int errsv = errno;
+                    std::fprintf(stderr, "Error: Could not write merged output (%s)\n", std::strerror(errsv));
+                    std::exit(errsv);
+                }
+                buf += res;
+                len -= static_cast<size_t>( res );
+            }
+        }
+
+        /*
+           Trial-compresses a sample from the start of the tf buffer with each candidate setting, and
+           keeps the one that best meets the --optimize objective for the rest of the chromosome. Small
+           chromosomes that share a chunk are sampled together, so the choice fits the whole chunk.
+        */
+        static void choose_codec(shared_buffer_t* sb) {
+            static const struct { codec_t codec; int level; } _candidates[] = { { k_bzip2_codec, 9 },
+                                                                                { k_bzip2_codec, 1 },
+                                                                                { k_gzip_codec, 9 },
+                                                                                { k_gzip_codec, 6 },
+                                                                                { k_gzip_codec, 1 } };
+            size_t sample_size = std::min(sb->tf_buffer->size(), static_cast<size_t>( auto_sample_length ));
+            std::vector<char> trial(Archive::compressed_bound(sample_size));
+            std::vector<char> decoded(sample_size);
+            std::string compress_error;
+            size_t trial_size = 0;
+            double began = 0;
+            double compressed = 0;
+            double decompressed = 0;
+            double cost = 0;
+            double best_cost = 0;
+            for (size_t idx = 0; idx < sizeof(_candidates) / sizeof(_candidates[0]); idx++) {
+                began = monotonic_seconds();
+                if (Archive::compress_chunk(_candidates[idx].codec, _candidates[idx].level, sb->tf_buffer->data(), sample_size, trial.data(), trial.size(), &trial_size, &compress_error) != k_status_ok) {
+                    std::fprintf(stderr, "Error: %s\n", compress_error.c_str());
+                    std::exit(EINVAL);
+                }
+                compressed = monotonic_seconds();
+                if (Archive::decompress_chunk(_candidates[idx].codec, trial.data(), trial_size, decoded.data(), sample_size, &compress_error) != k_status_ok) {
+                    std::fprintf(stderr, "Error: %s\n", compress_error.c_str());
+                    std::exit(EINVAL);
+                }
+                decompressed = monotonic_seconds();
+                switch (self->get_optimize_objective()) {
+                case k_optimize_speed:
+                    cost = compressed - began;
+                    break;
+                case k_optimize_decode_speed:
+                    cost = decompressed - compressed;
+                    break;
+                default:
+                    cost = static_cast<double>( trial_size );
+                    break;
+                }
+#ifdef DEBUG
+                std::fprintf(stderr, "Debug: Trial of [%s] on [%zu] bytes of [%s] gave [%zu] bytes in [%.6f] s, decoded in [%.6f] s\n", Archive::codec_name(_candidates[idx].codec, _candidates[idx].level).c_str(), sample_size, sb->chrs->name(sb->tf_state->current_chr_id), trial_size, compressed - began, decompressed - compressed);
+#endif
+                if ((idx == 0) || (cost < best_cost)) {
+                    best_cost = cost;
+                    sb->codec = _candidates[idx].codec;
+                    sb->level = _candidates[idx].level;
+                }
+            }
+            sb->is_codec_chosen = true;
+        }
+
+        static void initialize_transformation_state(starch3::Starch::transform_state_t** tfs) {
+            (*tfs)->line_count = 0;
+            (*tfs)->last_start = 0;
+            (*tfs)->last_stop = 0;
+            (*tfs)->last_coord_diff = 0;
+            (*tfs)->last_chr_id = ChrTable::no_chr;
+            (*tfs)->current_start = 0;
+            (*tfs)->current_stop = 0;
+            (*tfs)->current_coord_diff = 0;
+            (*tfs)->current_chr_id = ChrTable::no_chr;
+            (*tfs)->base_count_unique = 0;
+            (*tfs)->base_count_nonunique = 0;
+#ifdef DEBUG
+            std::fprintf(stderr, "--- starch3::Starch::initialize_transformation_state() ---\n");
+#endif
+        }
+
+        static void reset_transformation_state(starch3::Starch::transform_state_t** tfs) {
+            (*tfs)->line_count = 0;
+            (*tfs)->last_start = 0;
+            (*tfs)->last_stop = 0;
+            (*tfs)->last_coord_diff = 0;
+            (*tfs)->current_start = 0;
+            (*tfs)->current_stop = 0;
+            (*tfs)->current_coord_diff = 0;
+            (*tfs)->base_count_unique = 0;
+            (*tfs)->base_count_nonunique = 0;
+#ifdef DEBUG
+            std::fprintf(stderr, "--- starch3::Starch::reset_transformation_state() ---\n");
+#endif
+        }
+
+        static inline short n_digits(int64_t i) {
+            // IN64_MAX = 9223372036854775808LL;
+            if (i < 0) i = -i;
+            if (i <                  10) return  1;
+            if (i <                 100) return  2;
+            if (i <                1000) return  3;
+            if (i <               10000) return  4;
+            if (i <              100000) return  5;
+            if (i <             1000000) return  6;      
+            if (i <            10000000) return  7;
+            if (i <           100000000) return  8;
+            if (i <          1000000000) return  9;
+            if (i <         10000000000) return 10;
+            if (i <        100000000000) return 11;
+            if (i <       1000000000000) return 12;
+            if (i <      10000000000000) return 13;
+            if (i <     100000000000000) return 14;
+            if (i <    1000000000000000) return 15;
+            if (i <   10000000000000000) return 16;
+            if (i <  100000000000000000) return 17;
+            if (i < 1000000000000000000) return 18;
+            return 19;
+        }
+    };
+
+    void Starch::initialize_shared_buffer(starch3::Starch::shared_buffer_t* sb) {
+        sb->is_eof = false;
+        sb->in_line = NULL;
+        sb->in_line = static_cast<char*>( malloc(starch3::Starch::in_line_initial_length) );
+        if (!sb->in_line) {
+            std::fprintf(stderr, "Error: Not enough memory for shared_buffer_t line character buffer\n");
+            std::exit(ENOMEM);
+        }
+        sb->in_line_capacity = starch3::Starch::in_line_initial_length;
+        sb->bed = static_cast<bed_t*>( malloc(sizeof(bed_t)) );
+        if (!sb->bed) {
+            std::fprintf(stderr, "Error: Could not allocate space for buffer BED line components\n");
+            std::exit(ENOMEM);
+        }
+        sb->bed->chr = NULL;
+        sb->bed->chr = static_cast<char*>( malloc(starch3::Starch::in_field_initial_length) );
+        if (!sb->bed->chr) {
+            std::fprintf(stderr, "Error: Could not allocate space for buffer BED line chromosome field component\n");
+            std::exit(ENOMEM);
+        }
+        sb->bed->chr_capacity = starch3::Starch::in_field_initial_length;
+        sb->bed->chr_length = 0;
+        sb->bed->chr_id = ChrTable::no_chr;
+        sb->chrs = &this->chrs;
         sb->bed->start_str = NULL;
         sb->bed->start_str = static_cast<char*>( malloc(starch3::Starch::in_field_initial_length) );
         if (!sb->bed->start_str) {
             std::fprintf(stderr, "Error: Could not allocate space for buffer BED line start field component\n");
             std::exit(ENOMEM);
         }
-        sb->bed->start_str_capacity = starch3::Starch::in_field_initial_length;
-        sb->bed->stop_str = NULL;
-        sb->bed->stop_str = static_cast<char*>( malloc(starch3::Starch::in_field_initial_length) );
-        if (!sb->bed->stop_str) {
-            std::fprintf(stderr, "Error: Could not allocate space for buffer BED line stop field component\n");
+        sb->bed->start_str_capacity = starch3::Starch::in_field_initial_length;
+        sb->bed->stop_str = NULL;
+        sb->bed->stop_str = static_cast<char*>( malloc(starch3::Starch::in_field_initial_length) );
+        if (!sb->bed->stop_str) {
+            std::fprintf(stderr, "Error: Could not allocate space for buffer BED line stop field component\n");
+            std::exit(ENOMEM);
+        }
+        sb->bed->stop_str_capacity = starch3::Starch::in_field_initial_length;
+        sb->bed->rem = NULL;
+        sb->bed->rem = static_cast<char*>( malloc(starch3::Starch::in_field_initial_length) );
+        if (!sb->bed->rem) {
+            std::fprintf(stderr, "Error: Could not allocate space for buffer BED line remainder field component\n");
+            std::exit(ENOMEM);
+        }
+        sb->bed->rem_capacity = starch3::Starch::in_field_initial_length;
+        sb->in_stream = get_in_stream();
+        sb->in_offset = _resume.is_resuming ? _resume.mark.offset : 0;
+        sb->tf_state = NULL;
+        sb->tf_state = static_cast<transform_state_t*>( malloc(sizeof(transform_state_t)) );
+        if (!sb->tf_state) {
+            std::fprintf(stderr, "Error: Not enough memory for shared_buffer_t transformation state\n");
+            std::exit(ENOMEM);
+        }
+        this->initialize_transformation_state(&sb->tf_state);
+        sb->batch = new (std::nothrow) record_batch_t;
+        sb->batch_marks = new (std::nothrow) std::vector<input_mark_t>;
+        sb->encoder = new (std::nothrow) Encoder;
+        sb->tf_buffer = new (std::nothrow) std::vector<char>;
+        sb->packed_chrs = new (std::nothrow) std::vector<packed_chr_t>;
+        if (!sb->batch || !sb->batch_marks || !sb->encoder || !sb->tf_buffer || !sb->packed_chrs) {
+            std::fprintf(stderr, "Error: Not enough memory for shared_buffer_t transformation buffer\n");
+            std::exit(ENOMEM);
+        }
+        Encoder::clear_batch(sb->batch);
+        sb->tf_buffer->reserve(tf_buffer_chunk_length * 2);
+        sb->tf_chr_offset = 0;
+        sb->chr_tf_flushed = 0;
+        /* a small input fills at most one chunk, so it is compressed without starting workers */
+        this->pool.start(this->is_small_input() ? 1 : this->get_thread_count(), this->is_pinned());
+        sb->pool = &this->pool;
+        sb->pending_chunks = new (std::nothrow) std::deque<pending_chunk_t*>;
+        if (!sb->pending_chunks) {
+            std::fprintf(stderr, "Error: Not enough memory for shared_buffer_t pending chunks\n");
+            std::exit(ENOMEM);
+        }
+        sb->max_pending_chunks = this->pool.size() * 2;
+        sb->out_queue = &this->out_queue;
+        sb->streams = &this->streams;
+        sb->validation = new (std::nothrow) validation_state_t;
+        if (!sb->validation) {
+            std::fprintf(stderr, "Error: Not enough memory for shared_buffer_t validation state\n");
+            std::exit(ENOMEM);
+        }
+        sb->validation->line_count = 0;
+        sb->validation->is_line_valid = false;
+        sb->validation->last_chr_id = ChrTable::no_chr;
+        sb->validation->last_start = 0;
+        sb->validation->error_count = 0;
+        sb->is_checkpointing = !this->get_checkpoint_fn().empty();
+        sb->in_size = _resume.input_size;
+        sb->in_mtime = _resume.input_mtime;
+        sb->checkpoint_due = monotonic_seconds() + checkpoint_interval;
+        sb->tf_mark.offset = 0;
+        sb->tf_mark.line_count = 0;
+        sb->tf_mark.start = 0;
+        sb->tf_mark.error_count = 0;
+        /* the resumed run validates as if it had read the archived lines itself */
+        if (_resume.is_resuming) {
+            sb->tf_mark = _resume.mark;
+            sb->validation->line_count = _resume.mark.line_count;
+            sb->validation->last_start = _resume.mark.start;
+            sb->validation->error_count = _resume.mark.error_count;
+            sb->validation->errors = _resume.errors;
+            for (std::vector<stream_record_t>::const_iterator st = this->streams.begin(); st != this->streams.end(); ++st) {
+                sb->validation->last_chr_id = sb->chrs->intern(st->chr);
+            }
+        }
+        sb->shards = this->get_shard_dir().empty() ? NULL : &this->shards;
+        sb->open_shard = NULL;
+        sb->reuse_chunks = NULL;
+        if (!this->get_reuse_fn().empty()) {
+            this->open_reuse_archive();
+            sb->reuse_chunks = &this->reuse_chunks;
+        }
+        sb->reuse_fd = this->reuse_fd;
+        sb->reused_chunk_count = 0;
+        sb->codec = (this->get_compression_method() == k_gzip) ? k_gzip_codec : k_bzip2_codec;
+        sb->level = (this->get_compression_method() == k_gzip) ? Archive::default_gzip_level : Archive::default_bzip2_level;
+        sb->is_auto = this->is_auto();
+        sb->is_codec_chosen = false;
+
+#ifdef DEBUG
+        std::fprintf(stderr, "--- starch3::Starch::initialize_shared_buffer() ---\n");
+#endif
+    }
+
+    void Starch::delete_shared_buffer(starch3::Starch::shared_buffer_t* sb) {
+        /* input decompression runs on the pool too, so the input is closed first */
+        fclose(sb->in_stream);
+        this->pool.stop();
+        delete sb->pending_chunks;
+        sb->pending_chunks = NULL;
+        if (sb->in_line) {
+            free(sb->in_line);
+            sb->in_line = NULL;
+            sb->in_line_capacity = 0;
+        }
+        if (sb->tf_state) {
+            free(sb->tf_state);
+            sb->tf_state = NULL;
+        }
+        if (sb->bed) {
+            if (sb->bed->chr) {
+                free(sb->bed->chr);
+                sb->bed->chr = NULL;
+                sb->bed->chr_capacity = 0;
+            }
+            if (sb->bed->start_str) {
+                free(sb->bed->start_str);
+                sb->bed->start_str = NULL;
+                sb->bed->start_str_capacity = 0;
+            }
+            if (sb->bed->stop_str) {
+                free(sb->bed->stop_str);
+                sb->bed->stop_str = NULL;
+                sb->bed->stop_str_capacity = 0;
+            }
+            if (sb->bed->rem) {
+                free(sb->bed->rem);
+                sb->bed->rem = NULL;
+                sb->bed->rem_capacity = 0;
+            }
+            free(sb->bed);
+            sb->bed = NULL;
+        }
+        delete sb->batch;
+        sb->batch = NULL;
+        delete sb->batch_marks;
+        sb->batch_marks = NULL;
+        delete sb->encoder;
+        sb->encoder = NULL;
+        delete sb->tf_buffer;
+        sb->tf_buffer = NULL;
+        delete sb->packed_chrs;
+        sb->packed_chrs = NULL;
+        delete sb->validation;
+        sb->validation = NULL;
+#ifdef DEBUG
+        std::fprintf(stderr, "Debug: Reused [%" PRId64 "] chunks from the reference archive\n", sb->reused_chunk_count);
+        std::fprintf(stderr, "--- starch3::Starch::delete_shared_buffer() ---\n");
+#endif
+    }
+
+    FILE* Starch::get_in_stream(void) {
+        return _in_stream;
+    }
+
+    /*
+       Opens the input and decides whether it is small enough to compress on one thread. Plain
+       regular files are judged by size. Compressed or piped input is read ahead, decompressed, by
+       up to a chunk, and is small if it ends within that; the bytes read ahead are replayed to
+       whichever path compresses them.
+    */
+    void Starch::initialize_in_stream(void) {
+        FILE* in_fp = NULL;
+        FILE* raw_fp = NULL;
+        struct stat in_stats;
+        std::vector<char> prefix;
+        size_t prefix_size = 0;
+        in_fp = this->get_input_fn().empty() ? stdin : fopen(this->get_input_fn().c_str(), "r");
+        if (!in_fp) {
+            std::fprintf(stderr, "Error: Input file handle could not be created\n");
+            std::exit(ENODATA); /* No message is available on the STREAM head read queue (POSIX.1) */
+        }
+        bool is_regular = (fstat(fileno(in_fp), &in_stats) == 0) && S_ISREG(in_stats.st_mode);
+        /* gzip, BGZF and bzip2 input is recognized by its magic bytes and decompressed in-process */
+        raw_fp = in_fp;
+        in_fp = InputDecompressor::open(in_fp, &this->pool);
+        if (!in_fp) {
+            std::fprintf(stderr, "Error: Decompressed input stream could not be created\n");
             std::exit(ENOMEM);
         }
-        sb->bed->stop_str_capacity = starch3::Starch::in_field_initial_length;
-        sb->bed->rem = NULL;
-        sb->bed->rem = static_cast<char*>( malloc(starch3::Starch::in_field_initial_length) );
-        if (!sb->bed->rem) {
-            std::fprintf(stderr, "Error: Could not allocate space for buffer BED line remainder field component\n");
-            std::exit(ENOMEM);
+        /* a plain file is judged by its size; compressed or piped input by how much of it can be read ahead */
+        if (is_regular && (in_fp == raw_fp)) {
+            _is_small_input = (in_stats.st_size <= static_cast<off_t>( small_input_length ));
         }
-        sb->bed->rem_capacity = starch3::Starch::in_field_initial_length;
-        pthread_mutex_init(&sb->lock, NULL);
-        pthread_cond_init(&sb->new_line_is_available, NULL);
-        pthread_cond_init(&sb->new_line_is_empty, NULL);
-        pthread_cond_init(&sb->new_chromosome_is_available, NULL);
-        pthread_cond_init(&sb->new_tf_buffer_is_available, NULL);
-        sb->in_stream = get_in_stream();
-        sb->tf_line = NULL;
-        sb->tf_line = static_cast<char*>( malloc(starch3::Starch::tf_line_initial_length) );
-        if (!sb->tf_line) {
-            std::fprintf(stderr, "Error: Not enough memory for shared_buffer_t transformed line character buffer\n");
-            std::exit(ENOMEM);
+        else {
+            prefix.resize(small_input_length);
+            prefix_size = fread(prefix.data(), 1, prefix.size(), in_fp);
+            _is_small_input = (prefix_size < prefix.size()) && feof(in_fp);
+            prefix.resize(prefix_size);
+            in_fp = PrefixedInput::open(in_fp, &prefix);
+            if (!in_fp) {
+                std::fprintf(stderr, "Error: Input stream could not be created\n");
+                std::exit(ENOMEM);
+            }
         }
-        sb->tf_line_capacity = starch3::Starch::tf_line_initial_length;
-        sb->tf_state = NULL;
-        sb->tf_state = static_cast<transform_state_t*>( malloc(sizeof(transform_state_t)) );
-        if (!sb->tf_state) {
-            std::fprintf(stderr, "Error: Not enough memory for shared_buffer_t transformation state\n");
-            std::exit(ENOMEM);
+#ifdef DEBUG
+        std::fprintf(stderr, "Debug: Input is [%s]\n", _is_small_input ? "small" : "large");
+#endif
+        this->set_in_stream(in_fp);
+    }
+
+    bool Starch::is_small_input(void) {
+        return _is_small_input;
+    }
+
+    void Starch::set_in_stream(FILE* is) {
+        _in_stream = is;
+    }
+
+    std::string Starch::get_input_fn(void) {
+        return _input_fn;
+    }
+    
+    void Starch::set_input_fn(std::string s) {
+        struct stat buf;
+        if (stat(s.c_str(), &buf) == 0) {
+            _input_fn = s;
         }
-        this->initialize_transformation_state(&sb->tf_state);
-        sb->tf_buffer = NULL;
-        sb->tf_buffer = static_cast<char*>( std::calloc(tf_buffer_initial_length, sizeof(*sb->tf_buffer)) );
-        if (!sb->tf_buffer) {
-            std::fprintf(stderr, "Error: Not enough memory for shared_buffer_t transformation buffer\n");
+        else {
+            std::fprintf(stderr, "Error: Input file does not exist (%s)\n", s.c_str());
+            std::exit(ENODATA); /* No message is available on the STREAM head read queue (POSIX.1) */
+        }
+    }
+
+    std::string Starch::get_output_fn(void) {
+        return _output_fn;
+    }
+
+    void Starch::set_output_fn(std::string s) {
+        _output_fn = s;
+    }
+
+    std::string Starch::get_shard_dir(void) {
+        return _shard_dir;
+    }
+
+    void Starch::set_shard_dir(std::string s) {
+        /* trailing separators would double up in shard paths */
+        while ((s.size() > 1) && (s[s.size() - 1] == '/')) {
+            s.erase(s.size() - 1);
+        }
+        _shard_dir = s;
+    }
+
+    std::string Starch::get_reuse_fn(void) {
+        return _reuse_fn;
+    }
+
+    void Starch::set_reuse_fn(std::string s) {
+        _reuse_fn = s;
+    }
+
+    /* indexes the reference archive's chunks; archives written before chunk hashes offer none */
+    void Starch::open_reuse_archive(void) {
+        std::vector<stream_record_t> reuse_streams;
+        reuse_fd = open(_reuse_fn.c_str(), O_RDONLY);
+        if (reuse_fd == -1) {
+            int errsv = errno;
+            std::fprintf(stderr, "Error: Reference archive could not be opened [%s] (%s)\n", _reuse_fn.c_str(), std::strerror(errsv));
+            std::exit(errsv);
+        }
+        this->read_archive_metadata(reuse_fd, &reuse_streams);
+        reuse_chunks.clear();
+        for (std::vector<stream_record_t>::const_iterator st = reuse_streams.begin(); st != reuse_streams.end(); ++st) {
+            for (std::vector<chunk_record_t>::const_iterator c = st->chunks.begin(); c != st->chunks.end(); ++c) {
+                if (c->tf_hash != 0) {
+                    reuse_chunks[std::make_pair(c->tf_hash, c->tf_size)] = *c;
+                }
+            }
+        }
+#ifdef DEBUG
+        std::fprintf(stderr, "Debug: Reference archive [%s] offers [%zu] reusable chunks\n", _reuse_fn.c_str(), reuse_chunks.size());
+#endif
+    }
+
+    std::string Starch::get_checkpoint_fn(void) {
+        return _checkpoint_fn;
+    }
+
+    void Starch::set_checkpoint_fn(std::string s) {
+        _checkpoint_fn = s;
+    }
+
+    /*
+       Picks up an interrupted compression from its checkpoint, if one was left: the input skips the
+       bytes already in the archive's chunks, and the metadata and validation state of those chunks are
+       restored. The archive itself is cut back to the checkpoint when the output is opened. Without a
+       checkpoint file, compression starts from the beginning.
+    */
+    void Starch::resume_from_checkpoint(void) {
+        json_error_t json_error;
+        json_t* checkpoint = NULL;
+        json_t* progress = NULL;
+        json_t* error = NULL;
+        size_t error_idx = 0;
+        std::string metadata_error;
+        struct stat in_stats;
+        std::vector<char> skipped;
+        off_t skip_remaining = 0;
+        size_t n = 0;
+        _resume.is_resuming = false;
+        if (this->get_checkpoint_fn().empty()) {
+            return;
+        }
+        /* every checkpoint of this run records the input as it was now, so that a resumed run can tell it is unchanged */
+        if (stat(this->get_input_fn().c_str(), &in_stats) == -1) {
+            int errsv = errno;
+            std::fprintf(stderr, "Error: Input could not be examined for checkpointing (%s)\n", std::strerror(errsv));
+            std::exit(errsv);
+        }
+        _resume.input_size = in_stats.st_size;
+        _resume.input_mtime = in_stats.st_mtime;
+        if (access(this->get_checkpoint_fn().c_str(), F_OK) == -1) {
+            return;
+        }
+        checkpoint = json_load_file(this->get_checkpoint_fn().c_str(), 0, &json_error);
+        if (!checkpoint) {
+            std::fprintf(stderr, "Error: Checkpoint could not be read [%s] (%s)\n", this->get_checkpoint_fn().c_str(), json_error.text);
+            std::exit(EINVAL);
+        }
+        progress = json_object_get(checkpoint, "checkpoint");
+        /* a changed input would not line up with the archived chunks */
+        if (!json_is_object(progress)
+            || !json_is_string(json_object_get(progress, "input"))
+            || (this->get_input_fn() != json_string_value(json_object_get(progress, "input")))
+            || !json_is_string(json_object_get(progress, "output"))
+            || (this->get_output_fn() != json_string_value(json_object_get(progress, "output")))
+            || (json_integer_value(json_object_get(progress, "input_size")) != static_cast<json_int_t>( _resume.input_size ))
+            || (json_integer_value(json_object_get(progress, "input_mtime")) != static_cast<json_int_t>( _resume.input_mtime ))) {
+            std::fprintf(stderr, "Error: Checkpoint [%s] does not match this input and output; remove it to start over\n", this->get_checkpoint_fn().c_str());
+            std::exit(EINVAL);
+        }
+        if (Archive::json_to_metadata(json_object_get(checkpoint, "metadata"), &this->streams, &metadata_error) != k_status_ok) {
+            std::fprintf(stderr, "Error: Checkpoint metadata could not be read [%s] (%s)\n", this->get_checkpoint_fn().c_str(), metadata_error.c_str());
+            std::exit(EINVAL);
+        }
+        _resume.mark.offset = static_cast<off_t>( json_integer_value(json_object_get(progress, "input_offset")) );
+        _resume.mark.line_count = static_cast<int64_t>( json_integer_value(json_object_get(progress, "line_count")) );
+        _resume.mark.start = static_cast<int64_t>( json_integer_value(json_object_get(progress, "last_start")) );
+        _resume.output_offset = static_cast<off_t>( json_integer_value(json_object_get(progress, "output_offset")) );
+        _resume.mark.error_count = static_cast<int64_t>( json_integer_value(json_object_get(progress, "error_count")) );
+        _resume.errors.clear();
+        json_array_foreach(json_object_get(progress, "errors"), error_idx, error) {
+            const char* type = json_string_value(json_object_get(error, "type"));
+            const char* chr = json_string_value(json_object_get(error, "chromosome"));
+            validation_error_t e;
+            e.line = static_cast<int64_t>( json_integer_value(json_object_get(error, "line")) );
+            e.kind = k_malformed_line;
+            while (type && (e.kind < k_validation_error_kind_undefined) && (std::strcmp(validation_error_name(e.kind), type) != 0)) {
+                e.kind = static_cast<validation_error_kind_t>( e.kind + 1 );
+            }
+            e.chr = chr ? chr : "";
+            _resume.errors.push_back(e);
+        }
+        json_decref(checkpoint);
+        /* decompressed input cannot seek, so the bytes already archived are read past instead */
+        if (fseeko(this->get_in_stream(), _resume.mark.offset, SEEK_SET) != 0) {
+            skipped.resize(out_staging_length);
+            skip_remaining = _resume.mark.offset;
+            while (skip_remaining > 0) {
+                n = fread(skipped.data(), 1, std::min(skipped.size(), static_cast<size_t>( skip_remaining )), this->get_in_stream());
+                if (n == 0) {
+                    std::fprintf(stderr, "Error: Input ends before checkpoint [%s]\n", this->get_checkpoint_fn().c_str());
+                    std::exit(EINVAL);
+                }
+                skip_remaining -= static_cast<off_t>( n );
+            }
+        }
+        _resume.is_resuming = true;
+#ifdef DEBUG
+        std::fprintf(stderr, "Debug: Resuming from checkpoint at input offset [%jd] line [%" PRId64 "] output offset [%jd]\n", static_cast<intmax_t>( _resume.mark.offset ), _resume.mark.line_count, static_cast<intmax_t>( _resume.output_offset ));
+#endif
+    }
+
+    /* the archive is complete, or was discarded, so there is nothing left to resume */
+    void Starch::remove_checkpoint(void) {
+        if (!this->get_checkpoint_fn().empty()) {
+            unlink(this->get_checkpoint_fn().c_str());
+        }
+    }
+
+    /* lists the shards by chromosome; it is written last, so its presence means every shard is complete */
+    void Starch::write_shard_manifest(void) {
+        json_t* manifest = json_object();
+        json_t* archive = json_object();
+        json_t* shard_array = json_array();
+        std::string manifest_fn = this->get_shard_dir() + "/manifest.json";
+        std::string manifest_tmp_fn = manifest_fn + ".tmp";
+        std::vector<stream_record_t>::iterator s = streams.begin();
+        json_object_set_new(archive, "type", json_string("starch-shards"));
+        json_object_set_new(archive, "version", json_integer(Archive::version_major));
+        if (!this->get_note().empty()) {
+            json_object_set_new(archive, "note", json_string(this->get_note().c_str()));
+        }
+        for (std::deque<shard_record_t>::iterator sh = shards.begin(); sh != shards.end(); ++sh, ++s) {
+            json_t* shard = json_object();
+            json_object_set_new(shard, "chromosome", json_string(sh->chr.c_str()));
+            json_object_set_new(shard, "file", json_string(sh->fn.substr(this->get_shard_dir().size() + 1).c_str()));
+            json_object_set_new(shard, "file_size", json_integer(static_cast<json_int_t>( sh->size )));
+            json_object_set_new(shard, "line_count", json_integer(static_cast<json_int_t>( s->line_count )));
+            json_object_set_new(shard, "transformed_size", json_integer(static_cast<json_int_t>( s->tf_size )));
+            json_object_set_new(shard, "compressed_size", json_integer(static_cast<json_int_t>( s->size )));
+            json_object_set_new(shard, "compressed_crc32c", json_integer(static_cast<json_int_t>( s->compressed_crc32c )));
+            json_array_append_new(shard_array, shard);
+        }
+        json_object_set_new(manifest, "archive", archive);
+        json_object_set_new(manifest, "shards", shard_array);
+        if ((json_dump_file(manifest, manifest_tmp_fn.c_str(), JSON_INDENT(2) | JSON_PRESERVE_ORDER) != 0) || (rename(manifest_tmp_fn.c_str(), manifest_fn.c_str()) == -1)) {
+            std::fprintf(stderr, "Error: Could not write shard manifest [%s]\n", manifest_fn.c_str());
+            std::exit(EIO);
+        }
+        json_decref(manifest);
+#ifdef DEBUG
+        std::fprintf(stderr, "--- starch3::Starch::write_shard_manifest() ---\n");
+#endif
+    }
+
+    void Starch::delete_shards(void) {
+        for (std::deque<shard_record_t>::iterator sh = shards.begin(); sh != shards.end(); ++sh) {
+            unlink(sh->fn.c_str());
+        }
+    }
+
+    std::string Starch::get_report_fn(void) {
+        return _report_fn;
+    }
+
+    void Starch::set_report_fn(std::string s) {
+        _report_fn = s;
+    }
+
+    /* writes the validation report, if one was requested, and returns the error count */
+    int64_t Starch::report_validation(void) {
+        validation_state_t* vs = this->buffer.validation;
+        json_t* report = NULL;
+        json_t* error_array = NULL;
+        if (!this->get_report_fn().empty()) {
+            report = json_object();
+            error_array = json_array();
+            for (std::vector<validation_error_t>::iterator e = vs->errors.begin(); e != vs->errors.end(); ++e) {
+                json_t* error = json_object();
+                json_object_set_new(error, "line", json_integer(static_cast<json_int_t>( e->line )));
+                json_object_set_new(error, "type", json_string(validation_error_name(e->kind)));
+                json_object_set_new(error, "chromosome", json_string(e->chr.c_str()));
+                json_object_set_new(error, "message", json_string(validation_error_message(e->kind)));
+                json_array_append_new(error_array, error);
+            }
+            json_object_set_new(report, "input", json_string(this->get_input_fn().empty() ? "-" : this->get_input_fn().c_str()));
+            json_object_set_new(report, "valid", json_boolean(vs->error_count == 0));
+            json_object_set_new(report, "line_count", json_integer(static_cast<json_int_t>( vs->line_count )));
+            json_object_set_new(report, "error_count", json_integer(static_cast<json_int_t>( vs->error_count )));
+            json_object_set_new(report, "errors", error_array);
+            if (json_dump_file(report, this->get_report_fn().c_str(), JSON_INDENT(2) | JSON_PRESERVE_ORDER) != 0) {
+                std::fprintf(stderr, "Error: Could not write validation report [%s]\n", this->get_report_fn().c_str());
+                std::exit(EIO);
+            }
+            json_decref(report);
+        }
+#ifdef DEBUG
+        std::fprintf(stderr, "--- starch3::Starch::report_validation() - lines [%" PRId64 "] errors [%" PRId64 "] ---\n", vs->line_count, vs->error_count);
+#endif
+        return vs->error_count;
+    }
+
+    void Starch::set_out_fd(int fd) {
+        _out_fd = fd;
+    }
+
+    int Starch::get_out_fd(void) {
+        return _out_fd;
+    }
+
+    void Starch::initialize_out_stream(void) {
+        int out_fd = STDOUT_FILENO;
+        if (!this->get_shard_dir().empty()) {
+            /* each shard brings its own header, written when its first chunk is */
+            if ((mkdir(this->get_shard_dir().c_str(), 0755) == -1) && (errno != EEXIST)) {
+                int errsv = errno;
+                std::fprintf(stderr, "Error: Shard directory could not be created (%s)\n", std::strerror(errsv));
+                std::exit(errsv);
+            }
+            this->set_out_fd(-1);
+            this->initialize_write_queue(&this->out_queue);
+            return;
+        }
+        if (!this->get_output_fn().empty()) {
+            out_fd = open(this->get_output_fn().c_str(), O_WRONLY | O_CREAT | (_resume.is_resuming ? 0 : O_TRUNC), 0644);
+            if (out_fd == -1) {
+                int errsv = errno;
+                std::fprintf(stderr, "Error: Output file handle could not be created (%s)\n", std::strerror(errsv));
+                std::exit(errsv);
+            }
+            /* bytes past the checkpoint were written after it was committed, and are written again */
+            if (_resume.is_resuming && ((ftruncate(out_fd, _resume.output_offset) == -1) || (lseek(out_fd, _resume.output_offset, SEEK_SET) == -1))) {
+                int errsv = errno;
+                std::fprintf(stderr, "Error: Output could not be cut back to checkpoint (%s)\n", std::strerror(errsv));
+                std::exit(errsv);
+            }
+        }
+        this->set_out_fd(out_fd);
+        this->initialize_write_queue(&this->out_queue);
+        /* disk space for a named output is reserved in steps as it is written; see flush_staging_buffer() */
+        this->out_queue.is_preallocating = this->out_queue.out_fd_is_seekable && !this->get_output_fn().empty();
+        if (!_resume.is_resuming) {
+            enqueue_header_magic_bytes(&this->out_queue);
+        }
+    }
+
+    void Starch::finalize_out_stream(void) {
+        pthread_mutex_lock(&out_queue.lock);
+        out_queue.is_eof = true;
+        pthread_cond_signal(&out_queue.block_is_available);
+        pthread_mutex_unlock(&out_queue.lock);
+        if (out_queue.is_inline) {
+            flush_staging_buffer(&out_queue);
+        }
+        else {
+            pthread_join(write_blocks_thread, NULL);
+        }
+        if (!this->get_output_fn().empty()) {
+            if (ftruncate(this->get_out_fd(), out_queue.next_offset) == -1) {
+                int errsv = errno;
+                std::fprintf(stderr, "Error: Could not trim preallocated output (%s)\n", std::strerror(errsv));
+                std::exit(errsv);
+            }
+            close(this->get_out_fd());
+        }
+        this->delete_write_queue(&this->out_queue);
+#ifdef DEBUG
+        std::fprintf(stderr, "--- starch3::Starch::finalize_out_stream() ---\n");
+#endif
+    }
+
+    void Starch::initialize_write_queue(starch3::Starch::write_queue_t* wq) {
+        struct stat out_stats;
+        void* staging = NULL;
+        wq->next_in = 0;
+        wq->next_out = 0;
+        wq->count = 0;
+        wq->is_eof = false;
+        wq->out_fd = this->get_out_fd();
+        wq->next_fd = wq->out_fd;
+        /* appending descriptors ignore pwrite() offsets, so they are written sequentially */
+        wq->out_fd_is_seekable = (fstat(wq->out_fd, &out_stats) == 0) && S_ISREG(out_stats.st_mode) && !(fcntl(wq->out_fd, F_GETFL) & O_APPEND);
+        wq->next_offset = wq->out_fd_is_seekable ? lseek(wq->out_fd, 0, SEEK_CUR) : 0;
+        if (wq->next_offset < 0) {
+            wq->next_offset = 0;
+        }
+        if (posix_memalign(&staging, out_staging_alignment, out_staging_length) != 0) {
+            std::fprintf(stderr, "Error: Not enough memory for output staging buffer\n");
             std::exit(ENOMEM);
         }
-        sb->tf_buffer_capacity = tf_buffer_initial_length;
-        sb->tf_buffer_size = 0;
-
-#ifdef DEBUG
-        std::fprintf(stderr, "--- starch3::Starch::initialize_shared_buffer() ---\n");
-#endif
+        wq->staging = static_cast<char*>( staging );
+        wq->staging_size = 0;
+        wq->staging_offset = wq->next_offset;
+        wq->is_preallocating = false;
+        wq->preallocated_offset = wq->next_offset;
+        wq->is_inline = this->is_small_input();
+        pthread_mutex_init(&wq->lock, NULL);
+        pthread_cond_init(&wq->slot_is_available, NULL);
+        pthread_cond_init(&wq->block_is_available, NULL);
+#ifdef DEBUG
+        std::fprintf(stderr, "--- starch3::Starch::initialize_write_queue() ---\n");
+#endif
+    }
+
+    void Starch::delete_write_queue(starch3::Starch::write_queue_t* wq) {
+        pthread_mutex_destroy(&wq->lock);
+        pthread_cond_destroy(&wq->slot_is_available);
+        pthread_cond_destroy(&wq->block_is_available);
+        if (wq->staging) {
+            free(wq->staging);
+            wq->staging = NULL;
+            wq->staging_size = 0;
+        }
+#ifdef DEBUG
+        std::fprintf(stderr, "--- starch3::Starch::delete_write_queue() ---\n");
+#endif
+    }
+
+    std::string Starch::get_note(void) {
+        return _note;
+    }
+    
+    void Starch::set_note(std::string s) {
+        _note = s;
+    }
+
+    Starch::compression_method_t Starch::get_compression_method(void) {
+        return _compression_method;
+    }
+
+    bool Starch::is_auto(void) {
+        return _is_auto;
+    }
+
+    void Starch::set_auto(bool b) {
+        _is_auto = b;
+    }
+
+    Starch::optimize_objective_t Starch::get_optimize_objective(void) {
+        return _optimize_objective;
+    }
+
+    void Starch::set_optimize_objective(std::string s) {
+        if (s == "ratio") {
+            _optimize_objective = k_optimize_ratio;
+        }
+        else if (s == "speed") {
+            _optimize_objective = k_optimize_speed;
+        }
+        else if (s == "decode-speed") {
+            _optimize_objective = k_optimize_decode_speed;
+        }
+        else {
+            std::fprintf(stderr, "Error: Optimization objective must be one of ratio, speed or decode-speed (%s)\n", s.c_str());
+            std::exit(EINVAL);
+        }
+    }
+
+    void Starch::set_compression_method(Starch::compression_method_t t) {
+        _compression_method = t;
+    }
+
+    Starch::client_mode_t Starch::get_client_mode(void) {
+        return _client_mode;
+    }
+
+    void Starch::set_client_mode(Starch::client_mode_t m) {
+        _client_mode = m;
+    }
+
+    void Starch::write_archive_metadata(void) {
+        if (!this->get_shard_dir().empty()) {
+            /* each shard carries its own metadata */
+            return;
+        }
+        enqueue_archive_metadata(&this->out_queue, streams, this->get_note());
+#ifdef DEBUG
+        std::fprintf(stderr, "--- starch3::Starch::write_archive_metadata() ---\n");
+#endif
+    }
+
+    void Starch::read_archive_metadata(int in_fd, std::vector<stream_record_t>* s) {
+        std::string metadata_error;
+        if (Archive::read_metadata(in_fd, s, &metadata_error) != k_status_ok) {
+            std::fprintf(stderr, "Error: %s\n", metadata_error.c_str());
+            std::exit(EINVAL);
+        }
+#ifdef DEBUG
+        std::fprintf(stderr, "--- starch3::Starch::read_archive_metadata() ---\n");
+#endif
+    }
+
+    int Starch::verify_archive(void) {
+        verify_state_t vs;
+        std::vector<verify_job_t> jobs;
+        std::vector<std::vector<size_t> > job_idxs;
+        std::vector<int> results;
+        std::vector<pthread_t> workers;
+        long n_workers = this->get_thread_count();
+        int exit_status = EXIT_SUCCESS;
+        if (this->get_input_fn().empty()) {
+            std::fprintf(stderr, "Error: Verification requires an archive filename\n");
+            this->print_usage(stderr);
+            std::exit(ENODATA);
+        }
+        vs.in_fd = open(this->get_input_fn().c_str(), O_RDONLY);
+        if (vs.in_fd == -1) {
+            int errsv = errno;
+            std::fprintf(stderr, "Error: Archive could not be opened (%s)\n", std::strerror(errsv));
+            std::exit(errsv);
+        }
+        this->read_archive_metadata(vs.in_fd, &this->streams);
+        results.assign(this->streams.size(), EXIT_FAILURE);
+        job_idxs.resize(this->streams.size());
+        /* chunk records of packed chromosomes follow one another in archive order, so each distinct chunk is one job */
+        for (size_t stream_idx = 0; stream_idx < this->streams.size(); stream_idx++) {
+            const stream_record_t& s = this->streams[stream_idx];
+            for (size_t chunk_idx = 0; chunk_idx < s.chunks.size(); chunk_idx++) {
+                if (!jobs.empty()) {
+                    const std::pair<size_t, size_t>& last = jobs.back().parts.back();
+                    const chunk_record_t& lc = this->streams[last.first].chunks[last.second];
+                    if ((lc.offset == s.chunks[chunk_idx].offset) && (lc.size == s.chunks[chunk_idx].size)) {
+                        jobs.back().parts.push_back(std::make_pair(stream_idx, chunk_idx));
+                        job_idxs[stream_idx].push_back(jobs.size() - 1);
+                        continue;
+                    }
+                }
+                jobs.push_back(verify_job_t());
+                jobs.back().parts.push_back(std::make_pair(stream_idx, chunk_idx));
+                jobs.back().result = EXIT_FAILURE;
+                job_idxs[stream_idx].push_back(jobs.size() - 1);
+            }
+        }
+        vs.next_job = 0;
+        vs.streams = &this->streams;
+        vs.jobs = &jobs;
+        pthread_mutex_init(&vs.lock, NULL);
+        if (n_workers < 1) {
+            n_workers = 1;
+        }
+        if (static_cast<size_t>( n_workers ) > jobs.size()) {
+            n_workers = static_cast<long>( std::max(jobs.size(), static_cast<size_t>( 1 )) );
+        }
+        workers.resize(static_cast<size_t>( n_workers ));
+        for (std::vector<pthread_t>::iterator w = workers.begin(); w != workers.end(); ++w) {
+            pthread_create(&*w, NULL, verify_chunks, &vs);
+        }
+        for (std::vector<pthread_t>::iterator w = workers.begin(); w != workers.end(); ++w) {
+            pthread_join(*w, NULL);
+        }
+        pthread_mutex_destroy(&vs.lock);
+        close(vs.in_fd);
+        /* a stream's checksum combines those of its chunks, as compression computed it */
+        for (size_t stream_idx = 0; stream_idx < this->streams.size(); stream_idx++) {
+            const stream_record_t& s = this->streams[stream_idx];
+            uint32_t stream_crc32c = 0;
+            int result = EXIT_SUCCESS;
+            for (size_t chunk_idx = 0; chunk_idx < s.chunks.size(); chunk_idx++) {
+                const verify_job_t& job = jobs[job_idxs[stream_idx][chunk_idx]];
+                if (job.result != EXIT_SUCCESS) {
+                    result = EXIT_FAILURE;
+                    break;
+                }
+                stream_crc32c = (chunk_idx == 0) ? job.crc32c : CRC32C::combine(stream_crc32c, job.crc32c, s.chunks[chunk_idx].size);
+            }
+            if ((result == EXIT_SUCCESS) && (stream_crc32c != s.compressed_crc32c)) {
+                std::fprintf(stderr, "Error: Stream [%s] has checksum [%08x] (expected [%08x])\n", s.chr.c_str(), stream_crc32c, s.compressed_crc32c);
+                result = EXIT_FAILURE;
+            }
+            results[stream_idx] = result;
+        }
+        for (size_t idx = 0; idx < this->streams.size(); idx++) {
+            std::fprintf(stdout, "%s\t%s\n", this->streams[idx].chr.c_str(), (results[idx] == EXIT_SUCCESS) ? "OK" : "FAILED");
+            if (results[idx] != EXIT_SUCCESS) {
+                exit_status = EXIT_FAILURE;
+            }
+        }
+        return exit_status;
+    }
+
+    void Starch::add_selected_chr(std::string s) {
+        _selected_chrs.insert(s);
+    }
+
+    void Starch::add_query(std::string s) {
+        query_region_t r;
+        std::string chr;
+        if (!parse_query_region(s, &chr, &r)) {
+            std::fprintf(stderr, "Error: Query [%s] is not of the form chr:start-stop, with start less than stop\n", s.c_str());
+            std::exit(EINVAL);
+        }
+        _query_regions[chr].push_back(r);
+    }
+
+    /* reads regions from the first three columns of a BED file, in any order */
+    void Starch::read_query_regions(std::string fn) {
+        FILE* regions_fp = std::fopen(fn.c_str(), "r");
+        char* line = NULL;
+        size_t line_capacity = 0;
+        ssize_t line_length = 0;
+        int64_t line_number = 0;
+        char chr[256] = {0};
+        query_region_t r;
+        if (!regions_fp) {
+            int errsv = errno;
+            std::fprintf(stderr, "Error: Regions file could not be opened [%s] (%s)\n", fn.c_str(), std::strerror(errsv));
+            std::exit(errsv);
+        }
+        while ((line_length = getline(&line, &line_capacity, regions_fp)) != -1) {
+            line_number++;
+            if ((line_length <= 1) || (line[0] == '#') || (std::strncmp(line, "track", 5) == 0) || (std::strncmp(line, "browser", 7) == 0)) {
+                continue;
+            }
+            if ((std::sscanf(line, "%255s %" SCNd64 " %" SCNd64, chr, &r.start, &r.stop) != 3) || (r.start < 0) || (r.start >= r.stop)) {
+                std::fprintf(stderr, "Error: Line [%" PRId64 "] of regions file [%s] is not a valid BED interval\n", line_number, fn.c_str());
+                std::exit(EINVAL);
+            }
+            _query_regions[chr].push_back(r);
+        }
+        free(line);
+        std::fclose(regions_fp);
+    }
+
+    /* sorts each chromosome's regions and merges overlaps, so a record matching several regions is written once */
+    void Starch::merge_query_regions(void) {
+        for (std::map<std::string, std::vector<query_region_t> >::iterator q = _query_regions.begin(); q != _query_regions.end(); ++q) {
+            std::vector<query_region_t>& regions = q->second;
+            std::vector<query_region_t> merged;
+            std::sort(regions.begin(), regions.end(), query_region_is_before);
+            for (std::vector<query_region_t>::iterator r = regions.begin(); r != regions.end(); ++r) {
+                if (!merged.empty() && (r->start <= merged.back().stop)) {
+                    merged.back().stop = std::max(merged.back().stop, r->stop);
+                }
+                else {
+                    merged.push_back(*r);
+                }
+            }
+            regions.swap(merged);
+        }
     }
 
-    void Starch::delete_shared_buffer(starch3::Starch::shared_buffer_t* sb) {
-        pthread_mutex_destroy(&sb->lock);
-        pthread_cond_destroy(&sb->new_line_is_available);
-        pthread_cond_destroy(&sb->new_line_is_empty);
-        pthread_cond_destroy(&sb->new_chromosome_is_available);
-        pthread_cond_destroy(&sb->new_tf_buffer_is_available);
-        fclose(sb->in_stream);
-        if (sb->in_line) {
-            free(sb->in_line);
-            sb->in_line = NULL;
-            sb->in_line_capacity = 0;
+    /*
+       Tallies records and bases per window. Chunks that lie inside a window are added from their
+       zone maps; only chunks that straddle a window boundary are decoded, in parallel. Windows are
+       written in sort-bed order, with zeros for chromosomes the archive lacks.
+    */
+    int Starch::summarize_archive(void) {
+        summary_state_t ss;
+        std::vector<summary_job_t> jobs;
+        std::vector<std::vector<summary_totals_t> > worker_totals;
+        std::vector<summary_totals_t> totals;
+        std::vector<pthread_t> workers;
+        std::map<std::string, summary_job_t> chr_windows;
+        std::map<std::string, summary_job_t>::iterator c;
+        summary_totals_t zero_totals = { 0, 0 };
+        long n_workers = this->get_thread_count();
+        size_t n_windows = 0;
+        summary_job_t job;
+        if (this->get_input_fn().empty()) {
+            std::fprintf(stderr, "Error: Summary requires an archive filename\n");
+            this->print_usage(stderr);
+            std::exit(ENODATA);
         }
-        if (sb->tf_state) {
-            this->delete_transformation_state(&sb->tf_state);
-            free(sb->tf_state);
-            sb->tf_state = NULL;
+        if (_query_regions.empty()) {
+            std::fprintf(stderr, "Error: Summary requires windows from --query or --regions\n");
+            this->print_usage(stderr);
+            std::exit(EINVAL);
         }
-        if (sb->bed) {
-            if (sb->bed->chr) {
-                free(sb->bed->chr);
-                sb->bed->chr = NULL;
-                sb->bed->chr_capacity = 0;
+        ss.in_fd = open(this->get_input_fn().c_str(), O_RDONLY);
+        if (ss.in_fd == -1) {
+            int errsv = errno;
+            std::fprintf(stderr, "Error: Archive could not be opened (%s)\n", std::strerror(errsv));
+            std::exit(errsv);
+        }
+        this->read_archive_metadata(ss.in_fd, &this->streams);
+        /* windows are kept as given, not merged, since each is reported on its own */
+        for (std::map<std::string, std::vector<query_region_t> >::iterator q = _query_regions.begin(); q != _query_regions.end(); ++q) {
+            std::sort(q->second.begin(), q->second.end(), query_region_is_before);
+            job.windows = &q->second;
+            job.window_offset = n_windows;
+            job.max_window_length = 0;
+            for (std::vector<query_region_t>::iterator w = q->second.begin(); w != q->second.end(); ++w) {
+                job.max_window_length = std::max(job.max_window_length, w->stop - w->start);
             }
-            if (sb->bed->start_str) {
-                free(sb->bed->start_str);
-                sb->bed->start_str = NULL;
-                sb->bed->start_str_capacity = 0;
+            chr_windows[q->first] = job;
+            n_windows += q->second.size();
+        }
+        totals.assign(n_windows, zero_totals);
+        for (job.stream_idx = 0; job.stream_idx < this->streams.size(); job.stream_idx++) {
+            const stream_record_t& s = this->streams[job.stream_idx];
+            if ((c = chr_windows.find(s.chr)) == chr_windows.end()) {
+                continue;
             }
-            if (sb->bed->stop_str) {
-                free(sb->bed->stop_str);
-                sb->bed->stop_str = NULL;
-                sb->bed->stop_str_capacity = 0;
+            job.windows = c->second.windows;
+            job.window_offset = c->second.window_offset;
+            job.max_window_length = c->second.max_window_length;
+            const std::vector<query_region_t>& windows = *job.windows;
+            for (job.chunk_idx = 0; job.chunk_idx < s.chunks.size(); job.chunk_idx++) {
+                const chunk_record_t& cr = s.chunks[job.chunk_idx];
+                bool is_decoded = false;
+                for (size_t w = first_candidate_window(windows, cr.min_start, job.max_window_length); (w < windows.size()) && (windows[w].start < cr.max_stop); w++) {
+                    if (!Archive::chunk_overlaps(cr, windows[w].start, windows[w].stop)) {
+                        continue;
+                    }
+                    if (window_contains_chunk(windows[w], cr)) {
+                        totals[job.window_offset + w].count += cr.line_count;
+                        totals[job.window_offset + w].bases += cr.base_count;
+                    }
+                    else {
+                        is_decoded = true;
+                    }
+                }
+                if (is_decoded) {
+                    jobs.push_back(job);
+                }
             }
-            if (sb->bed->rem) {
-                free(sb->bed->rem);
-                sb->bed->rem = NULL;
-                sb->bed->rem_capacity = 0;
+        }
+#ifdef DEBUG
+        std::fprintf(stderr, "Debug: Summary decodes [%zu] chunks\n", jobs.size());
+#endif
+        if (n_workers < 1) {
+            n_workers = 1;
+        }
+        if (static_cast<size_t>( n_workers ) > jobs.size()) {
+            n_workers = static_cast<long>( jobs.size() );
+        }
+        worker_totals.assign(static_cast<size_t>( n_workers ), totals);
+        for (std::vector<std::vector<summary_totals_t> >::iterator t = worker_totals.begin(); t != worker_totals.end(); ++t) {
+            t->assign(n_windows, zero_totals);
+        }
+        ss.next_job = 0;
+        ss.next_worker = 0;
+        ss.is_failed = false;
+        ss.streams = &this->streams;
+        ss.jobs = &jobs;
+        ss.worker_totals = &worker_totals;
+        pthread_mutex_init(&ss.lock, NULL);
+        workers.resize(static_cast<size_t>( n_workers ));
+        for (std::vector<pthread_t>::iterator w = workers.begin(); w != workers.end(); ++w) {
+            pthread_create(&*w, NULL, summarize_chunks, &ss);
+        }
+        for (std::vector<pthread_t>::iterator w = workers.begin(); w != workers.end(); ++w) {
+            pthread_join(*w, NULL);
+        }
+        pthread_mutex_destroy(&ss.lock);
+        close(ss.in_fd);
+        if (ss.is_failed) {
+            return EXIT_FAILURE;
+        }
+        for (std::vector<std::vector<summary_totals_t> >::iterator t = worker_totals.begin(); t != worker_totals.end(); ++t) {
+            for (size_t w = 0; w < n_windows; w++) {
+                totals[w].count += (*t)[w].count;
+                totals[w].bases += (*t)[w].bases;
             }
-            free(sb->bed);
-            sb->bed = NULL;
         }
-        if (sb->tf_line) {
-            free(sb->tf_line);
-            sb->tf_line = NULL;
-            sb->tf_line_capacity = 0;
+        for (c = chr_windows.begin(); c != chr_windows.end(); ++c) {
+            const std::vector<query_region_t>& windows = *c->second.windows;
+            for (size_t w = 0; w < windows.size(); w++) {
+                const summary_totals_t& t = totals[c->second.window_offset + w];
+                std::fprintf(stdout, "%s\t%" PRId64 "\t%" PRId64 "\t%" PRId64 "\t%" PRId64 "\n", c->first.c_str(), windows[w].start, windows[w].stop, t.count, t.bases);
+            }
         }
-        if (sb->tf_buffer) {
-            free(sb->tf_buffer);
-            sb->tf_buffer = NULL;
-            sb->tf_buffer_capacity = 0;
-            sb->tf_buffer_size = 0;
+        if (std::fflush(stdout) != 0) {
+            int errsv = errno;
+            std::fprintf(stderr, "Error: Could not write summary (%s)\n", std::strerror(errsv));
+            std::exit(errsv);
         }
-#ifdef DEBUG
-        std::fprintf(stderr, "--- starch3::Starch::delete_shared_buffer() ---\n");
-#endif
+        return EXIT_SUCCESS;
     }
 
-    FILE* Starch::get_in_stream(void) {
-        return _in_stream;
+    std::string Starch::get_serve_socket_fn(void) {
+        return _serve_socket_fn;
     }
 
-    void Starch::initialize_in_stream(void) {
-        FILE* in_fp = NULL;
-        in_fp = this->get_input_fn().empty() ? stdin : fopen(this->get_input_fn().c_str(), "r");
-        if (!in_fp) {
-            std::fprintf(stderr, "Error: Input file handle could not be created\n");
-            std::exit(ENODATA); /* No message is available on the STREAM head read queue (POSIX.1) */
-        }
-        this->set_in_stream(in_fp);
+    void Starch::set_serve_socket_fn(std::string s) {
+        _serve_socket_fn = s;
     }
 
-    void Starch::set_in_stream(FILE* is) {
-        _in_stream = is;
+    std::string Starch::get_columnar_fn(void) {
+        return _columnar_fn;
     }
 
-    std::string Starch::get_input_fn(void) {
-        return _input_fn;
-    }
-    
-    void Starch::set_input_fn(std::string s) {
-        struct stat buf;
-        if (stat(s.c_str(), &buf) == 0) {
-            _input_fn = s;
-        }
-        else {
-            std::fprintf(stderr, "Error: Input file does not exist (%s)\n", s.c_str());
-            std::exit(ENODATA); /* No message is available on the STREAM head read queue (POSIX.1) */
-        }
+    void Starch::set_columnar_fn(std::string s) {
+        _columnar_fn = s;
     }
 
-    void Starch::set_out_stream(FILE* wo_stream) {
-        _out_stream = wo_stream;
+    void Starch::add_archive_fn(std::string s) {
+        _archive_fns.push_back(s);
     }
 
-    FILE* Starch::get_out_stream(void) {
-        return _out_stream;
+    bool Starch::is_record_range_set(void) {
+        return _record_range.start >= 0;
     }
 
-    void Starch::initialize_out_stream(void) {
-        FILE* out_fp = stdout;
-        this->set_out_stream(out_fp);
-        std::fwrite(_header_magic_bytes, sizeof(unsigned char), 4, out_fp);
-    }
-
-    void Starch::initialize_out_compression_stream(void) {
-        switch (this->get_compression_method()) {
-        case k_bzip2:
-            this->initialize_bz_stream_ptr();
-            this->setup_bz_stream_callbacks(this);
-            break;
-        case k_gzip:
-            std::fprintf(stderr, "Error: This method is unsupported at this time\n");
-            std::exit(ENOSYS);
-        case k_compression_method_undefined:
-            std::fprintf(stderr, "Error: This method is undefined\n");
-            std::exit(ENOSYS);
-            break;
-        }
-    }
-
-    void Starch::delete_out_compression_stream(void) {
-        switch (this->get_compression_method()) {
-        case k_bzip2:
-            this->delete_bz_stream_ptr();
-            break;
-        case k_gzip:
-            std::fprintf(stderr, "Error: This method is unsupported at this time\n");
-            std::exit(ENOSYS);
-            break;
-        case k_compression_method_undefined:
-            std::fprintf(stderr, "Error: This method is undefined\n");
-            std::exit(ENOSYS);
-            break;
+    void Starch::set_record_range(std::string s) {
+        if (!parse_range(s, &_record_range)) {
+            std::fprintf(stderr, "Error: Record range [%s] is not of the form first-last, with first less than last\n", s.c_str());
+            std::exit(EINVAL);
         }
     }
-    
-    std::string Starch::get_note(void) {
-        return _note;
-    }
-    
-    void Starch::set_note(std::string s) {
-        _note = s;
+
+    int64_t Starch::get_sample_size(void) {
+        return _sample_size;
     }
 
-    Starch::compression_method_t Starch::get_compression_method(void) {
-        return _compression_method;
+    void Starch::set_sample_size(std::string s) {
+        char* end_ptr = NULL;
+        errno = 0;
+        long long n = std::strtoll(s.c_str(), &end_ptr, 10);
+        if ((end_ptr == s.c_str()) || (*end_ptr != '\0') || (errno != 0) || (n < 0)) {
+            std::fprintf(stderr, "Error: Sample size [%s] is not a count of records\n", s.c_str());
+            std::exit(EINVAL);
+        }
+        _sample_size = static_cast<int64_t>( n );
     }
 
-    void Starch::set_compression_method(Starch::compression_method_t t) {
-        _compression_method = t;
+    void Starch::set_sample_seed(std::string s) {
+        char* end_ptr = NULL;
+        errno = 0;
+        unsigned long long seed = std::strtoull(s.c_str(), &end_ptr, 10);
+        if ((end_ptr == s.c_str()) || (*end_ptr != '\0') || (errno != 0)) {
+            std::fprintf(stderr, "Error: Seed [%s] is not an unsigned integer\n", s.c_str());
+            std::exit(EINVAL);
+        }
+        _sample_seed = static_cast<uint64_t>( seed );
     }
 
-    void Starch::initialize_bz_stream_ptr(void) { 
-        try {
-            _bz_stream_ptr = new bz_stream; 
+    /*
+       Fills records with the sorted, merged ordinal ranges of --records or --sample, counted across the
+       archive's streams. Samples are drawn without replacement with Floyd's algorithm, which takes one
+       draw per sampled record however large the archive is.
+    */
+    void Starch::select_records(std::vector<query_region_t>* records) {
+        std::unordered_set<int64_t> sampled;
+        std::vector<int64_t> ordinals;
+        int64_t record_count = 0;
+        query_region_t r;
+        records->clear();
+        for (std::vector<stream_record_t>::const_iterator s = this->streams.begin(); s != this->streams.end(); ++s) {
+            record_count += s->line_count;
+        }
+        if (this->is_record_range_set()) {
+            if (_record_range.start < record_count) {
+                r.start = _record_range.start;
+                r.stop = std::min(_record_range.stop, record_count);
+                records->push_back(r);
+            }
+            return;
+        }
+        if (this->get_sample_size() < 0) {
+            return;
         }
-        catch (std::bad_alloc& ba) {
-            std::fprintf(stderr, "Error: Could not allocate space for bz_stream pointer (%s)\n", ba.what());
+        if (this->get_sample_size() >= record_count) {
+            if (record_count > 0) {
+                r.start = 0;
+                r.stop = record_count;
+                records->push_back(r);
+            }
+            return;
         }
-        // using standard malloc / free routines in bz2 library 
-        // cf. http://www.bzip.org/1.0.3/html/low-level.html
-        _bz_stream_ptr->bzalloc = NULL;
-        _bz_stream_ptr->bzfree = NULL;
-        _bz_stream_ptr->opaque = NULL;
-        // blockSize100k - 9 (900 kB)
-        // verbosity - 0 or 4 (silent or most verbose)
-        // workFactor - 30 (default)
 #ifdef DEBUG
-        int init_res = BZ2_bzCompressInit(_bz_stream_ptr, 9, 4, 30);
-#else
-        int init_res = BZ2_bzCompressInit(_bz_stream_ptr, 9, 0, 30);
+        std::fprintf(stderr, "Debug: Sampling [%" PRId64 "] of [%" PRId64 "] records with seed [%" PRIu64 "]\n", this->get_sample_size(), record_count, _sample_seed);
 #endif
-        switch (init_res) {
-        case BZ_CONFIG_ERROR:
-            std::fprintf(stderr, "Error: bzip2 initialization failed - library was miscompiled\n");
-            std::exit(EINVAL);
-        case BZ_PARAM_ERROR:
-            std::fprintf(stderr, "Error: bzip2 initialization failed - incorrect parameters\n");
-            std::exit(EINVAL);
-        case BZ_MEM_ERROR:
-            std::fprintf(stderr, "Error: bzip2 initialization failed - insufficient memory\n");
+        std::mt19937_64 rng(_sample_seed);
+        sampled.reserve(static_cast<size_t>( this->get_sample_size() ));
+        for (int64_t j = record_count - this->get_sample_size(); j < record_count; j++) {
+            std::uniform_int_distribution<int64_t> draw(0, j);
+            int64_t t = draw(rng);
+            sampled.insert(sampled.count(t) ? j : t);
+        }
+        ordinals.assign(sampled.begin(), sampled.end());
+        std::sort(ordinals.begin(), ordinals.end());
+        for (std::vector<int64_t>::const_iterator o = ordinals.begin(); o != ordinals.end(); ++o) {
+            if (!records->empty() && (records->back().stop == *o)) {
+                records->back().stop++;
+            }
+            else {
+                r.start = *o;
+                r.stop = *o + 1;
+                records->push_back(r);
+            }
+        }
+    }
+
+    void Starch::set_cache_size(std::string s) {
+        char* end_ptr = NULL;
+        errno = 0;
+        long long mib = std::strtoll(s.c_str(), &end_ptr, 10);
+        if ((end_ptr == s.c_str()) || (*end_ptr != '\0') || (errno != 0) || (mib < 0)) {
+            std::fprintf(stderr, "Error: Cache size [%s] is not a count of MiB\n", s.c_str());
             std::exit(EINVAL);
-        case BZ_OK:
+        }
+        _cache_size = static_cast<size_t>( mib ) << 20;
+    }
+
+    /* threads for compression and for the parallel stages of other modes; unless set, as many as the process is allotted */
+    long Starch::get_thread_count(void) {
+        if (_thread_count < 1) {
+            _thread_count = TaskPool::allotted_cpus();
 #ifdef DEBUG
-            std::fprintf(stderr, "--- starch3::Starch::initialize_bz_stream_ptr() ---\n");
+            std::fprintf(stderr, "Debug: Allotted [%ld] CPU(s)\n", _thread_count);
 #endif
-            break;
         }
+        return _thread_count;
     }
 
-    void Starch::setup_bz_stream_callbacks(starch3::Starch* h) {
-        if (!_bz_stream_ptr)
-            return;
-        _bz_stream_ptr->handler = &h;
-        _bz_stream_ptr->block_close_functor = bzip2_block_close_static_callback;
+    void Starch::set_thread_count(std::string s) {
+        char* end_ptr = NULL;
+        errno = 0;
+        long n = std::strtol(s.c_str(), &end_ptr, 10);
+        if ((end_ptr == s.c_str()) || (*end_ptr != '\0') || (errno != 0) || (n < 1)) {
+            std::fprintf(stderr, "Error: Thread count [%s] is not a positive integer\n", s.c_str());
+            std::exit(EINVAL);
+        }
+        _thread_count = n;
     }
 
-    void Starch::delete_bz_stream_ptr(void) {
-        if (!_bz_stream_ptr)
-            return;
-        // release all memory associated with the compression stream before ptr deletion
-        int end_res = BZ2_bzCompressEnd(_bz_stream_ptr);
-        switch (end_res) {
-        case BZ_PARAM_ERROR:
-            std::fprintf(stderr, "Error: Could not release internals of bz_stream pointer\n");
-            std::exit(EINVAL);
-        case BZ_OK:
+    bool Starch::is_pinned(void) {
+        return _is_pinned;
+    }
+
+    void Starch::set_pinned(bool b) {
+        _is_pinned = b;
+    }
+
+    /*
+       Keeps archives mapped and answers requests on a Unix socket from a pool of workers, which
+       share one LRU cache of decoded chunks. SIGINT or SIGTERM stops the server, which then
+       reports cache counters on stderr.
+    */
+    int Starch::serve_archives(void) {
+        serve_state_t ss;
+        std::vector<served_archive_t> archives;
+        std::vector<pthread_t> workers;
+        struct sockaddr_un addr;
+        struct sigaction sa;
+        struct stat archive_stats;
+        long n_workers = std::max(this->get_thread_count(), static_cast<long>( serve_min_workers ));
+        int listen_fd = -1;
+        int fd = -1;
+        if (_archive_fns.empty()) {
+            std::fprintf(stderr, "Error: Serving requires at least one archive filename\n");
+            this->print_usage(stderr);
+            std::exit(ENODATA);
+        }
+        if (this->get_serve_socket_fn().size() >= sizeof(addr.sun_path)) {
+            std::fprintf(stderr, "Error: Socket path is too long [%s]\n", this->get_serve_socket_fn().c_str());
+            std::exit(ENAMETOOLONG);
+        }
+        archives.resize(_archive_fns.size());
+        for (size_t idx = 0; idx < _archive_fns.size(); idx++) {
+            served_archive_t& a = archives[idx];
+            a.fn = _archive_fns[idx];
+            a.fd = open(a.fn.c_str(), O_RDONLY);
+            if ((a.fd == -1) || (fstat(a.fd, &archive_stats) == -1)) {
+                int errsv = errno;
+                std::fprintf(stderr, "Error: Archive could not be opened [%s] (%s)\n", a.fn.c_str(), std::strerror(errsv));
+                std::exit(errsv);
+            }
+            this->read_archive_metadata(a.fd, &a.streams);
+            for (std::vector<stream_record_t>::iterator s = a.streams.begin(); s != a.streams.end(); ++s) {
+                a.stream_chrs.push_back(a.chrs.intern(s->chr));
+            }
+            a.map_size = static_cast<size_t>( archive_stats.st_size );
+            void* map = mmap(NULL, a.map_size, PROT_READ, MAP_SHARED, a.fd, 0);
+            if (map == MAP_FAILED) {
+                int errsv = errno;
+                std::fprintf(stderr, "Error: Archive could not be mapped [%s] (%s)\n", a.fn.c_str(), std::strerror(errsv));
+                std::exit(errsv);
+            }
+            a.map = static_cast<const char*>( map );
+        }
+        listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd == -1) {
+            int errsv = errno;
+            std::fprintf(stderr, "Error: Socket could not be created (%s)\n", std::strerror(errsv));
+            std::exit(errsv);
+        }
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        std::strncpy(addr.sun_path, this->get_serve_socket_fn().c_str(), sizeof(addr.sun_path) - 1);
+        /* a socket left behind by an earlier server would block the bind */
+        if ((lstat(addr.sun_path, &archive_stats) == 0) && S_ISSOCK(archive_stats.st_mode)) {
+            unlink(addr.sun_path);
+        }
+        if ((bind(listen_fd, reinterpret_cast<struct sockaddr*>( &addr ), sizeof(addr)) == -1) || (listen(listen_fd, SOMAXCONN) == -1)) {
+            int errsv = errno;
+            std::fprintf(stderr, "Error: Socket could not be bound [%s] (%s)\n", addr.sun_path, std::strerror(errsv));
+            std::exit(errsv);
+        }
+        /* no SA_RESTART, so that a signal interrupts accept() */
+        std::memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = handle_serve_signal;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        signal(SIGPIPE, SIG_IGN);
+        ChunkCache cache(_cache_size);
+        ss.is_stopping = false;
+        ss.archives = &archives;
+        ss.cache = &cache;
+        pthread_mutex_init(&ss.lock, NULL);
+        pthread_cond_init(&ss.connection_is_available, NULL);
+        workers.resize(static_cast<size_t>( n_workers ));
+        for (std::vector<pthread_t>::iterator w = workers.begin(); w != workers.end(); ++w) {
+            pthread_create(&*w, NULL, serve_connections, &ss);
+        }
 #ifdef DEBUG
-            std::fprintf(stderr, "--- starch3::Starch::delete_bz_stream_ptr() ---\n");
+        std::fprintf(stderr, "Debug: Serving [%zu] archive(s) on [%s] with [%ld] workers\n", archives.size(), addr.sun_path, n_workers);
 #endif
-            delete _bz_stream_ptr; 
-            break;
+        while (!this->serve_is_stopping) {
+            fd = accept(listen_fd, NULL, NULL);
+            if (fd == -1) {
+                if ((errno == EINTR) || (errno == ECONNABORTED)) {
+                    continue;
+                }
+                int errsv = errno;
+                std::fprintf(stderr, "Error: Could not accept connection (%s)\n", std::strerror(errsv));
+                break;
+            }
+            pthread_mutex_lock(&ss.lock);
+            ss.connections.push_back(fd);
+            pthread_cond_signal(&ss.connection_is_available);
+            pthread_mutex_unlock(&ss.lock);
+        }
+        close(listen_fd);
+        unlink(addr.sun_path);
+        /* wake idle workers and hang up on clients, so that every worker returns */
+        pthread_mutex_lock(&ss.lock);
+        ss.is_stopping = true;
+        for (std::set<int>::iterator a = ss.active.begin(); a != ss.active.end(); ++a) {
+            shutdown(*a, SHUT_RDWR);
         }
+        for (std::deque<int>::iterator c = ss.connections.begin(); c != ss.connections.end(); ++c) {
+            close(*c);
+        }
+        ss.connections.clear();
+        pthread_cond_broadcast(&ss.connection_is_available);
+        pthread_mutex_unlock(&ss.lock);
+        for (std::vector<pthread_t>::iterator w = workers.begin(); w != workers.end(); ++w) {
+            pthread_join(*w, NULL);
+        }
+        pthread_cond_destroy(&ss.connection_is_available);
+        pthread_mutex_destroy(&ss.lock);
+        for (std::vector<served_archive_t>::iterator a = archives.begin(); a != archives.end(); ++a) {
+            munmap(const_cast<char*>( a->map ), a->map_size);
+            close(a->fd);
+        }
+        ChunkCache::stats_t cs = cache.stats();
+        uint64_t lookups = cs.hits + cs.misses;
+        std::fprintf(stderr, "Cache hits [%" PRIu64 "] misses [%" PRIu64 "] hit rate [%.2f%%] evictions [%" PRIu64 "]\n", cs.hits, cs.misses, (lookups > 0) ? 100.0 * static_cast<double>( cs.hits ) / static_cast<double>( lookups ) : 0.0, cs.evictions);
+        return EXIT_SUCCESS;
     }
 
-    void Starch::bzip2_block_close_static_callback(void* s) {
-        reinterpret_cast<starch3::Starch*>(s)->bzip2_block_close_callback();
+    /*
+       Merges sorted archives into one sorted stream: text on stdout, or an archive when --output is
+       given. Workers merge whole chromosomes with a heap over per-archive cursors, and the writer
+       takes their pieces in chromosome order. Queued pieces per chromosome are capped, and the worker
+       count is capped so that every worker's decoded chunks fit the memory budget.
+    */
+    int Starch::merge_archives(void) {
+        merge_state_t ms;
+        std::vector<merge_archive_t> archives;
+        ChrTable chr_names;
+        std::vector<ChrTable::chr_id_t> chrs;
+        std::vector<std::vector<std::pair<size_t, size_t> > > chr_streams;
+        std::vector<size_t> group_starts;
+        std::vector<uint64_t> chr_tf_sizes;
+        std::vector<char> is_joined;
+        std::vector<std::deque<merge_piece_t> > pieces;
+        std::vector<char> is_chr_done;
+        std::vector<pthread_t> workers;
+        std::vector<stream_record_t> merged_streams;
+        merge_piece_t piece;
+        long n_workers = this->get_thread_count();
+        long max_workers = 0;
+        int out_fd = STDOUT_FILENO;
+        off_t offset = 0;
+        off_t chunk_offset = 0;
+        uint64_t group_tf_size = 0;
+        int exit_status = EXIT_SUCCESS;
+        if (_archive_fns.empty()) {
+            std::fprintf(stderr, "Error: Merging requires at least one archive filename\n");
+            this->print_usage(stderr);
+            std::exit(ENODATA);
+        }
+        archives.resize(_archive_fns.size());
+        for (size_t idx = 0; idx < _archive_fns.size(); idx++) {
+            merge_archive_t& a = archives[idx];
+            a.fn = _archive_fns[idx];
+            a.fd = open(a.fn.c_str(), O_RDONLY);
+            if (a.fd == -1) {
+                int errsv = errno;
+                std::fprintf(stderr, "Error: Archive could not be opened [%s] (%s)\n", a.fn.c_str(), std::strerror(errsv));
+                std::exit(errsv);
+            }
+            this->read_archive_metadata(a.fd, &a.streams);
+            /* workers look up a chromosome's streams here instead of scanning every archive for it */
+            for (size_t s = 0; s < a.streams.size(); s++) {
+                ChrTable::chr_id_t chr_id = chr_names.intern(a.streams[s].chr);
+                if (chr_id >= chr_streams.size()) {
+                    chr_streams.resize(chr_id + 1);
+                }
+                chr_streams[chr_id].push_back(std::make_pair(idx, s));
+            }
+        }
+        /* chromosomes in the lexicographic order that compression checks for */
+        chrs = chr_names.ranked_ids();
+        pieces.resize(chrs.size());
+        is_chr_done.assign(chrs.size(), 0);
+        /*
+           Workers claim groups of chromosomes. Chromosomes that share a chunk in any input are grouped,
+           along with any that sort between them, so the chunk is decoded once. Runs of chromosomes small
+           enough to be packed are grouped too, so the worker can pack them into shared chunks as
+           compression does. A group stops growing at about a chunk of transformed bytes, which keeps
+           workers busy; a chunk shared across a group boundary is decoded once by each group.
+        */
+        chr_tf_sizes.assign(chrs.size(), 0);
+        is_joined.assign(chrs.size(), 0);
+        for (std::vector<merge_archive_t>::const_iterator a = archives.begin(); a != archives.end(); ++a) {
+            for (size_t s = 0; s < a->streams.size(); s++) {
+                size_t rank = chr_names.rank(chr_names.find(a->streams[s].chr));
+                chr_tf_sizes[rank] += a->streams[s].tf_size;
+                if ((s > 0) && !a->streams[s - 1].chunks.empty() && !a->streams[s].chunks.empty() && (a->streams[s - 1].chunks.back().offset == a->streams[s].chunks.front().offset)) {
+                    for (size_t r = chr_names.rank(chr_names.find(a->streams[s - 1].chr)) + 1; r <= rank; r++) {
+                        is_joined[r] = 1;
+                    }
+                }
+            }
+        }
+        for (size_t r = 0; r < chrs.size(); r++) {
+            bool is_shared = is_joined[r] && (group_tf_size < Archive::chunk_length);
+            bool is_packable = (r > 0) && (chr_tf_sizes[r - 1] < packed_chr_max_length) && (chr_tf_sizes[r] < packed_chr_max_length) && (group_tf_size + chr_tf_sizes[r] < Archive::chunk_length);
+            if ((r == 0) || (!is_shared && !is_packable)) {
+                group_starts.push_back(r);
+                group_tf_size = 0;
+            }
+            group_tf_size += chr_tf_sizes[r];
+        }
+        group_starts.push_back(chrs.size());
+        /* each worker holds a compressed and a transformed chunk per archive */
+        max_workers = static_cast<long>( merge_memory_budget / (archives.size() * 2 * Archive::chunk_length) );
+        n_workers = std::max(1L, std::min(n_workers, max_workers));
+        if (static_cast<size_t>( n_workers ) + 1 > group_starts.size()) {
+            n_workers = static_cast<long>( std::max(group_starts.size() - 1, static_cast<size_t>( 1 )) );
+        }
+        if (!this->get_output_fn().empty()) {
+            out_fd = open(this->get_output_fn().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (out_fd == -1) {
+                int errsv = errno;
+                std::fprintf(stderr, "Error: Output file handle could not be created (%s)\n", std::strerror(errsv));
+                std::exit(errsv);
+            }
+            write_merged_bytes(out_fd, reinterpret_cast<const char*>( Archive::header_magic_bytes ), sizeof(Archive::header_magic_bytes));
+            offset = static_cast<off_t>( sizeof(Archive::header_magic_bytes) );
+        }
+        ms.next_group = 0;
+        ms.is_failed = false;
+        ms.is_archive = !this->get_output_fn().empty();
+        ms.chr_names = &chr_names;
+        ms.chrs = &chrs;
+        ms.group_starts = &group_starts;
+        ms.archives = &archives;
+        ms.chr_streams = &chr_streams;
+        ms.pieces = &pieces;
+        ms.is_chr_done = &is_chr_done;
+        pthread_mutex_init(&ms.lock, NULL);
+        pthread_cond_init(&ms.piece_is_ready, NULL);
+        pthread_cond_init(&ms.piece_is_taken, NULL);
+        workers.resize(static_cast<size_t>( n_workers ));
+        for (std::vector<pthread_t>::iterator w = workers.begin(); w != workers.end(); ++w) {
+            pthread_create(&*w, NULL, merge_chromosomes, &ms);
+        }
+#ifdef DEBUG
+        std::fprintf(stderr, "Debug: Merging [%zu] archive(s) over [%zu] chromosome(s) in [%zu] group(s) with [%ld] workers\n", archives.size(), chrs.size(), group_starts.size() - 1, n_workers);
+#endif
+        for (size_t chr_idx = 0; (chr_idx < chrs.size()) && (exit_status == EXIT_SUCCESS); chr_idx++) {
+            for (;;) {
+                pthread_mutex_lock(&ms.lock);
+                while (!ms.is_failed && pieces[chr_idx].empty() && !is_chr_done[chr_idx]) {
+                    pthread_cond_wait(&ms.piece_is_ready, &ms.lock);
+                }
+                if (ms.is_failed) {
+                    pthread_mutex_unlock(&ms.lock);
+                    exit_status = EXIT_FAILURE;
+                    break;
+                }
+                if (pieces[chr_idx].empty()) {
+                    pthread_mutex_unlock(&ms.lock);
+                    break;
+                }
+                piece.data.swap(pieces[chr_idx].front().data);
+                piece.cr = pieces[chr_idx].front().cr;
+                piece.is_shared = pieces[chr_idx].front().is_shared;
+                pieces[chr_idx].pop_front();
+                pthread_cond_broadcast(&ms.piece_is_taken);
+                pthread_mutex_unlock(&ms.lock);
+                write_merged_bytes(out_fd, piece.data.data(), piece.data.size());
+                if (ms.is_archive) {
+                    /* a packed chromosome's piece refers to the chunk written with the piece before it */
+                    if (!piece.is_shared) {
+                        chunk_offset = offset;
+                        offset += static_cast<off_t>( piece.data.size() );
+                    }
+                    piece.cr.offset = chunk_offset;
+                    Archive::append_chunk_record(&merged_streams, chr_names.name(chrs[chr_idx]), chr_names.length(chrs[chr_idx]), piece.cr);
+                }
+            }
+        }
+        for (std::vector<pthread_t>::iterator w = workers.begin(); w != workers.end(); ++w) {
+            pthread_join(*w, NULL);
+        }
+        pthread_cond_destroy(&ms.piece_is_taken);
+        pthread_cond_destroy(&ms.piece_is_ready);
+        pthread_mutex_destroy(&ms.lock);
+        for (std::vector<merge_archive_t>::iterator a = archives.begin(); a != archives.end(); ++a) {
+            close(a->fd);
+        }
+        if (ms.is_archive) {
+            if (exit_status == EXIT_SUCCESS) {
+                char footer[Archive::footer_length + 1];
+                json_t* metadata = Archive::metadata_to_json(merged_streams, this->get_note());
+                char* metadata_str = json_dumps(metadata, JSON_COMPACT | JSON_PRESERVE_ORDER);
+                json_decref(metadata);
+                if (!metadata_str) {
+                    std::fprintf(stderr, "Error: Could not serialize archive metadata\n");
+                    std::exit(ENOMEM);
+                }
+                write_merged_bytes(out_fd, metadata_str, std::strlen(metadata_str));
+                Archive::format_footer(footer, offset, CRC32C::update(0, metadata_str, std::strlen(metadata_str)));
+                write_merged_bytes(out_fd, footer, Archive::footer_length);
+                free(metadata_str);
+            }
+            close(out_fd);
+            if (exit_status != EXIT_SUCCESS) {
+                unlink(this->get_output_fn().c_str());
+            }
+        }
+        else if (std::fflush(stdout) != 0) {
+            int errsv = errno;
+            std::fprintf(stderr, "Error: Could not write merged output (%s)\n", std::strerror(errsv));
+            std::exit(errsv);
+        }
+        return exit_status;
     }
-    
-    void Starch::bzip2_block_close_callback(void) {
-        std::fprintf(stderr, "callback -> starch3::Starch::bzip2_block_close_callback() called\n");
+
+    int Starch::extract_archive(void) {
+        extract_state_t es;
+        std::vector<extract_job_t> jobs;
+        std::vector<std::vector<char> > slots;
+        std::vector<char> slot_is_full;
+        std::vector<pthread_t> workers;
+        long n_workers = this->get_thread_count();
+        int exit_status = EXIT_SUCCESS;
+        extract_part_t part;
+        std::map<std::string, std::vector<query_region_t> >::iterator regions;
+        std::vector<query_region_t> records;
+        if (this->get_input_fn().empty()) {
+            std::fprintf(stderr, "Error: Extraction requires an archive filename\n");
+            this->print_usage(stderr);
+            std::exit(ENODATA);
+        }
+        es.in_fd = open(this->get_input_fn().c_str(), O_RDONLY);
+        if (es.in_fd == -1) {
+            int errsv = errno;
+            std::fprintf(stderr, "Error: Archive could not be opened (%s)\n", std::strerror(errsv));
+            std::exit(errsv);
+        }
+        this->read_archive_metadata(es.in_fd, &this->streams);
+        this->merge_query_regions();
+        this->select_records(&records);
+        /*
+           Chunks are independent, so they are the unit of work, which keeps workers busy even on a single
+           large chromosome. Small chromosomes sharing a chunk go to one job, so the chunk is decoded once.
+        */
+        for (part.stream_idx = 0; part.stream_idx < this->streams.size(); part.stream_idx++) {
+            const stream_record_t& s = this->streams[part.stream_idx];
+            if (!_selected_chrs.empty() && (_selected_chrs.find(s.chr) == _selected_chrs.end())) {
+                continue;
+            }
+            part.regions = NULL;
+            part.records = (this->is_record_range_set() || (this->get_sample_size() >= 0)) ? &records : NULL;
+            if (!_query_regions.empty()) {
+                regions = _query_regions.find(s.chr);
+                if (regions == _query_regions.end()) {
+                    continue;
+                }
+                part.regions = &regions->second;
+            }
+            for (part.chunk_idx = 0; part.chunk_idx < s.chunks.size(); part.chunk_idx++) {
+                if (part.regions && !overlaps_query_regions(s.chunks[part.chunk_idx], *part.regions)) {
+                    continue;
+                }
+                /* the index's ordinals locate the chunks holding selected records without decoding the rest */
+                if (part.records && !overlaps_record_ranges(s.chunks[part.chunk_idx], *part.records)) {
+                    continue;
+                }
+                if (jobs.empty() || (this->streams[jobs.back().parts.back().stream_idx].chunks[jobs.back().parts.back().chunk_idx].offset != s.chunks[part.chunk_idx].offset)) {
+                    jobs.push_back(extract_job_t());
+                }
+                jobs.back().parts.push_back(part);
+            }
+        }
+        for (std::set<std::string>::iterator c = _selected_chrs.begin(); c != _selected_chrs.end(); ++c) {
+            bool is_found = false;
+            for (std::vector<stream_record_t>::iterator s = this->streams.begin(); s != this->streams.end(); ++s) {
+                if (s->chr == *c) {
+                    is_found = true;
+                    break;
+                }
+            }
+            if (!is_found) {
+                std::fprintf(stderr, "Warning: Chromosome [%s] is not in archive\n", c->c_str());
+            }
+        }
+        if (n_workers < 1) {
+            n_workers = 1;
+        }
+        if (static_cast<size_t>( n_workers ) > jobs.size()) {
+            n_workers = static_cast<long>( jobs.size() );
+        }
+        slots.resize(std::max(static_cast<size_t>( n_workers ), static_cast<size_t>( 1 )) * extract_slots_per_worker);
+        slot_is_full.assign(slots.size(), 0);
+        es.next_job = 0;
+        es.next_out = 0;
+        es.is_failed = false;
+        es.streams = &this->streams;
+        es.jobs = &jobs;
+        es.slots = &slots;
+        es.slot_is_full = &slot_is_full;
+        pthread_mutex_init(&es.lock, NULL);
+        pthread_cond_init(&es.slot_is_ready, NULL);
+        pthread_cond_init(&es.slot_is_free, NULL);
+        workers.resize(static_cast<size_t>( n_workers ));
+        for (std::vector<pthread_t>::iterator w = workers.begin(); w != workers.end(); ++w) {
+            pthread_create(&*w, NULL, extract_chunks, &es);
+        }
+        /* write slots in job order as they fill; workers ahead of the writer wait for their slot to empty */
+        for (size_t job_idx = 0; job_idx < jobs.size(); job_idx++) {
+            std::vector<char>& slot = slots[job_idx % slots.size()];
+            pthread_mutex_lock(&es.lock);
+            while (!es.is_failed && !slot_is_full[job_idx % slots.size()]) {
+                pthread_cond_wait(&es.slot_is_ready, &es.lock);
+            }
+            if (es.is_failed) {
+                pthread_mutex_unlock(&es.lock);
+                exit_status = EXIT_FAILURE;
+                break;
+            }
+            pthread_mutex_unlock(&es.lock);
+            if (std::fwrite(slot.data(), 1, slot.size(), stdout) != slot.size()) {
+                int errsv = errno;
+                std::fprintf(stderr, "Error: Could not write extracted data (%s)\n", std::strerror(errsv));
+                std::exit(errsv);
+            }
+            pthread_mutex_lock(&es.lock);
+            slot_is_full[job_idx % slots.size()] = 0;
+            es.next_out++;
+            pthread_cond_broadcast(&es.slot_is_free);
+            pthread_mutex_unlock(&es.lock);
+        }
+        for (std::vector<pthread_t>::iterator w = workers.begin(); w != workers.end(); ++w) {
+            pthread_join(*w, NULL);
+        }
+        pthread_cond_destroy(&es.slot_is_free);
+        pthread_cond_destroy(&es.slot_is_ready);
+        pthread_mutex_destroy(&es.lock);
+        close(es.in_fd);
+        if (std::fflush(stdout) != 0) {
+            int errsv = errno;
+            std::fprintf(stderr, "Error: Could not write extracted data (%s)\n", std::strerror(errsv));
+            std::exit(errsv);
+        }
+        return exit_status;
+    }
+
+    int Starch::export_archive(void) {
+        export_state_t es;
+        std::vector<export_job_t> jobs;
+        std::vector<pthread_t> workers;
+        std::vector<size_t> selected;
+        std::vector<columnar_chr_t> table;
+        std::string names;
+        columnar_header_t header;
+        long n_workers = this->get_thread_count();
+        int exit_status = EXIT_SUCCESS;
+        export_part_t part;
+        uint64_t offset = 0;
+        if (this->get_input_fn().empty()) {
+            std::fprintf(stderr, "Error: Columnar export requires an archive filename\n");
+            this->print_usage(stderr);
+            std::exit(ENODATA);
+        }
+        es.in_fd = open(this->get_input_fn().c_str(), O_RDONLY);
+        if (es.in_fd == -1) {
+            int errsv = errno;
+            std::fprintf(stderr, "Error: Archive could not be opened (%s)\n", std::strerror(errsv));
+            std::exit(errsv);
+        }
+        this->read_archive_metadata(es.in_fd, &this->streams);
+        for (size_t stream_idx = 0; stream_idx < this->streams.size(); stream_idx++) {
+            if (_selected_chrs.empty() || (_selected_chrs.find(this->streams[stream_idx].chr) != _selected_chrs.end())) {
+                selected.push_back(stream_idx);
+            }
+        }
+        for (std::set<std::string>::iterator c = _selected_chrs.begin(); c != _selected_chrs.end(); ++c) {
+            bool is_found = false;
+            for (std::vector<stream_record_t>::iterator s = this->streams.begin(); s != this->streams.end(); ++s) {
+                if (s->chr == *c) {
+                    is_found = true;
+                    break;
+                }
+            }
+            if (!is_found) {
+                std::fprintf(stderr, "Warning: Chromosome [%s] is not in archive\n", c->c_str());
+            }
+        }
+        /*
+           Every array's place follows from the metadata's record counts, so the whole file is laid out
+           before anything is decoded, and each chunk's coordinates go straight to their final offsets.
+        */
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, Archive::columnar_magic_bytes, sizeof(header.magic));
+        header.version = Archive::columnar_version;
+        header.chr_count = static_cast<uint32_t>( selected.size() );
+        header.chrs_offset = sizeof(columnar_header_t);
+        header.names_offset = header.chrs_offset + selected.size() * sizeof(columnar_chr_t);
+        table.resize(selected.size());
+        for (size_t idx = 0; idx < selected.size(); idx++) {
+            const stream_record_t& s = this->streams[selected[idx]];
+            std::memset(&table[idx], 0, sizeof(columnar_chr_t));
+            table[idx].name_offset = header.names_offset + names.size();
+            table[idx].record_count = static_cast<uint64_t>( s.line_count );
+            /* chunk zone maps bound every stop, so the narrow width is chosen without decoding; archives without them get the wide one */
+            table[idx].width = sizeof(int32_t);
+            for (std::vector<chunk_record_t>::const_iterator c = s.chunks.begin(); c != s.chunks.end(); ++c) {
+                if (c->max_stop > INT32_MAX) {
+                    table[idx].width = sizeof(int64_t);
+                }
+            }
+            names.append(s.chr);
+            names.push_back('\0');
+            header.record_count += table[idx].record_count;
+        }
+        offset = header.names_offset + names.size();
+        for (size_t idx = 0; idx < selected.size(); idx++) {
+            offset = align_columnar_offset(offset);
+            table[idx].starts_offset = offset;
+            offset = align_columnar_offset(offset + table[idx].record_count * table[idx].width);
+            table[idx].stops_offset = offset;
+            offset += table[idx].record_count * table[idx].width;
+        }
+        for (size_t idx = 0; idx < selected.size(); idx++) {
+            const stream_record_t& s = this->streams[selected[idx]];
+            uint64_t records_before = 0;
+            part.stream_idx = selected[idx];
+            part.width = table[idx].width;
+            for (part.chunk_idx = 0; part.chunk_idx < s.chunks.size(); part.chunk_idx++) {
+                part.starts_offset = static_cast<off_t>( table[idx].starts_offset + records_before * part.width );
+                part.stops_offset = static_cast<off_t>( table[idx].stops_offset + records_before * part.width );
+                records_before += static_cast<uint64_t>( s.chunks[part.chunk_idx].line_count );
+                if (jobs.empty() || (this->streams[jobs.back().parts.back().stream_idx].chunks[jobs.back().parts.back().chunk_idx].offset != s.chunks[part.chunk_idx].offset)) {
+                    jobs.push_back(export_job_t());
+                }
+                jobs.back().parts.push_back(part);
+            }
+        }
+        es.out_fd = open(this->get_columnar_fn().c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (es.out_fd == -1) {
+            int errsv = errno;
+            std::fprintf(stderr, "Error: Columnar output could not be opened (%s)\n", std::strerror(errsv));
+            std::exit(errsv);
+        }
+        /* sizing the file up front lets workers write their arrays in any order */
+        if ((ftruncate(es.out_fd, static_cast<off_t>( offset )) != 0)
+            || !pwrite_fully(es.out_fd, reinterpret_cast<const char*>( &header ), sizeof(header), 0)
+            || !pwrite_fully(es.out_fd, reinterpret_cast<const char*>( table.data() ), table.size() * sizeof(columnar_chr_t), static_cast<off_t>( header.chrs_offset ))
+            || !pwrite_fully(es.out_fd, names.data(), names.size(), static_cast<off_t>( header.names_offset ))) {
+            int errsv = errno;
+            std::fprintf(stderr, "Error: Could not write columnar output (%s)\n", std::strerror(errsv));
+            close(es.out_fd);
+            unlink(this->get_columnar_fn().c_str());
+            std::exit(errsv);
+        }
+        if (n_workers < 1) {
+            n_workers = 1;
+        }
+        if (static_cast<size_t>( n_workers ) > jobs.size()) {
+            n_workers = static_cast<long>( jobs.size() );
+        }
+        es.next_job = 0;
+        es.is_failed = false;
+        es.streams = &this->streams;
+        es.jobs = &jobs;
+        pthread_mutex_init(&es.lock, NULL);
+        workers.resize(static_cast<size_t>( n_workers ));
+        for (std::vector<pthread_t>::iterator w = workers.begin(); w != workers.end(); ++w) {
+            pthread_create(&*w, NULL, export_chunks, &es);
+        }
+        for (std::vector<pthread_t>::iterator w = workers.begin(); w != workers.end(); ++w) {
+            pthread_join(*w, NULL);
+        }
+        pthread_mutex_destroy(&es.lock);
+        close(es.in_fd);
+        if (es.is_failed) {
+            exit_status = EXIT_FAILURE;
+        }
+        if (close(es.out_fd) != 0) {
+            int errsv = errno;
+            std::fprintf(stderr, "Error: Could not write columnar output (%s)\n", std::strerror(errsv));
+            exit_status = EXIT_FAILURE;
+        }
+        if (exit_status != EXIT_SUCCESS) {
+            unlink(this->get_columnar_fn().c_str());
+        }
+        return exit_status;
     }
 
     void Starch::test_stdin_availability(void) {
@@ -905,17 +4322,36 @@ namespace starch3
     }
 
     void Starch::initialize_header_magic_bytes(void) {
-        unsigned char mb[] = { 0xca, 0x5c, 0xad, 0x1a }; /* ca5cad1a */
-        std::memcpy(_header_magic_bytes, mb, sizeof(_header_magic_bytes)/sizeof(*_header_magic_bytes)); 
+        std::memcpy(_header_magic_bytes, Archive::header_magic_bytes, sizeof(_header_magic_bytes)/sizeof(*_header_magic_bytes)); 
     }
 
     Starch::Starch() {
         this->set_note(std::string());
+        this->set_out_fd(STDOUT_FILENO);
+        this->set_client_mode(k_compress_mode);
+        _cache_size = serve_default_cache_size;
+        _is_small_input = false;
+        _thread_count = 0;
+        _is_pinned = false;
+        _record_range.start = -1;
+        _record_range.stop = -1;
+        _sample_size = -1;
+        _sample_seed = static_cast<uint64_t>( std::time(NULL) ) ^ (static_cast<uint64_t>( getpid() ) << 32);
+        reuse_fd = -1;
+        serve_is_stopping = 0;
+        _resume.is_resuming = false;
+        _resume.input_size = 0;
+        _resume.input_mtime = 0;
+        _is_auto = false;
+        _optimize_objective = k_optimize_ratio;
         this->set_compression_method(k_compression_method_undefined);
         this->initialize_header_magic_bytes();
     }
 
     Starch::~Starch() {
+        if (reuse_fd != -1) {
+            close(reuse_fd);
+        }
     }
 
     extern Starch* self;
@@ -0,0 +1,131 @@
+#ifndef STARCH3_CACHE_H_
+#define STARCH3_CACHE_H_
+
+#include <list>
+#include <map>
+#include <set>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <cinttypes>
+#include <pthread.h>
+#include <sys/types.h>
+
+namespace starch3
+{
+    // size-bounded LRU cache of decoded chunks, shared by the threads of a query server
+    class ChunkCache
+    {
+    public:
+        typedef std::pair<size_t, std::pair<off_t, size_t> > chunk_key_t; // archive index, chunk offset and span offset within the decoded chunk
+        typedef std::shared_ptr<const std::vector<char> > chunk_ptr_t;  // decoded chunk, kept alive by readers after eviction
+
+        typedef struct stats {
+            uint64_t hits;                              // lookups answered from the cache
+            uint64_t misses;                            // lookups that had to decode
+            uint64_t evictions;                         // chunks dropped to stay within capacity
+            size_t entries;                             // chunks resident
+            size_t size;                                // decoded bytes resident
+            size_t capacity;                            // decoded byte limit
+        } stats_t;
+
+        explicit ChunkCache(size_t capacity) :
+            _size(0),
+            _capacity(capacity) {
+            _stats.hits = 0;
+            _stats.misses = 0;
+            _stats.evictions = 0;
+            pthread_mutex_init(&_lock, NULL);
+            pthread_cond_init(&_chunk_is_decoded, NULL);
+        }
+
+        ~ChunkCache() {
+            pthread_cond_destroy(&_chunk_is_decoded);
+            pthread_mutex_destroy(&_lock);
+        }
+
+        /*
+           Returns the chunk and marks it most recently used. If another thread is decoding the chunk,
+           this waits for it rather than decoding it again, since hot chunks are requested in bursts.
+           On a miss an empty pointer is returned, and the caller must decode the chunk and then call
+           insert(), or abandon() if decoding fails.
+        */
+        chunk_ptr_t acquire(const chunk_key_t& key) {
+            chunk_ptr_t chunk;
+            pthread_mutex_lock(&_lock);
+            for (;;) {
+                index_t::iterator e = _index.find(key);
+                if (e != _index.end()) {
+                    _order.splice(_order.begin(), _order, e->second);
+                    chunk = e->second->second;
+                    _stats.hits++;
+                    break;
+                }
+                if (_pending.find(key) == _pending.end()) {
+                    _pending.insert(key);
+                    _stats.misses++;
+                    break;
+                }
+                pthread_cond_wait(&_chunk_is_decoded, &_lock);
+            }
+            pthread_mutex_unlock(&_lock);
+            return chunk;
+        }
+
+        // gives up a miss returned by acquire(), so that a waiting thread can decode the chunk instead
+        void abandon(const chunk_key_t& key) {
+            pthread_mutex_lock(&_lock);
+            _pending.erase(key);
+            pthread_cond_broadcast(&_chunk_is_decoded);
+            pthread_mutex_unlock(&_lock);
+        }
+
+        // adds a decoded chunk, evicting least recently used chunks to make room; chunks larger than the cache are not kept
+        void insert(const chunk_key_t& key, const chunk_ptr_t& chunk) {
+            pthread_mutex_lock(&_lock);
+            _pending.erase(key);
+            pthread_cond_broadcast(&_chunk_is_decoded);
+            if ((chunk->size() <= _capacity) && (_index.find(key) == _index.end())) {
+                while (!_order.empty() && (_size + chunk->size() > _capacity)) {
+                    _size -= _order.back().second->size();
+                    _index.erase(_order.back().first);
+                    _order.pop_back();
+                    _stats.evictions++;
+                }
+                _order.push_front(std::make_pair(key, chunk));
+                _index[key] = _order.begin();
+                _size += chunk->size();
+            }
+            pthread_mutex_unlock(&_lock);
+        }
+
+        stats_t stats(void) {
+            stats_t s;
+            pthread_mutex_lock(&_lock);
+            s = _stats;
+            s.entries = _index.size();
+            s.size = _size;
+            s.capacity = _capacity;
+            pthread_mutex_unlock(&_lock);
+            return s;
+        }
+
+    private:
+        typedef std::list<std::pair<chunk_key_t, chunk_ptr_t> > order_t;
+        typedef std::map<chunk_key_t, order_t::iterator> index_t;
+
+        pthread_mutex_t _lock;
+        pthread_cond_t _chunk_is_decoded;               // signaled when a pending chunk is inserted or abandoned
+        std::set<chunk_key_t> _pending;                 // chunks being decoded after a miss
+        order_t _order;                                 // most recently used first
+        index_t _index;
+        size_t _size;
+        size_t _capacity;
+        stats_t _stats;
+
+        ChunkCache(const ChunkCache&);
+        ChunkCache& operator=(const ChunkCache&);
+    };
+}
+
+#endif // STARCH3_CACHE_H_
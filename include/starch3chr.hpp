@@ -0,0 +1,166 @@
+#ifndef STARCH3_CHR_H_
+#define STARCH3_CHR_H_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <cstring>
+#include <cinttypes>
+#include "starch3hash.hpp"
+
+namespace starch3
+{
+    // chromosome names, each interned once, so records and streams carry a small integer ID instead of a copy of the name
+    class ChrTable
+    {
+    public:
+        typedef uint32_t chr_id_t;
+
+        static const chr_id_t no_chr = UINT32_MAX;
+
+        ChrTable() :
+            _slots(initial_slots, static_cast<chr_id_t>( no_chr )),
+            _ranked_count(0) {
+        }
+
+        /* ID of the name, which is added if it has not been seen */
+        chr_id_t intern(const char* name, size_t length) {
+            uint64_t h = Hash64::hash(name, length);
+            size_t slot = find_slot(name, length, h);
+            if (_slots[slot] != no_chr) {
+                return _slots[slot];
+            }
+            entry_t e;
+            e.name.assign(name, length);
+            e.hash = h;
+            e.rank = 0;
+            _entries.push_back(e);
+            _slots[slot] = static_cast<chr_id_t>( _entries.size() - 1 );
+            /* at most half full, so probe runs stay short */
+            if (_entries.size() * 2 > _slots.size()) {
+                grow();
+            }
+            return static_cast<chr_id_t>( _entries.size() - 1 );
+        }
+
+        chr_id_t intern(const std::string& name) {
+            return intern(name.data(), name.size());
+        }
+
+        /* ID of the name, or no_chr if it has not been seen */
+        chr_id_t find(const char* name, size_t length) const {
+            return _slots[find_slot(name, length, Hash64::hash(name, length))];
+        }
+
+        chr_id_t find(const std::string& name) const {
+            return find(name.data(), name.size());
+        }
+
+        /* whether the ID names exactly these bytes; a length check settles most mismatches before any bytes are compared */
+        bool matches(chr_id_t id, const char* name, size_t length) const {
+            const std::string& s = _entries[id].name;
+            return (s.size() == length) && (std::memcmp(s.data(), name, length) == 0);
+        }
+
+        // names stay at the same address for the life of the table
+        const char* name(chr_id_t id) const {
+            return _entries[id].name.c_str();
+        }
+
+        const std::string& name_str(chr_id_t id) const {
+            return _entries[id].name;
+        }
+
+        size_t length(chr_id_t id) const {
+            return _entries[id].name.size();
+        }
+
+        uint64_t hash(chr_id_t id) const {
+            return _entries[id].hash;
+        }
+
+        size_t size(void) const {
+            return _entries.size();
+        }
+
+        /*
+           Position of the name in the byte order that compression checks inputs against. Ranks are
+           computed again only when names have been added since the last call, so sorting chromosomes
+           by rank costs one sort of the names rather than a string compare per comparison.
+        */
+        size_t rank(chr_id_t id) {
+            if (_ranked_count != _entries.size()) {
+                std::vector<chr_id_t> order(_entries.size());
+                for (size_t idx = 0; idx < order.size(); idx++) {
+                    order[idx] = static_cast<chr_id_t>( idx );
+                }
+                std::sort(order.begin(), order.end(), name_is_before(this));
+                for (size_t idx = 0; idx < order.size(); idx++) {
+                    _entries[order[idx]].rank = idx;
+                }
+                _ranked_count = _entries.size();
+            }
+            return _entries[id].rank;
+        }
+
+        /* IDs of all names, in rank order */
+        std::vector<chr_id_t> ranked_ids(void) {
+            std::vector<chr_id_t> ids(_entries.size());
+            for (size_t idx = 0; idx < ids.size(); idx++) {
+                ids[this->rank(static_cast<chr_id_t>( idx ))] = static_cast<chr_id_t>( idx );
+            }
+            return ids;
+        }
+
+    private:
+        static const size_t initial_slots = 64;
+
+        typedef struct entry {
+            std::string name;                           // chromosome name
+            uint64_t hash;                              // 64-bit hash of the name
+            size_t rank;                                // position in byte order, as of the last ranking
+        } entry_t;
+
+        struct name_is_before {
+            const ChrTable* t;
+            explicit name_is_before(const ChrTable* table) : t(table) {}
+            bool operator()(chr_id_t a, chr_id_t b) const {
+                return t->_entries[a].name < t->_entries[b].name;
+            }
+        };
+
+        std::deque<entry_t> _entries;
+        std::vector<chr_id_t> _slots;
+        size_t _ranked_count;
+
+        /* slot holding the name, or the empty slot where it would go; the slot count is a power of two */
+        size_t find_slot(const char* name, size_t length, uint64_t h) const {
+            size_t mask = _slots.size() - 1;
+            size_t slot = static_cast<size_t>( h ) & mask;
+            while (_slots[slot] != no_chr) {
+                const entry_t& e = _entries[_slots[slot]];
+                if ((e.hash == h) && (e.name.size() == length) && (std::memcmp(e.name.data(), name, length) == 0)) {
+                    break;
+                }
+                slot = (slot + 1) & mask;
+            }
+            return slot;
+        }
+
+        void grow(void) {
+            std::vector<chr_id_t> slots(_slots.size() * 2, static_cast<chr_id_t>( no_chr ));
+            size_t mask = slots.size() - 1;
+            for (size_t idx = 0; idx < _entries.size(); idx++) {
+                size_t slot = static_cast<size_t>( _entries[idx].hash ) & mask;
+                while (slots[slot] != no_chr) {
+                    slot = (slot + 1) & mask;
+                }
+                slots[slot] = static_cast<chr_id_t>( idx );
+            }
+            _slots.swap(slots);
+        }
+    };
+}
+
+#endif // STARCH3_CHR_H_
@@ -0,0 +1,167 @@
+#ifndef STARCH3_CRC32C_H_
+#define STARCH3_CRC32C_H_
+
+#include <cstddef>
+#include <cstring>
+#include <cinttypes>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace starch3
+{
+    // CRC-32C (Castagnoli), using SSE4.2 when the processor has it and slicing-by-8 tables otherwise
+    class CRC32C
+    {
+    public:
+        // continues a checksum over another span; start from 0 for a new checksum
+        static uint32_t update(uint32_t crc, const void* buf, size_t len) {
+            const unsigned char* p = static_cast<const unsigned char*>( buf );
+#if defined(__x86_64__)
+            if (has_hardware_support()) {
+                return ~update_hardware(~crc, p, len);
+            }
+#endif
+            return ~update_software(~crc, p, len);
+        }
+
+        // checksum of the concatenation A + B, given crc(A), crc(B) and the length of B
+        static uint32_t combine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+            uint32_t even[32];
+            uint32_t odd[32];
+            uint32_t row = 1;
+            if (len2 == 0) {
+                return crc1;
+            }
+            /* operator for one zero bit in odd */
+            odd[0] = polynomial;
+            for (int n = 1; n < 32; n++) {
+                odd[n] = row;
+                row <<= 1;
+            }
+            gf2_matrix_square(even, odd); /* two zero bits */
+            gf2_matrix_square(odd, even); /* four zero bits */
+            /* apply len2 zero bytes to crc1, squaring the operator for each bit of len2 */
+            do {
+                gf2_matrix_square(even, odd);
+                if (len2 & 1) {
+                    crc1 = gf2_matrix_times(even, crc1);
+                }
+                len2 >>= 1;
+                if (len2 == 0) {
+                    break;
+                }
+                gf2_matrix_square(odd, even);
+                if (len2 & 1) {
+                    crc1 = gf2_matrix_times(odd, crc1);
+                }
+                len2 >>= 1;
+            } while (len2 != 0);
+            return crc1 ^ crc2;
+        }
+
+        static bool has_hardware_support(void) {
+#if defined(__x86_64__)
+            static const bool _hw = __builtin_cpu_supports("sse4.2");
+            return _hw;
+#else
+            return false;
+#endif
+        }
+
+    private:
+        static const uint32_t polynomial = 0x82f63b78; /* reversed 0x1edc6f41 */
+
+        static uint32_t gf2_matrix_times(const uint32_t* mat, uint32_t vec) {
+            uint32_t sum = 0;
+            while (vec) {
+                if (vec & 1) {
+                    sum ^= *mat;
+                }
+                vec >>= 1;
+                mat++;
+            }
+            return sum;
+        }
+
+        static void gf2_matrix_square(uint32_t* square, const uint32_t* mat) {
+            for (int n = 0; n < 32; n++) {
+                square[n] = gf2_matrix_times(mat, mat[n]);
+            }
+        }
+
+        static const uint32_t (*tables(void))[256] {
+            static uint32_t _t[8][256];
+            static bool _initialized = initialize_tables(_t);
+            (void) _initialized;
+            return _t;
+        }
+
+        static bool initialize_tables(uint32_t t[8][256]) {
+            for (uint32_t n = 0; n < 256; n++) {
+                uint32_t c = n;
+                for (int k = 0; k < 8; k++) {
+                    c = (c & 1) ? (polynomial ^ (c >> 1)) : (c >> 1);
+                }
+                t[0][n] = c;
+            }
+            for (uint32_t n = 0; n < 256; n++) {
+                for (int k = 1; k < 8; k++) {
+                    t[k][n] = (t[k - 1][n] >> 8) ^ t[0][t[k - 1][n] & 0xff];
+                }
+            }
+            return true;
+        }
+
+        static uint32_t update_software(uint32_t c, const unsigned char* p, size_t len) {
+            const uint32_t (*t)[256] = tables();
+            uint32_t lo = 0;
+            uint32_t hi = 0;
+            while ((len > 0) && (reinterpret_cast<uintptr_t>( p ) & 7)) {
+                c = t[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+                len--;
+            }
+            while (len >= 8) {
+                std::memcpy(&lo, p, 4);
+                std::memcpy(&hi, p + 4, 4);
+                lo ^= c; /* little-endian byte order is assumed by the slicing tables */
+                c = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+                    t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+                p += 8;
+                len -= 8;
+            }
+            while (len > 0) {
+                c = t[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+                len--;
+            }
+            return c;
+        }
+
+#if defined(__x86_64__)
+        __attribute__((target("sse4.2")))
+        static uint32_t update_hardware(uint32_t c, const unsigned char* p, size_t len) {
+            uint64_t c64 = 0;
+            uint64_t word = 0;
+            while ((len > 0) && (reinterpret_cast<uintptr_t>( p ) & 7)) {
+                c = _mm_crc32_u8(c, *p++);
+                len--;
+            }
+            c64 = c;
+            while (len >= 8) {
+                std::memcpy(&word, p, 8);
+                c64 = _mm_crc32_u64(c64, word);
+                p += 8;
+                len -= 8;
+            }
+            c = static_cast<uint32_t>( c64 );
+            while (len > 0) {
+                c = _mm_crc32_u8(c, *p++);
+                len--;
+            }
+            return c;
+        }
+#endif
+    };
+}
+
+#endif // STARCH3_CRC32C_H_
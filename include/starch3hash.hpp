@@ -0,0 +1,50 @@
+#ifndef STARCH3_HASH_H_
+#define STARCH3_HASH_H_
+
+#include <cstddef>
+#include <cstring>
+#include <cinttypes>
+
+namespace starch3
+{
+    // 64-bit MurmurHash2 (MurmurHash64A), identifying transformed chunks whose compressed bytes can be reused
+    class Hash64
+    {
+    public:
+        static uint64_t hash(const void* buf, size_t len) {
+            const unsigned char* p = static_cast<const unsigned char*>( buf );
+            const unsigned char* end = p + (len & ~static_cast<size_t>( 7 ));
+            uint64_t h = seed ^ (static_cast<uint64_t>( len ) * m);
+            uint64_t k = 0;
+            for (; p != end; p += 8) {
+                std::memcpy(&k, p, 8);
+                k *= m;
+                k ^= k >> r;
+                k *= m;
+                h ^= k;
+                h *= m;
+            }
+            switch (len & 7) {
+            case 7: h ^= static_cast<uint64_t>( p[6] ) << 48; /* fall through */
+            case 6: h ^= static_cast<uint64_t>( p[5] ) << 40; /* fall through */
+            case 5: h ^= static_cast<uint64_t>( p[4] ) << 32; /* fall through */
+            case 4: h ^= static_cast<uint64_t>( p[3] ) << 24; /* fall through */
+            case 3: h ^= static_cast<uint64_t>( p[2] ) << 16; /* fall through */
+            case 2: h ^= static_cast<uint64_t>( p[1] ) << 8;  /* fall through */
+            case 1: h ^= static_cast<uint64_t>( p[0] );
+                    h *= m;
+            }
+            h ^= h >> r;
+            h *= m;
+            h ^= h >> r;
+            return h;
+        }
+
+    private:
+        static const uint64_t m = 0xc6a4a7935bd1e995ULL;
+        static const int r = 47;
+        static const uint64_t seed = 0x5ca1ab1e5ca1ab1eULL;
+    };
+}
+
+#endif // STARCH3_HASH_H_
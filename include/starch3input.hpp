@@ -0,0 +1,749 @@
+#ifndef STARCH3_INPUT_H_
+#define STARCH3_INPUT_H_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cinttypes>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "bzlib.h"
+#include "starch3pool.hpp"
+
+namespace starch3
+{
+    // presents gzip, BGZF or bzip2 input as a plain stdio stream, decompressing blocks as tasks on a shared pool
+    class InputDecompressor
+    {
+    public:
+        typedef enum input_format {
+            k_plain_input = 0,
+            k_gzip_input,
+            k_bgzf_input,
+            k_bzip2_input,
+            k_input_format_undefined
+        } input_format_t;
+
+    private:
+        typedef struct piece {
+            std::vector<unsigned char> in;              // bzip2: block bits, starting at the block magic; BGZF: one member
+            uint64_t in_bits;                           // bzip2: block length in bits
+            char level;                                 // bzip2: block size level of the enclosing stream
+            std::vector<char> out;                      // decompressed bytes
+            input_format_t format;                      // bzip2 or BGZF, for the task that decompresses the piece
+            bool is_done;                               // has the piece been decompressed? set by the pool for queued tasks
+            bool is_failed;                             // did decompression fail?
+        } piece_t;
+
+        typedef struct decompress_state {
+            pthread_mutex_t lock;                       // protects the piece queue and flags
+            pthread_cond_t piece_is_queued;             // to note when the splitter has queued a piece
+            pthread_cond_t window_has_room;             // to note when the splitter may queue another piece
+            std::deque<piece_t*> ordered;               // pieces in input order, awaiting the reader
+            TaskPool* pool;                             // decompresses pieces; bounds those in flight by its size
+            bool is_split_done;                         // splitter has queued its last piece
+            bool is_aborted;                            // stream was closed before input was exhausted
+            input_format_t format;                      // detected input format
+            FILE* raw;                                  // compressed input stream
+            std::vector<unsigned char> buf;             // raw input window
+            uint64_t buf_base;                          // input offset of buf[0]
+            bool is_raw_eof;                            // raw input is exhausted
+            piece_t* current;                           // piece being read from
+            size_t current_pos;                         // read position in current piece
+            pthread_t splitter;                         // splits raw input into pieces
+        } decompress_state_t;
+
+        static const size_t raw_read_length = 4194304;
+        static const size_t plain_piece_length = 4194304;
+        static const size_t detect_length = 18;
+        static const int max_piece_merges = 16;
+        static const uint64_t bzip2_block_magic = 0x314159265359ULL;
+        static const uint64_t bzip2_eos_magic = 0x177245385090ULL;
+        static const uint64_t bzip2_magic_mask = 0xffffffffffffULL;
+
+    public:
+        static input_format_t detect(const unsigned char* p, size_t n) {
+            if ((n >= 3) && (p[0] == 0x1f) && (p[1] == 0x8b) && (p[2] == 0x08)) {
+                /* BGZF members carry their own length in a "BC" extra subfield */
+                if ((n >= 16) && (p[3] & 0x04) && (p[12] == 'B') && (p[13] == 'C') && (p[14] == 2) && (p[15] == 0)) {
+                    return k_bgzf_input;
+                }
+                return k_gzip_input;
+            }
+            if ((n >= 4) && (p[0] == 'B') && (p[1] == 'Z') && (p[2] == 'h') && (p[3] >= '1') && (p[3] <= '9')) {
+                return k_bzip2_input;
+            }
+            return k_plain_input;
+        }
+
+        /*
+           Returns raw itself for plain input that can be read directly, or a new stream
+           yielding decompressed bytes; closing the returned stream closes raw. Blocks are
+           decompressed on the pool, which need not be started yet, so that they share its
+           threads with chunk compression rather than adding threads of their own.
+        */
+        static FILE* open(FILE* raw, TaskPool* pool) {
+            unsigned char prefix[detect_length];
+            size_t prefix_length = 0;
+            off_t raw_start = ftello(raw);
+            struct stat raw_stats;
+            int c = getc(raw);
+            if (c == EOF) {
+                return raw;
+            }
+            /* plain BED almost never starts with a compression magic byte, so one byte of pushback suffices */
+            if ((c != 0x1f) && (c != 'B')) {
+                ungetc(c, raw);
+                return raw;
+            }
+            prefix[0] = static_cast<unsigned char>( c );
+            prefix_length = 1 + fread(prefix + 1, 1, detect_length - 1, raw);
+            input_format_t format = detect(prefix, prefix_length);
+            if ((format == k_plain_input) && (raw_start != -1) && (fstat(fileno(raw), &raw_stats) == 0) && S_ISREG(raw_stats.st_mode) && (fseeko(raw, raw_start, SEEK_SET) == 0)) {
+                return raw;
+            }
+            decompress_state_t* st = new decompress_state_t;
+            st->format = format;
+            st->raw = raw;
+            st->buf.assign(prefix, prefix + prefix_length);
+            st->buf_base = 0;
+            st->is_raw_eof = false;
+            st->is_split_done = false;
+            st->is_aborted = false;
+            st->current = NULL;
+            st->current_pos = 0;
+            st->pool = pool;
+            pthread_mutex_init(&st->lock, NULL);
+            pthread_cond_init(&st->piece_is_queued, NULL);
+            pthread_cond_init(&st->window_has_room, NULL);
+            pthread_create(&st->splitter, NULL, split_input, st);
+#ifdef DEBUG
+            std::fprintf(stderr, "--- starch3::InputDecompressor::open() - format [%d] ---\n", format);
+#endif
+#ifdef __APPLE__
+            return funopen(st, read_decompressed_bsd, NULL, NULL, close_decompressed);
+#else
+            cookie_io_functions_t io = { read_decompressed, NULL, NULL, close_decompressed };
+            return fopencookie(st, "r", io);
+#endif
+        }
+
+    private:
+        // reader side
+
+#ifdef __APPLE__
+        static int read_decompressed_bsd(void* cookie, char* out, int size) {
+            return static_cast<int>( read_decompressed(cookie, out, static_cast<size_t>( size )) );
+        }
+#endif
+
+        static ssize_t read_decompressed(void* cookie, char* out, size_t size) {
+            decompress_state_t* st = static_cast<decompress_state_t*>( cookie );
+            size_t n = 0;
+            for (;;) {
+                if (st->current) {
+                    if (st->current_pos < st->current->out.size()) {
+                        n = st->current->out.size() - st->current_pos;
+                        n = (n < size) ? n : size;
+                        std::memcpy(out, st->current->out.data() + st->current_pos, n);
+                        st->current_pos += n;
+                        return static_cast<ssize_t>( n );
+                    }
+                    delete st->current;
+                    st->current = NULL;
+                }
+                st->current = next_piece(st);
+                st->current_pos = 0;
+                if (!st->current) {
+                    return 0;
+                }
+                if (st->current->is_failed) {
+                    repair_bzip2_piece(st, st->current);
+                }
+            }
+        }
+
+        /* takes the next piece in input order once it is decompressed, running pool tasks while it waits; NULL at the end of input */
+        static piece_t* next_piece(decompress_state_t* st) {
+            piece_t* p = NULL;
+            pthread_mutex_lock(&st->lock);
+            while (st->ordered.empty() && !st->is_split_done) {
+                pthread_cond_wait(&st->piece_is_queued, &st->lock);
+            }
+            if (!st->ordered.empty()) {
+                p = st->ordered.front();
+                st->ordered.pop_front();
+                pthread_cond_signal(&st->window_has_room);
+            }
+            pthread_mutex_unlock(&st->lock);
+            if (p) {
+                st->pool->wait(&p->is_done);
+            }
+            return p;
+        }
+
+        /*
+           A bzip2 block magic can occur by chance inside compressed data, which splits a
+           block in two. The first half then fails to decompress; it is rejoined with the
+           pieces that follow until the block decompresses.
+        */
+        static void repair_bzip2_piece(decompress_state_t* st, piece_t* p) {
+            piece_t* next = NULL;
+            for (int merges = 0; p->is_failed; merges++) {
+                next = next_piece(st);
+                if ((st->format != k_bzip2_input) || !next || (merges == max_piece_merges)) {
+                    std::fprintf(stderr, "Error: Compressed input is corrupt and could not be decompressed\n");
+                    std::exit(EIO);
+                }
+                append_bits(&p->in, p->in_bits, next->in.data(), 0, next->in_bits);
+                p->in_bits += next->in_bits;
+                delete next;
+                decompress_bzip2_piece(p);
+            }
+        }
+
+        static int close_decompressed(void* cookie) {
+            decompress_state_t* st = static_cast<decompress_state_t*>( cookie );
+            pthread_mutex_lock(&st->lock);
+            st->is_aborted = true;
+            pthread_cond_broadcast(&st->window_has_room);
+            pthread_mutex_unlock(&st->lock);
+            pthread_join(st->splitter, NULL);
+            /* pieces still queued on the pool are decompressed before they are freed */
+            while (!st->ordered.empty()) {
+                st->pool->wait(&st->ordered.front()->is_done);
+                delete st->ordered.front();
+                st->ordered.pop_front();
+            }
+            delete st->current;
+            pthread_mutex_destroy(&st->lock);
+            pthread_cond_destroy(&st->piece_is_queued);
+            pthread_cond_destroy(&st->window_has_room);
+            int res = fclose(st->raw);
+            delete st;
+#ifdef DEBUG
+            std::fprintf(stderr, "--- starch3::InputDecompressor::close_decompressed() ---\n");
+#endif
+            return res;
+        }
+
+        // splitter side
+
+        static void* split_input(void* arg) {
+            decompress_state_t* st = static_cast<decompress_state_t*>( arg );
+            switch (st->format) {
+            case k_bzip2_input:
+                split_bzip2_input(st);
+                break;
+            case k_bgzf_input:
+                split_bgzf_input(st);
+                break;
+            case k_gzip_input:
+                inflate_gzip_input(st);
+                break;
+            case k_plain_input:
+            case k_input_format_undefined:
+                pass_plain_input(st);
+                break;
+            }
+            pthread_mutex_lock(&st->lock);
+            st->is_split_done = true;
+            pthread_cond_broadcast(&st->piece_is_queued);
+            pthread_mutex_unlock(&st->lock);
+            return NULL;
+        }
+
+        /* queues a piece for the reader, handing it to the pool first unless it is already decompressed */
+        static bool queue_piece(decompress_state_t* st, piece_t* p) {
+            size_t max_in_flight = 4 * st->pool->size();
+            pthread_mutex_lock(&st->lock);
+            while ((st->ordered.size() >= max_in_flight) && !st->is_aborted) {
+                pthread_cond_wait(&st->window_has_room, &st->lock);
+            }
+            if (st->is_aborted) {
+                pthread_mutex_unlock(&st->lock);
+                delete p;
+                return false;
+            }
+            pthread_mutex_unlock(&st->lock);
+            if (!p->is_done) {
+                p->format = st->format;
+                st->pool->submit(decompress_piece, p, &p->is_done);
+            }
+            pthread_mutex_lock(&st->lock);
+            st->ordered.push_back(p);
+            pthread_cond_broadcast(&st->piece_is_queued);
+            pthread_mutex_unlock(&st->lock);
+            return true;
+        }
+
+        static piece_t* new_piece(void) {
+            piece_t* p = new piece_t;
+            p->in_bits = 0;
+            p->level = '9';
+            p->format = k_input_format_undefined;
+            p->is_done = false;
+            p->is_failed = false;
+            return p;
+        }
+
+        /* reads until the window extends to input offset end, returning false if input ends first */
+        static bool fill_to(decompress_state_t* st, uint64_t end) {
+            size_t buf_size = 0;
+            size_t n = 0;
+            while ((st->buf_base + st->buf.size() < end) && !st->is_raw_eof) {
+                buf_size = st->buf.size();
+                st->buf.resize(buf_size + raw_read_length);
+                n = fread(st->buf.data() + buf_size, 1, raw_read_length, st->raw);
+                st->buf.resize(buf_size + n);
+                if (n == 0) {
+                    if (ferror(st->raw)) {
+                        std::fprintf(stderr, "Error: Could not read compressed input\n");
+                        std::exit(EIO);
+                    }
+                    st->is_raw_eof = true;
+                }
+            }
+            return (st->buf_base + st->buf.size() >= end);
+        }
+
+        /* drops window bytes before input offset keep, once enough have accumulated to be worth moving */
+        static void discard_to(decompress_state_t* st, uint64_t keep) {
+            if (keep - st->buf_base >= raw_read_length) {
+                st->buf.erase(st->buf.begin(), st->buf.begin() + static_cast<std::ptrdiff_t>( keep - st->buf_base ));
+                st->buf_base = keep;
+            }
+        }
+
+        static void pass_plain_input(decompress_state_t* st) {
+            piece_t* p = NULL;
+            do {
+                fill_to(st, st->buf_base + st->buf.size() + 1);
+                p = new_piece();
+                p->out.assign(st->buf.begin(), st->buf.end());
+                p->is_done = true;
+                st->buf_base += st->buf.size();
+                st->buf.clear();
+                if (!queue_piece(st, p)) {
+                    return;
+                }
+            } while (!st->is_raw_eof);
+        }
+
+        static void inflate_gzip_input(decompress_state_t* st) {
+            z_stream zs;
+            int inflate_res = Z_OK;
+            piece_t* p = new_piece();
+            std::memset(&zs, 0, sizeof(zs));
+            if (inflateInit2(&zs, 15 + 32) != Z_OK) {
+                std::fprintf(stderr, "Error: gzip decompression could not be initialized\n");
+                std::exit(EINVAL);
+            }
+            p->out.resize(plain_piece_length);
+            zs.next_in = st->buf.data();
+            zs.avail_in = static_cast<uInt>( st->buf.size() );
+            zs.next_out = reinterpret_cast<Bytef*>( p->out.data() );
+            zs.avail_out = static_cast<uInt>( plain_piece_length );
+            for (;;) {
+                if (zs.avail_in == 0) {
+                    st->buf_base += st->buf.size();
+                    st->buf.clear();
+                    if (!fill_to(st, st->buf_base + 1)) {
+                        break;
+                    }
+                    zs.next_in = st->buf.data();
+                    zs.avail_in = static_cast<uInt>( st->buf.size() );
+                }
+                inflate_res = inflate(&zs, Z_NO_FLUSH);
+                if (inflate_res == Z_STREAM_END) {
+                    /* concatenated members continue; anything else is trailing garbage, as gzip treats it */
+                    if (zs.avail_in == 0) {
+                        st->buf_base += st->buf.size();
+                        st->buf.clear();
+                        if (!fill_to(st, st->buf_base + 1)) {
+                            break;
+                        }
+                        zs.next_in = st->buf.data();
+                        zs.avail_in = static_cast<uInt>( st->buf.size() );
+                    }
+                    if (zs.next_in[0] != 0x1f) {
+                        std::fprintf(stderr, "Warning: Ignoring trailing data after gzip input\n");
+                        break;
+                    }
+                    inflateReset(&zs);
+                }
+                else if ((inflate_res != Z_OK) && (inflate_res != Z_BUF_ERROR)) {
+                    std::fprintf(stderr, "Error: gzip input is corrupt and could not be decompressed (%s)\n", zs.msg ? zs.msg : "unknown error");
+                    std::exit(EIO);
+                }
+                if (zs.avail_out == 0) {
+                    p->is_done = true;
+                    if (!queue_piece(st, p)) {
+                        inflateEnd(&zs);
+                        return;
+                    }
+                    p = new_piece();
+                    p->out.resize(plain_piece_length);
+                    zs.next_out = reinterpret_cast<Bytef*>( p->out.data() );
+                    zs.avail_out = static_cast<uInt>( plain_piece_length );
+                }
+            }
+            if (inflate_res != Z_STREAM_END) {
+                std::fprintf(stderr, "Error: gzip input is truncated\n");
+                std::exit(EIO);
+            }
+            inflateEnd(&zs);
+            p->out.resize(plain_piece_length - zs.avail_out);
+            p->is_done = true;
+            queue_piece(st, p);
+        }
+
+        static void split_bgzf_input(decompress_state_t* st) {
+            uint64_t pos = 0;
+            size_t member_length = 0;
+            size_t xlen = 0;
+            size_t x = 0;
+            const unsigned char* h = NULL;
+            for (;;) {
+                if (!fill_to(st, pos + 18)) {
+                    if (st->buf_base + st->buf.size() == pos) {
+                        return;
+                    }
+                    std::fprintf(stderr, "Error: BGZF input is truncated\n");
+                    std::exit(EIO);
+                }
+                h = st->buf.data() + (pos - st->buf_base);
+                member_length = 0;
+                if ((h[0] == 0x1f) && (h[1] == 0x8b) && (h[2] == 0x08) && (h[3] & 0x04)) {
+                    xlen = static_cast<size_t>( h[10] ) | (static_cast<size_t>( h[11] ) << 8);
+                    fill_to(st, pos + 12 + xlen);
+                    h = st->buf.data() + (pos - st->buf_base);
+                    for (x = 0; (x + 6 <= xlen) && (pos + 12 + xlen <= st->buf_base + st->buf.size()); x += 4 + (static_cast<size_t>( h[12 + x + 2] ) | (static_cast<size_t>( h[12 + x + 3] ) << 8))) {
+                        if ((h[12 + x] == 'B') && (h[12 + x + 1] == 'C') && (h[12 + x + 2] == 2) && (h[12 + x + 3] == 0)) {
+                            member_length = 1 + (static_cast<size_t>( h[12 + x + 4] ) | (static_cast<size_t>( h[12 + x + 5] ) << 8));
+                            break;
+                        }
+                    }
+                }
+                if (member_length == 0) {
+                    std::fprintf(stderr, "Error: gzip input mixes BGZF and other members; decompress it separately\n");
+                    std::exit(EINVAL);
+                }
+                if (!fill_to(st, pos + member_length)) {
+                    std::fprintf(stderr, "Error: BGZF input is truncated\n");
+                    std::exit(EIO);
+                }
+                piece_t* p = new_piece();
+                h = st->buf.data() + (pos - st->buf_base);
+                p->in.assign(h, h + member_length);
+                if (!queue_piece(st, p)) {
+                    return;
+                }
+                pos += member_length;
+                discard_to(st, pos);
+            }
+        }
+
+        static inline uint64_t load_be64(const unsigned char* p) {
+            uint64_t v = 0;
+            for (int i = 0; i < 8; i++) {
+                v = (v << 8) | p[i];
+            }
+            return v;
+        }
+
+        /* finds the next bzip2 block or end-of-stream magic at or after bit position from_bit */
+        static bool find_bzip2_magic(decompress_state_t* st, uint64_t from_bit, uint64_t* magic_bit, bool* is_eos) {
+            uint64_t byte_pos = from_bit / 8;
+            uint64_t end = 0;
+            uint64_t w = 0;
+            uint64_t candidate = 0;
+            unsigned char tail[8];
+            for (;;) {
+                end = st->buf_base + st->buf.size();
+                for (; byte_pos + 8 <= end; byte_pos++) {
+                    w = load_be64(st->buf.data() + (byte_pos - st->buf_base));
+                    for (int s = 0; s < 8; s++) {
+                        candidate = (w >> (16 - s)) & bzip2_magic_mask;
+                        if (((candidate == bzip2_block_magic) || (candidate == bzip2_eos_magic)) && (byte_pos * 8 + static_cast<uint64_t>( s ) >= from_bit)) {
+                            *magic_bit = byte_pos * 8 + static_cast<uint64_t>( s );
+                            *is_eos = (candidate == bzip2_eos_magic);
+                            return true;
+                        }
+                    }
+                }
+                if (st->is_raw_eof) {
+                    /* the last few bytes are scanned against zero padding, accepting only magics that fit */
+                    for (; byte_pos < end; byte_pos++) {
+                        std::memset(tail, 0, sizeof(tail));
+                        std::memcpy(tail, st->buf.data() + (byte_pos - st->buf_base), static_cast<size_t>( end - byte_pos ));
+                        w = load_be64(tail);
+                        for (int s = 0; s < 8; s++) {
+                            candidate = (w >> (16 - s)) & bzip2_magic_mask;
+                            if (((candidate == bzip2_block_magic) || (candidate == bzip2_eos_magic)) && (byte_pos * 8 + static_cast<uint64_t>( s ) >= from_bit) && (byte_pos * 8 + static_cast<uint64_t>( s ) + 48 <= end * 8)) {
+                                *magic_bit = byte_pos * 8 + static_cast<uint64_t>( s );
+                                *is_eos = (candidate == bzip2_eos_magic);
+                                return true;
+                            }
+                        }
+                    }
+                    return false;
+                }
+                fill_to(st, end + 1);
+            }
+        }
+
+        static bool is_bzip2_stream_header(decompress_state_t* st, uint64_t pos) {
+            if (!fill_to(st, pos + 4)) {
+                return false;
+            }
+            const unsigned char* h = st->buf.data() + (pos - st->buf_base);
+            return (h[0] == 'B') && (h[1] == 'Z') && (h[2] == 'h') && (h[3] >= '1') && (h[3] <= '9');
+        }
+
+        static bool queue_bzip2_block(decompress_state_t* st, uint64_t block_bit, uint64_t end_bit, char level) {
+            piece_t* p = new_piece();
+            p->level = level;
+            p->in_bits = end_bit - block_bit;
+            append_bits(&p->in, 0, st->buf.data(), block_bit - (st->buf_base * 8), p->in_bits);
+            return queue_piece(st, p);
+        }
+
+        static void split_bzip2_input(decompress_state_t* st) {
+            uint64_t stream_pos = 0;
+            uint64_t block_bit = 0;
+            uint64_t magic_bit = 0;
+            uint64_t stream_end = 0;
+            uint64_t search_bit = 0;
+            bool is_eos = false;
+            char level = '9';
+            while (is_bzip2_stream_header(st, stream_pos)) {
+                level = static_cast<char>( st->buf[stream_pos - st->buf_base + 3] );
+                block_bit = (stream_pos + 4) * 8;
+                search_bit = block_bit;
+                for (;;) {
+                    if (!find_bzip2_magic(st, search_bit, &magic_bit, &is_eos)) {
+                        std::fprintf(stderr, "Error: bzip2 input is truncated\n");
+                        std::exit(EIO);
+                    }
+                    if (!is_eos) {
+                        if (magic_bit > block_bit) {
+                            if (!queue_bzip2_block(st, block_bit, magic_bit, level)) {
+                                return;
+                            }
+                            block_bit = magic_bit;
+                            discard_to(st, block_bit / 8);
+                        }
+                        search_bit = magic_bit + 48;
+                        continue;
+                    }
+                    /* end-of-stream magic and stream checksum are followed by padding to a byte boundary */
+                    stream_end = (magic_bit + 48 + 32 + 7) / 8;
+                    if (!fill_to(st, stream_end + 1) && (st->buf_base + st->buf.size() == stream_end)) {
+                        break;
+                    }
+                    if (is_bzip2_stream_header(st, stream_end)) {
+                        break;
+                    }
+                    if ((st->buf_base + st->buf.size() >= stream_end) && st->is_raw_eof && !find_bzip2_magic(st, magic_bit + 1, &search_bit, &is_eos)) {
+                        std::fprintf(stderr, "Warning: Ignoring trailing data after bzip2 input\n");
+                        break;
+                    }
+                    /* an end-of-stream magic inside block data is a coincidence, so the search continues */
+                    search_bit = magic_bit + 1;
+                }
+                if ((magic_bit > block_bit) && !queue_bzip2_block(st, block_bit, magic_bit, level)) {
+                    return;
+                }
+                stream_pos = stream_end;
+                discard_to(st, stream_pos);
+            }
+            if (st->buf_base + st->buf.size() > stream_pos) {
+                std::fprintf(stderr, "Warning: Ignoring trailing data after bzip2 input\n");
+            }
+        }
+
+        // pool side
+
+        /* task pool entry point: decompresses one bzip2 block or BGZF member */
+        static void decompress_piece(void* arg) {
+            piece_t* p = static_cast<piece_t*>( arg );
+            if (p->format == k_bzip2_input) {
+                decompress_bzip2_piece(p);
+            }
+            else {
+                decompress_bgzf_piece(p);
+            }
+        }
+
+        /* appends n_bits bits of src, starting at bit src_bit, to dst at bit dst_bit (MSB-first) */
+        static void append_bits(std::vector<unsigned char>* dst, uint64_t dst_bit, const unsigned char* src, uint64_t src_bit, uint64_t n_bits) {
+            uint64_t bit = 0;
+            uint64_t byte_idx = 0;
+            unsigned int shift = 0;
+            unsigned int v = 0;
+            dst->resize(static_cast<size_t>( (dst_bit + n_bits + 7) / 8 ), 0);
+            /* whole source bytes are shifted in a byte at a time; the remainder bit by bit */
+            for (bit = 0; bit + 8 <= n_bits; bit += 8) {
+                byte_idx = (src_bit + bit) / 8;
+                shift = static_cast<unsigned int>( (src_bit + bit) % 8 );
+                v = static_cast<unsigned int>( src[byte_idx] << shift ) & 0xff;
+                if (shift) {
+                    v |= src[byte_idx + 1] >> (8 - shift);
+                }
+                byte_idx = (dst_bit + bit) / 8;
+                shift = static_cast<unsigned int>( (dst_bit + bit) % 8 );
+                (*dst)[byte_idx] = static_cast<unsigned char>( ((*dst)[byte_idx] & (0xff00 >> shift)) | (v >> shift) );
+                if (shift) {
+                    (*dst)[byte_idx + 1] = static_cast<unsigned char>( (v << (8 - shift)) & 0xff );
+                }
+            }
+            for (; bit < n_bits; bit++) {
+                v = (src[(src_bit + bit) / 8] >> (7 - ((src_bit + bit) % 8))) & 1;
+                byte_idx = (dst_bit + bit) / 8;
+                shift = static_cast<unsigned int>( 7 - ((dst_bit + bit) % 8) );
+                (*dst)[byte_idx] = static_cast<unsigned char>( ((*dst)[byte_idx] & ~(1u << shift)) | (v << shift) );
+            }
+        }
+
+        static void append_uint(std::vector<unsigned char>* dst, uint64_t dst_bit, uint64_t v, unsigned int n_bits) {
+            unsigned char bytes[8];
+            for (int i = 0; i < 8; i++) {
+                bytes[i] = static_cast<unsigned char>( (v << (64 - n_bits)) >> (56 - 8 * i) );
+            }
+            append_bits(dst, dst_bit, bytes, 0, n_bits);
+        }
+
+        /* wraps one block in a single-block stream: header, block, end-of-stream magic and stream checksum */
+        static void decompress_bzip2_piece(piece_t* p) {
+            std::vector<unsigned char> stream;
+            uint32_t block_crc = 0;
+            uint64_t bit = 32;
+            bz_stream bzs;
+            int decompress_res = BZ_OK;
+            size_t out_size = 0;
+            p->is_failed = true;
+            if (p->in_bits < 48 + 32) {
+                return;
+            }
+            for (int i = 0; i < 4; i++) {
+                block_crc = (block_crc << 8) | p->in[static_cast<size_t>( 6 + i )];
+            }
+            stream.push_back('B');
+            stream.push_back('Z');
+            stream.push_back('h');
+            stream.push_back(static_cast<unsigned char>( p->level ));
+            append_bits(&stream, bit, p->in.data(), 0, p->in_bits);
+            bit += p->in_bits;
+            append_uint(&stream, bit, bzip2_eos_magic, 48);
+            bit += 48;
+            /* a single-block stream's checksum is the block's own checksum */
+            append_uint(&stream, bit, block_crc, 32);
+            std::memset(&bzs, 0, sizeof(bzs));
+            if (BZ2_bzDecompressInit(&bzs, 0, 0) != BZ_OK) {
+                return;
+            }
+            p->out.resize(plain_piece_length);
+            bzs.next_in = reinterpret_cast<char*>( stream.data() );
+            bzs.avail_in = static_cast<unsigned int>( stream.size() );
+            for (;;) {
+                bzs.next_out = p->out.data() + out_size;
+                bzs.avail_out = static_cast<unsigned int>( p->out.size() - out_size );
+                decompress_res = BZ2_bzDecompress(&bzs);
+                out_size = p->out.size() - bzs.avail_out;
+                if ((decompress_res != BZ_OK) || ((bzs.avail_in == 0) && (bzs.avail_out > 0))) {
+                    break;
+                }
+                if (bzs.avail_out == 0) {
+                    p->out.resize(p->out.size() * 2);
+                }
+            }
+            BZ2_bzDecompressEnd(&bzs);
+            p->out.resize(out_size);
+            p->is_failed = (decompress_res != BZ_STREAM_END);
+        }
+
+        static void decompress_bgzf_piece(piece_t* p) {
+            z_stream zs;
+            size_t n = p->in.size();
+            /* the member trailer holds the uncompressed length */
+            size_t out_size = static_cast<size_t>( p->in[n - 4] ) | (static_cast<size_t>( p->in[n - 3] ) << 8) | (static_cast<size_t>( p->in[n - 2] ) << 16) | (static_cast<size_t>( p->in[n - 1] ) << 24);
+            int inflate_res = Z_OK;
+            std::memset(&zs, 0, sizeof(zs));
+            p->out.resize(out_size + 1);
+            p->is_failed = true;
+            if (inflateInit2(&zs, 15 + 16) != Z_OK) {
+                return;
+            }
+            zs.next_in = p->in.data();
+            zs.avail_in = static_cast<uInt>( n );
+            zs.next_out = reinterpret_cast<Bytef*>( p->out.data() );
+            zs.avail_out = static_cast<uInt>( p->out.size() );
+            inflate_res = inflate(&zs, Z_FINISH);
+            inflateEnd(&zs);
+            p->is_failed = (inflate_res != Z_STREAM_END) || (zs.total_out != out_size);
+            p->out.resize(out_size);
+        }
+    };
+
+    // replays bytes already read from a stream, then continues reading the stream itself
+    class PrefixedInput
+    {
+    public:
+        /* takes over prefix and rest; closing the returned stream closes rest */
+        static FILE* open(FILE* rest, std::vector<char>* prefix) {
+            prefixed_state_t* st = new prefixed_state_t;
+            st->rest = rest;
+            st->prefix.swap(*prefix);
+            st->prefix_pos = 0;
+#ifdef __APPLE__
+            return funopen(st, read_prefixed_bsd, NULL, NULL, close_prefixed);
+#else
+            cookie_io_functions_t io = { read_prefixed, NULL, NULL, close_prefixed };
+            return fopencookie(st, "r", io);
+#endif
+        }
+
+    private:
+        typedef struct prefixed_state {
+            FILE* rest;                                 // stream the prefix was read from
+            std::vector<char> prefix;                   // bytes read ahead of the consumer
+            size_t prefix_pos;                          // read position in prefix
+        } prefixed_state_t;
+
+#ifdef __APPLE__
+        static int read_prefixed_bsd(void* cookie, char* out, int size) {
+            return static_cast<int>( read_prefixed(cookie, out, static_cast<size_t>( size )) );
+        }
+#endif
+
+        static ssize_t read_prefixed(void* cookie, char* out, size_t size) {
+            prefixed_state_t* st = static_cast<prefixed_state_t*>( cookie );
+            size_t n = st->prefix.size() - st->prefix_pos;
+            if (n > 0) {
+                n = (n < size) ? n : size;
+                std::memcpy(out, st->prefix.data() + st->prefix_pos, n);
+                st->prefix_pos += n;
+                return static_cast<ssize_t>( n );
+            }
+            n = fread(out, 1, size, st->rest);
+            return ferror(st->rest) ? -1 : static_cast<ssize_t>( n );
+        }
+
+        static int close_prefixed(void* cookie) {
+            prefixed_state_t* st = static_cast<prefixed_state_t*>( cookie );
+            int res = fclose(st->rest);
+            delete st;
+            return res;
+        }
+    };
+}
+
+#endif // STARCH3_INPUT_H_
@@ -0,0 +1,352 @@
+#ifndef STARCH3_POOL_H_
+#define STARCH3_POOL_H_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+namespace starch3
+{
+    /*
+       Runs tasks on a fixed set of threads. Each worker has a deque of its own: it takes its newest
+       task first, while the data that task was given is likely still in cache, and once it runs dry
+       it steals the oldest task of another worker. The thread that waits on a task counts as one of
+       the pool's threads and runs queued tasks while it waits, so a pool of n threads starts n - 1
+       workers, and a pool of one thread runs each task as it is submitted. Tasks may be submitted
+       from any thread, including before the pool is started, in which case they run as submitted.
+    */
+    class TaskPool
+    {
+    public:
+        typedef void (*task_fn_t)(void* arg);
+
+        TaskPool() :
+            _is_stopping(false),
+            _queued_count(0),
+            _next_worker(0) {
+            pthread_mutex_init(&_lock, NULL);
+            pthread_cond_init(&_state_is_changed, NULL);
+        }
+
+        ~TaskPool() {
+            stop();
+            pthread_cond_destroy(&_state_is_changed);
+            pthread_mutex_destroy(&_lock);
+        }
+
+        /* starts the workers; with is_pinned, the calling thread and each worker are bound to their own CPU of the process's affinity mask */
+        void start(long n_threads, bool is_pinned) {
+            std::vector<int> cpus;
+            if (is_pinned) {
+                cpus = allowed_cpus();
+                pin_thread(pthread_self(), cpus, 0);
+            }
+            /* the workers are all in place before any runs, and before another thread's submit can see them */
+            pthread_mutex_lock(&_lock);
+            for (long idx = 1; idx < n_threads; idx++) {
+                worker_t* w = new worker_t;
+                w->pool = this;
+                pthread_mutex_init(&w->lock, NULL);
+                _workers.push_back(w);
+            }
+            _is_stopping = false;
+            pthread_mutex_unlock(&_lock);
+            for (size_t idx = 0; idx < _workers.size(); idx++) {
+                pthread_create(&_workers[idx]->thread, NULL, run_worker, _workers[idx]);
+                if (is_pinned) {
+                    pin_thread(_workers[idx]->thread, cpus, idx + 1);
+                }
+            }
+        }
+
+        /* lets the workers finish the tasks already queued, then joins them */
+        void stop(void) {
+            pthread_mutex_lock(&_lock);
+            _is_stopping = true;
+            pthread_cond_broadcast(&_state_is_changed);
+            pthread_mutex_unlock(&_lock);
+            /* a worker looks through every deque until it leaves, so none is freed before all have joined */
+            for (std::vector<worker_t*>::iterator w = _workers.begin(); w != _workers.end(); ++w) {
+                pthread_join((*w)->thread, NULL);
+            }
+            pthread_mutex_lock(&_lock);
+            for (std::vector<worker_t*>::iterator w = _workers.begin(); w != _workers.end(); ++w) {
+                pthread_mutex_destroy(&(*w)->lock);
+                delete *w;
+            }
+            _workers.clear();
+            pthread_mutex_unlock(&_lock);
+        }
+
+        /* threads that run tasks, counting the one that waits on them */
+        size_t size(void) {
+            pthread_mutex_lock(&_lock);
+            size_t n = _workers.size() + 1;
+            pthread_mutex_unlock(&_lock);
+            return n;
+        }
+
+        /*
+           Queues fn(arg), and sets *is_done once it has run. A worker queues onto its own deque; other
+           threads deal tasks out among the workers in turn.
+        */
+        void submit(task_fn_t fn, void* arg, bool* is_done) {
+            task_t t = { fn, arg, is_done };
+            worker_t* w = current_worker();
+            pthread_mutex_lock(&_lock);
+            if (_workers.empty()) {
+                pthread_mutex_unlock(&_lock);
+                run(t);
+                return;
+            }
+            if (!w || (w->pool != this)) {
+                w = _workers[_next_worker++ % _workers.size()];
+            }
+            pthread_mutex_unlock(&_lock);
+            pthread_mutex_lock(&w->lock);
+            w->tasks.push_back(t);
+            pthread_mutex_unlock(&w->lock);
+            pthread_mutex_lock(&_lock);
+            _queued_count++;
+            pthread_cond_broadcast(&_state_is_changed);
+            pthread_mutex_unlock(&_lock);
+        }
+
+        /* whether the task that will set *is_done has run */
+        bool is_done(const bool* is_done) {
+            pthread_mutex_lock(&_lock);
+            bool b = *is_done;
+            pthread_mutex_unlock(&_lock);
+            return b;
+        }
+
+        /* returns once the task that will set *is_done has run, running queued tasks in the meantime */
+        void wait(const bool* is_done) {
+            task_t t;
+            for (;;) {
+                if (this->is_done(is_done)) {
+                    return;
+                }
+                if (take(NULL, &t)) {
+                    run(t);
+                    continue;
+                }
+                pthread_mutex_lock(&_lock);
+                while (!*is_done && (_queued_count <= 0)) {
+                    pthread_cond_wait(&_state_is_changed, &_lock);
+                }
+                pthread_mutex_unlock(&_lock);
+            }
+        }
+
+        /* CPUs this process may run on: its affinity mask, capped by any cgroup CPU quota */
+        static long allotted_cpus(void) {
+            long n = static_cast<long>( allowed_cpus().size() );
+            long quota = cgroup_cpu_quota();
+            if (n < 1) {
+                n = sysconf(_SC_NPROCESSORS_ONLN);
+            }
+            if ((quota > 0) && (quota < n)) {
+                n = quota;
+            }
+            return (n < 1) ? 1 : n;
+        }
+
+    private:
+        typedef struct task {
+            task_fn_t fn;                               // work to run
+            void* arg;                                  // argument of fn
+            bool* is_done;                              // set by the pool, under its lock, once fn has returned
+        } task_t;
+
+        typedef struct worker {
+            TaskPool* pool;                             // pool the worker belongs to
+            pthread_t thread;                           // thread running the worker
+            pthread_mutex_t lock;                       // protects tasks, which thieves take from the front
+            std::deque<task_t> tasks;                   // tasks queued to this worker; it takes from the back
+        } worker_t;
+
+        pthread_mutex_t _lock;
+        pthread_cond_t _state_is_changed;
+        std::vector<worker_t*> _workers;
+        bool _is_stopping;
+        long _queued_count;
+        size_t _next_worker;
+
+        static worker_t*& current_worker(void) {
+            static thread_local worker_t* w = NULL;
+            return w;
+        }
+
+        /* takes a task from the worker's own deque, or else steals one from another; a NULL worker only steals */
+        bool take(worker_t* self, task_t* t) {
+            bool is_taken = false;
+            if (self) {
+                pthread_mutex_lock(&self->lock);
+                if (!self->tasks.empty()) {
+                    *t = self->tasks.back();
+                    self->tasks.pop_back();
+                    is_taken = true;
+                }
+                pthread_mutex_unlock(&self->lock);
+            }
+            for (size_t idx = 0; !is_taken && (idx < _workers.size()); idx++) {
+                worker_t* victim = _workers[idx];
+                if (victim == self) {
+                    continue;
+                }
+                pthread_mutex_lock(&victim->lock);
+                if (!victim->tasks.empty()) {
+                    *t = victim->tasks.front();
+                    victim->tasks.pop_front();
+                    is_taken = true;
+                }
+                pthread_mutex_unlock(&victim->lock);
+            }
+            if (is_taken) {
+                pthread_mutex_lock(&_lock);
+                _queued_count--;
+                pthread_mutex_unlock(&_lock);
+            }
+            return is_taken;
+        }
+
+        void run(const task_t& t) {
+            t.fn(t.arg);
+            pthread_mutex_lock(&_lock);
+            *t.is_done = true;
+            pthread_cond_broadcast(&_state_is_changed);
+            pthread_mutex_unlock(&_lock);
+        }
+
+        static void* run_worker(void* arg) {
+            worker_t* w = static_cast<worker_t*>( arg );
+            TaskPool* pool = w->pool;
+            task_t t;
+            current_worker() = w;
+            for (;;) {
+                if (pool->take(w, &t)) {
+                    pool->run(t);
+                    continue;
+                }
+                pthread_mutex_lock(&pool->_lock);
+                while (!pool->_is_stopping && (pool->_queued_count <= 0)) {
+                    pthread_cond_wait(&pool->_state_is_changed, &pool->_lock);
+                }
+                bool is_finished = pool->_is_stopping && (pool->_queued_count <= 0);
+                pthread_mutex_unlock(&pool->_lock);
+                if (is_finished) {
+                    break;
+                }
+            }
+            return NULL;
+        }
+
+        static std::vector<int> allowed_cpus(void) {
+            std::vector<int> cpus;
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+                for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                    if (CPU_ISSET(cpu, &set)) {
+                        cpus.push_back(cpu);
+                    }
+                }
+            }
+            return cpus;
+        }
+
+        /* binds the thread to the idx-th allowed CPU, wrapping around when there are more threads than CPUs */
+        static void pin_thread(pthread_t thread, const std::vector<int>& cpus, size_t idx) {
+            cpu_set_t set;
+            if (cpus.empty()) {
+                return;
+            }
+            CPU_ZERO(&set);
+            CPU_SET(cpus[idx % cpus.size()], &set);
+            if (pthread_setaffinity_np(thread, sizeof(set), &set) != 0) {
+                std::fprintf(stderr, "Warning: Could not pin thread to CPU [%d]\n", cpus[idx % cpus.size()]);
+            }
+        }
+
+        /* quota over period of a cgroup CPU limit, rounded up to whole CPUs; 0 when the file holds no limit */
+        static long read_cpu_limit(const std::string& quota_fn, const std::string& period_fn) {
+            char quota[32];
+            long long period = 0;
+            FILE* f = std::fopen(quota_fn.c_str(), "r");
+            if (!f) {
+                return 0;
+            }
+            int n = std::fscanf(f, "%31s %lld", quota, &period);
+            std::fclose(f);
+            /* cgroup v1 keeps the period in a file of its own */
+            if ((n == 1) && !period_fn.empty() && ((f = std::fopen(period_fn.c_str(), "r")) != NULL)) {
+                n += std::fscanf(f, "%lld", &period);
+                std::fclose(f);
+            }
+            if ((n != 2) || (period <= 0) || (std::strcmp(quota, "max") == 0)) {
+                return 0;
+            }
+            long long q = std::strtoll(quota, NULL, 10);
+            return (q > 0) ? static_cast<long>( (q + period - 1) / period ) : 0;
+        }
+
+        /*
+           Tightest CPU quota on the process's cgroup or any cgroup above it, from cgroup v2's cpu.max
+           or cgroup v1's cpu controller; 0 when there is none. Inside a cgroup namespace the paths in
+           /proc/self/cgroup may not exist under the mount, so the walk up ends at the mount's root.
+        */
+        static long cgroup_cpu_quota(void) {
+            char line[4096];
+            long quota = 0;
+            FILE* f = std::fopen("/proc/self/cgroup", "r");
+            if (!f) {
+                return 0;
+            }
+            while (std::fgets(line, sizeof(line), f)) {
+                std::string entry(line);
+                std::string::size_type first = entry.find(':');
+                std::string::size_type second = (first == std::string::npos) ? std::string::npos : entry.find(':', first + 1);
+                if (second == std::string::npos) {
+                    continue;
+                }
+                std::string controllers = "," + entry.substr(first + 1, second - first - 1) + ",";
+                std::string path = entry.substr(second + 1);
+                std::vector<std::string> mounts;
+                while (!path.empty() && ((path[path.size() - 1] == '\n') || (path[path.size() - 1] == '/'))) {
+                    path.erase(path.size() - 1);
+                }
+                if (entry.compare(0, 3, "0::") == 0) {
+                    mounts.push_back("/sys/fs/cgroup");
+                }
+                else if (controllers.find(",cpu,") != std::string::npos) {
+                    mounts.push_back("/sys/fs/cgroup/cpu");
+                    mounts.push_back("/sys/fs/cgroup/cpu,cpuacct");
+                }
+                for (std::vector<std::string>::const_iterator m = mounts.begin(); m != mounts.end(); ++m) {
+                    std::string p = path;
+                    for (;;) {
+                        long limit = (entry.compare(0, 3, "0::") == 0) ? read_cpu_limit(*m + p + "/cpu.max", "") : read_cpu_limit(*m + p + "/cpu.cfs_quota_us", *m + p + "/cpu.cfs_period_us");
+                        if ((limit > 0) && ((quota == 0) || (limit < quota))) {
+                            quota = limit;
+                        }
+                        if (p.empty()) {
+                            break;
+                        }
+                        p.erase(p.rfind('/'));
+                    }
+                }
+            }
+            std::fclose(f);
+            return quota;
+        }
+    };
+}
+
+#endif // STARCH3_POOL_H_
@@ -0,0 +1,1329 @@
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <climits>
+#include <ctime>
+#include <map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "libstarch3.hpp"
+#include "starch3crc32c.hpp"
+#include "starch3hash.hpp"
+
+const unsigned char starch3::Archive::header_magic_bytes[4] = { 0xca, 0x5c, 0xad, 0x1a }; /* ca5cad1a */
+const unsigned char starch3::Archive::columnar_magic_bytes[8] = { 'S', '3', 'C', 'O', 'L', 'S', 0x00, 0x00 }; /* S3COLS */
+
+// helpers
+
+static const char*
+parse_int64(const char* p, const char* end, int64_t* v)
+{
+    bool is_negative = false;
+    int64_t n = 0;
+    if ((p < end) && (*p == '-')) {
+        is_negative = true;
+        p++;
+    }
+    if ((p == end) || (*p < '0') || (*p > '9')) {
+        return NULL;
+    }
+    while ((p < end) && (*p >= '0') && (*p <= '9')) {
+        n = (n * 10) + (*p++ - '0');
+    }
+    *v = is_negative ? -n : n;
+    return p;
+}
+
+/* writes the decimal digits of v without a terminator, returning their count */
+static size_t
+format_int64(char* out, int64_t v)
+{
+    char digits[20];
+    size_t n = 0;
+    size_t len = 0;
+    uint64_t u = (v < 0) ? (~static_cast<uint64_t>( v ) + 1) : static_cast<uint64_t>( v );
+    do {
+        digits[n++] = static_cast<char>( '0' + (u % 10) );
+        u /= 10;
+    } while (u != 0);
+    if (v < 0) {
+        out[len++] = '-';
+    }
+    while (n > 0) {
+        out[len++] = digits[--n];
+    }
+    return len;
+}
+
+/* decimal digit count of each value, summed without branches so the loop vectorizes */
+static size_t
+digit_cost(const int64_t* __restrict__ values, size_t n)
+{
+    static const int64_t powers[] = { 10LL, 100LL, 1000LL, 10000LL, 100000LL, 1000000LL, 10000000LL, 100000000LL, 1000000000LL, 10000000000LL, 100000000000LL, 1000000000000LL };
+    size_t cost = 0;
+    int64_t v = 0;
+    for (size_t idx = 0; idx < n; idx++) {
+        v = values[idx];
+        cost += 1 + static_cast<size_t>( v < 0 );
+        v = (v < 0) ? -v : v;
+        for (size_t p = 0; p < sizeof(powers) / sizeof(powers[0]); p++) {
+            cost += static_cast<size_t>( v >= powers[p] );
+        }
+    }
+    return cost;
+}
+
+static void
+ignore_block_close(void*)
+{
+}
+
+static starch3::status_t
+pread_fully(int fd, char* buf, size_t len, off_t offset)
+{
+    size_t pos = 0;
+    ssize_t res = 0;
+    while (pos < len) {
+        res = pread(fd, buf + pos, len - pos, offset + static_cast<off_t>( pos ));
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return starch3::k_status_error;
+        }
+        if (res == 0) {
+            return starch3::k_status_error;
+        }
+        pos += static_cast<size_t>( res );
+    }
+    return starch3::k_status_ok;
+}
+
+// starch3::Archive
+
+json_t*
+starch3::Archive::metadata_to_json(const std::vector<stream_record_t>& streams, const std::string& note)
+{
+    char timestamp[32] = {0};
+    char tf_hash_str[17] = {0};
+    time_t now = time(NULL);
+    struct tm now_utc;
+    json_t* metadata = json_object();
+    json_t* archive = json_object();
+    json_t* version = json_object();
+    json_t* stream_array = json_array();
+    json_t* shared_array = json_array();
+    std::map<off_t, size_t> chunk_uses;
+    std::map<off_t, size_t> shared_idxs;
+    int64_t first_record = 0;
+    const char* format = NULL;
+    gmtime_r(&now, &now_utc);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", &now_utc);
+    json_object_set_new(version, "major", json_integer(version_major));
+    json_object_set_new(version, "minor", json_integer(version_minor));
+    json_object_set_new(version, "revision", json_integer(version_revision));
+    json_object_set_new(archive, "type", json_string("starch"));
+    json_object_set_new(archive, "version", version);
+    json_object_set_new(archive, "creation_timestamp", json_string(timestamp));
+    /* the codec of every chunk, or "mixed" when --auto chose more than one; per-stream "compression" keys give the levels */
+    for (std::vector<stream_record_t>::const_iterator s = streams.begin(); s != streams.end(); ++s) {
+        for (std::vector<chunk_record_t>::const_iterator c = s->chunks.begin(); c != s->chunks.end(); ++c) {
+            const char* name = (c->codec == k_gzip_codec) ? "gzip" : "bzip2";
+            format = (!format || (std::strcmp(format, name) == 0)) ? name : "mixed";
+        }
+    }
+    json_object_set_new(archive, "compression_format", json_string(format ? format : "bzip2"));
+    json_object_set_new(archive, "checksum", json_string("crc32c"));
+    if (!note.empty()) {
+        json_object_set_new(archive, "note", json_string(note.c_str()));
+    }
+    /* chunks that small chromosomes share are described once, and each chromosome's span refers to them by index */
+    for (std::vector<stream_record_t>::const_iterator s = streams.begin(); s != streams.end(); ++s) {
+        for (std::vector<chunk_record_t>::const_iterator c = s->chunks.begin(); c != s->chunks.end(); ++c) {
+            chunk_uses[c->offset]++;
+        }
+    }
+    for (std::vector<stream_record_t>::const_iterator s = streams.begin(); s != streams.end(); ++s) {
+        for (std::vector<chunk_record_t>::const_iterator c = s->chunks.begin(); c != s->chunks.end(); ++c) {
+            if ((chunk_uses[c->offset] > 1) && (shared_idxs.find(c->offset) == shared_idxs.end())) {
+                json_t* shared_chunk = json_object();
+                shared_idxs[c->offset] = json_array_size(shared_array);
+                json_object_set_new(shared_chunk, "offset", json_integer(static_cast<json_int_t>( c->offset )));
+                json_object_set_new(shared_chunk, "compressed_size", json_integer(static_cast<json_int_t>( c->size )));
+                json_object_set_new(shared_chunk, "compressed_crc32c", json_integer(static_cast<json_int_t>( c->compressed_crc32c )));
+                json_object_set_new(shared_chunk, "compression", json_string(codec_name(c->codec, c->level).c_str()));
+                json_array_append_new(shared_array, shared_chunk);
+            }
+        }
+    }
+    for (std::vector<stream_record_t>::const_iterator s = streams.begin(); s != streams.end(); ++s) {
+        json_t* stream = json_object();
+        json_t* chunk_array = json_array();
+        bool is_shared_only = true;
+        /* a stream's compression is that of its first chunk; a later chunk notes its own only where it differs */
+        codec_t codec = s->chunks.empty() ? k_bzip2_codec : s->chunks.front().codec;
+        int level = s->chunks.empty() ? default_bzip2_level : s->chunks.front().level;
+        for (std::vector<chunk_record_t>::const_iterator c = s->chunks.begin(); c != s->chunks.end(); ++c) {
+            /* span: [shared chunk, transformed offset, transformed size, line count, min start, max stop, base count, unique base count, transformed CRC32C] */
+            if (shared_idxs.find(c->offset) != shared_idxs.end()) {
+                json_t* span = json_array();
+                json_array_append_new(span, json_integer(static_cast<json_int_t>( shared_idxs[c->offset] )));
+                json_array_append_new(span, json_integer(static_cast<json_int_t>( c->tf_offset )));
+                json_array_append_new(span, json_integer(static_cast<json_int_t>( c->tf_size )));
+                json_array_append_new(span, json_integer(static_cast<json_int_t>( c->line_count )));
+                json_array_append_new(span, json_integer(static_cast<json_int_t>( c->min_start )));
+                json_array_append_new(span, json_integer(static_cast<json_int_t>( c->max_stop )));
+                json_array_append_new(span, json_integer(static_cast<json_int_t>( c->base_count )));
+                json_array_append_new(span, json_integer(static_cast<json_int_t>( c->unique_base_count )));
+                json_array_append_new(span, json_integer(static_cast<json_int_t>( c->tf_crc32c )));
+                json_array_append_new(chunk_array, span);
+                first_record += c->line_count;
+                continue;
+            }
+            is_shared_only = false;
+            json_t* chunk = json_object();
+            json_object_set_new(chunk, "offset", json_integer(static_cast<json_int_t>( c->offset )));
+            json_object_set_new(chunk, "compressed_size", json_integer(static_cast<json_int_t>( c->size )));
+            json_object_set_new(chunk, "transformed_offset", json_integer(static_cast<json_int_t>( c->tf_offset )));
+            json_object_set_new(chunk, "transformed_size", json_integer(static_cast<json_int_t>( c->tf_size )));
+            json_object_set_new(chunk, "line_count", json_integer(static_cast<json_int_t>( c->line_count )));
+            /* counted over the streams written here, so a shard's ordinals start from 0 */
+            json_object_set_new(chunk, "first_record", json_integer(static_cast<json_int_t>( first_record )));
+            first_record += c->line_count;
+            json_object_set_new(chunk, "min_start", json_integer(static_cast<json_int_t>( c->min_start )));
+            json_object_set_new(chunk, "max_stop", json_integer(static_cast<json_int_t>( c->max_stop )));
+            json_object_set_new(chunk, "base_count", json_integer(static_cast<json_int_t>( c->base_count )));
+            json_object_set_new(chunk, "unique_base_count", json_integer(static_cast<json_int_t>( c->unique_base_count )));
+            json_object_set_new(chunk, "transformed_crc32c", json_integer(static_cast<json_int_t>( c->tf_crc32c )));
+            json_object_set_new(chunk, "compressed_crc32c", json_integer(static_cast<json_int_t>( c->compressed_crc32c )));
+            /* JSON integers are signed, so the hash is written as hex; shared chunks have none */
+            if (c->tf_hash != 0) {
+                std::snprintf(tf_hash_str, sizeof(tf_hash_str), "%016" PRIx64, c->tf_hash);
+                json_object_set_new(chunk, "transformed_hash", json_string(tf_hash_str));
+            }
+            if ((c->codec != codec) || (c->level != level)) {
+                json_object_set_new(chunk, "compression", json_string(codec_name(c->codec, c->level).c_str()));
+            }
+            json_array_append_new(chunk_array, chunk);
+        }
+        json_object_set_new(stream, "chromosome", json_string(s->chr.c_str()));
+        /* the totals of a one-chunk stream are those of its chunk, so readers derive them */
+        if (s->chunks.size() != 1) {
+            json_object_set_new(stream, "line_count", json_integer(static_cast<json_int_t>( s->line_count )));
+            json_object_set_new(stream, "transformed_size", json_integer(static_cast<json_int_t>( s->tf_size )));
+            json_object_set_new(stream, "compressed_size", json_integer(static_cast<json_int_t>( s->size )));
+            json_object_set_new(stream, "transformed_crc32c", json_integer(static_cast<json_int_t>( s->tf_crc32c )));
+            json_object_set_new(stream, "compressed_crc32c", json_integer(static_cast<json_int_t>( s->compressed_crc32c )));
+        }
+        /* spans take their compression from the shared chunk */
+        if (!is_shared_only || s->chunks.empty()) {
+            json_object_set_new(stream, "compression", json_string(codec_name(codec, level).c_str()));
+        }
+        json_object_set_new(stream, "chunks", chunk_array);
+        json_array_append_new(stream_array, stream);
+    }
+    json_object_set_new(metadata, "archive", archive);
+    if (json_array_size(shared_array) > 0) {
+        json_object_set_new(metadata, "shared_chunks", shared_array);
+    }
+    else {
+        json_decref(shared_array);
+    }
+    json_object_set_new(metadata, "streams", stream_array);
+    return metadata;
+}
+
+starch3::status_t
+starch3::Archive::json_to_metadata(json_t* metadata, std::vector<stream_record_t>* streams, std::string* error)
+{
+    json_t* stream_array = json_object_get(metadata, "streams");
+    json_t* shared_array = json_object_get(metadata, "shared_chunks");
+    json_t* stream = NULL;
+    json_t* chunk = NULL;
+    size_t stream_idx = 0;
+    size_t chunk_idx = 0;
+    int64_t first_record = 0;
+    json_t* version = json_object_get(json_object_get(metadata, "archive"), "version");
+    char version_str[64] = {0};
+    if (!json_is_array(stream_array)) {
+        error->assign("Archive metadata has no streams");
+        return k_status_error;
+    }
+    /* minor versions add stream features, so only newer minor versions are unreadable */
+    if ((json_integer_value(json_object_get(version, "major")) != version_major) || (json_integer_value(json_object_get(version, "minor")) > version_minor)) {
+        std::snprintf(version_str, sizeof(version_str), "%" JSON_INTEGER_FORMAT ".%" JSON_INTEGER_FORMAT, json_integer_value(json_object_get(version, "major")), json_integer_value(json_object_get(version, "minor")));
+        error->assign("Archive version is not supported (");
+        error->append(version_str);
+        error->append(")");
+        return k_status_error;
+    }
+    streams->clear();
+    json_array_foreach(stream_array, stream_idx, stream) {
+        stream_record_t sr;
+        if (!json_is_string(json_object_get(stream, "chromosome")) || !json_is_array(json_object_get(stream, "chunks"))) {
+            error->assign("Archive metadata stream is missing its chromosome or chunks");
+            return k_status_error;
+        }
+        sr.chr = json_string_value(json_object_get(stream, "chromosome"));
+        /* archives written before per-stream compression hold only bzip2 chunks */
+        codec_t codec = k_bzip2_codec;
+        int level = default_bzip2_level;
+        if (json_object_get(stream, "compression") && !parse_codec_name(json_string_value(json_object_get(stream, "compression")), &codec, &level)) {
+            error->assign("Archive stream compression is not supported");
+            return k_status_error;
+        }
+        json_array_foreach(json_object_get(stream, "chunks"), chunk_idx, chunk) {
+            chunk_record_t cr;
+            cr.codec = codec;
+            cr.level = level;
+            /* a span of a chunk listed under "shared_chunks"; see metadata_to_json() for its fields */
+            if (json_is_array(chunk)) {
+                json_t* shared_chunk = json_array_get(shared_array, static_cast<size_t>( json_integer_value(json_array_get(chunk, 0)) ));
+                if ((json_array_size(chunk) != 9) || !json_is_object(shared_chunk)) {
+                    error->assign("Archive metadata chunk span is not valid");
+                    return k_status_error;
+                }
+                if (!parse_codec_name(json_string_value(json_object_get(shared_chunk, "compression")), &cr.codec, &cr.level)) {
+                    error->assign("Archive chunk compression is not supported");
+                    return k_status_error;
+                }
+                cr.offset = static_cast<off_t>( json_integer_value(json_object_get(shared_chunk, "offset")) );
+                cr.size = static_cast<size_t>( json_integer_value(json_object_get(shared_chunk, "compressed_size")) );
+                cr.compressed_crc32c = static_cast<uint32_t>( json_integer_value(json_object_get(shared_chunk, "compressed_crc32c")) );
+                cr.tf_offset = static_cast<size_t>( json_integer_value(json_array_get(chunk, 1)) );
+                cr.tf_size = static_cast<size_t>( json_integer_value(json_array_get(chunk, 2)) );
+                cr.line_count = static_cast<int64_t>( json_integer_value(json_array_get(chunk, 3)) );
+                cr.first_record = first_record;
+                first_record += cr.line_count;
+                cr.min_start = static_cast<int64_t>( json_integer_value(json_array_get(chunk, 4)) );
+                cr.max_stop = static_cast<int64_t>( json_integer_value(json_array_get(chunk, 5)) );
+                cr.base_count = static_cast<int64_t>( json_integer_value(json_array_get(chunk, 6)) );
+                cr.unique_base_count = static_cast<int64_t>( json_integer_value(json_array_get(chunk, 7)) );
+                cr.tf_crc32c = static_cast<uint32_t>( json_integer_value(json_array_get(chunk, 8)) );
+                cr.tf_hash = 0;
+                sr.chunks.push_back(cr);
+                continue;
+            }
+            if (json_object_get(chunk, "compression") && !parse_codec_name(json_string_value(json_object_get(chunk, "compression")), &cr.codec, &cr.level)) {
+                error->assign("Archive chunk compression is not supported");
+                return k_status_error;
+            }
+            cr.offset = static_cast<off_t>( json_integer_value(json_object_get(chunk, "offset")) );
+            cr.size = static_cast<size_t>( json_integer_value(json_object_get(chunk, "compressed_size")) );
+            cr.tf_offset = static_cast<size_t>( json_integer_value(json_object_get(chunk, "transformed_offset")) );
+            cr.tf_size = static_cast<size_t>( json_integer_value(json_object_get(chunk, "transformed_size")) );
+            cr.line_count = static_cast<int64_t>( json_integer_value(json_object_get(chunk, "line_count")) );
+            /* archives written before ordinals were recorded are counted as they are read */
+            cr.first_record = json_is_integer(json_object_get(chunk, "first_record")) ? static_cast<int64_t>( json_integer_value(json_object_get(chunk, "first_record")) ) : first_record;
+            first_record = cr.first_record + cr.line_count;
+            /* chunks written before ranges were recorded may hold any coordinate */
+            cr.min_start = json_is_integer(json_object_get(chunk, "min_start")) ? static_cast<int64_t>( json_integer_value(json_object_get(chunk, "min_start")) ) : 0;
+            cr.max_stop = json_is_integer(json_object_get(chunk, "max_stop")) ? static_cast<int64_t>( json_integer_value(json_object_get(chunk, "max_stop")) ) : INT64_MAX;
+            cr.base_count = json_is_integer(json_object_get(chunk, "base_count")) ? static_cast<int64_t>( json_integer_value(json_object_get(chunk, "base_count")) ) : -1;
+            cr.unique_base_count = json_is_integer(json_object_get(chunk, "unique_base_count")) ? static_cast<int64_t>( json_integer_value(json_object_get(chunk, "unique_base_count")) ) : -1;
+            cr.tf_crc32c = static_cast<uint32_t>( json_integer_value(json_object_get(chunk, "transformed_crc32c")) );
+            cr.compressed_crc32c = static_cast<uint32_t>( json_integer_value(json_object_get(chunk, "compressed_crc32c")) );
+            cr.tf_hash = json_is_string(json_object_get(chunk, "transformed_hash")) ? static_cast<uint64_t>( std::strtoull(json_string_value(json_object_get(chunk, "transformed_hash")), NULL, 16) ) : 0;
+            sr.chunks.push_back(cr);
+        }
+        /* streams of one chunk leave their totals to be derived from it */
+        if (json_is_integer(json_object_get(stream, "line_count"))) {
+            sr.line_count = static_cast<int64_t>( json_integer_value(json_object_get(stream, "line_count")) );
+            sr.tf_size = static_cast<uint64_t>( json_integer_value(json_object_get(stream, "transformed_size")) );
+            sr.size = static_cast<uint64_t>( json_integer_value(json_object_get(stream, "compressed_size")) );
+            sr.tf_crc32c = static_cast<uint32_t>( json_integer_value(json_object_get(stream, "transformed_crc32c")) );
+            sr.compressed_crc32c = static_cast<uint32_t>( json_integer_value(json_object_get(stream, "compressed_crc32c")) );
+        }
+        else {
+            sr.line_count = 0;
+            sr.tf_size = 0;
+            sr.size = 0;
+            sr.tf_crc32c = 0;
+            sr.compressed_crc32c = 0;
+            for (std::vector<chunk_record_t>::const_iterator c = sr.chunks.begin(); c != sr.chunks.end(); ++c) {
+                sr.tf_crc32c = (c == sr.chunks.begin()) ? c->tf_crc32c : CRC32C::combine(sr.tf_crc32c, c->tf_crc32c, c->tf_size);
+                sr.compressed_crc32c = (c == sr.chunks.begin()) ? c->compressed_crc32c : CRC32C::combine(sr.compressed_crc32c, c->compressed_crc32c, c->size);
+                sr.line_count += c->line_count;
+                sr.tf_size += c->tf_size;
+                sr.size += c->size;
+            }
+        }
+        streams->push_back(sr);
+    }
+    return k_status_ok;
+}
+
+void
+starch3::Archive::format_footer(char* footer, off_t metadata_offset, uint32_t metadata_crc32c)
+{
+    /* zero-padded metadata offset, metadata checksum, space padding and newline */
+    std::memset(footer, ' ', footer_length);
+    std::snprintf(footer, footer_length, "%0*jd%08x", footer_offset_length, static_cast<intmax_t>( metadata_offset ), metadata_crc32c);
+    footer[std::strlen(footer)] = ' ';
+    footer[footer_length - 1] = '\n';
+}
+
+starch3::status_t
+starch3::Archive::read_metadata(int fd, std::vector<stream_record_t>* streams, std::string* error)
+{
+    struct stat in_stats;
+    unsigned char magic_bytes[sizeof(header_magic_bytes)];
+    char footer[footer_length + 1] = {0};
+    char offset_str[footer_offset_length + 1] = {0};
+    char* end_ptr = NULL;
+    off_t metadata_offset = 0;
+    size_t metadata_size = 0;
+    uint32_t metadata_crc32c = 0;
+    std::vector<char> metadata_str;
+    json_error_t json_error;
+    json_t* metadata = NULL;
+    status_t res = k_status_ok;
+
+    if ((fstat(fd, &in_stats) == -1) || (static_cast<size_t>( in_stats.st_size ) < sizeof(magic_bytes) + footer_length)) {
+        error->assign("Archive is too small to contain metadata");
+        return k_status_error;
+    }
+    if ((pread_fully(fd, reinterpret_cast<char*>( magic_bytes ), sizeof(magic_bytes), 0) != k_status_ok) || (std::memcmp(magic_bytes, header_magic_bytes, sizeof(magic_bytes)) != 0)) {
+        error->assign("Archive header is not recognized");
+        return k_status_error;
+    }
+    if (pread_fully(fd, footer, footer_length, in_stats.st_size - static_cast<off_t>( footer_length )) != k_status_ok) {
+        error->assign("Could not read archive footer");
+        return k_status_error;
+    }
+    std::memcpy(offset_str, footer, footer_offset_length);
+    metadata_offset = static_cast<off_t>( std::strtoll(offset_str, &end_ptr, 10) );
+    if ((*end_ptr != '\0') || (metadata_offset < static_cast<off_t>( sizeof(magic_bytes) )) || (metadata_offset > in_stats.st_size - static_cast<off_t>( footer_length ))) {
+        error->assign("Archive footer metadata offset is invalid");
+        return k_status_error;
+    }
+    footer[footer_offset_length + 8] = '\0';
+    metadata_crc32c = static_cast<uint32_t>( std::strtoul(footer + footer_offset_length, NULL, 16) );
+    metadata_size = static_cast<size_t>( in_stats.st_size - static_cast<off_t>( footer_length ) - metadata_offset );
+    metadata_str.resize(metadata_size + 1);
+    if (pread_fully(fd, metadata_str.data(), metadata_size, metadata_offset) != k_status_ok) {
+        error->assign("Could not read archive metadata");
+        return k_status_error;
+    }
+    if (CRC32C::update(0, metadata_str.data(), metadata_size) != metadata_crc32c) {
+        error->assign("Archive metadata checksum does not match footer");
+        return k_status_error;
+    }
+    metadata = json_loadb(metadata_str.data(), metadata_size, 0, &json_error);
+    if (!metadata) {
+        error->assign("Could not parse archive metadata (");
+        error->append(json_error.text);
+        error->append(")");
+        return k_status_error;
+    }
+    res = json_to_metadata(metadata, streams, error);
+    json_decref(metadata);
+    return res;
+}
+
+void
+starch3::Archive::append_chunk_record(std::vector<stream_record_t>* streams, const char* chr, size_t chr_length, const chunk_record_t& cr)
+{
+    int64_t first_record = 0;
+    if (!streams->empty() && !streams->back().chunks.empty()) {
+        first_record = streams->back().chunks.back().first_record + streams->back().chunks.back().line_count;
+    }
+    if (streams->empty() || (streams->back().chr.compare(0, std::string::npos, chr, chr_length) != 0)) {
+        stream_record_t sr;
+        sr.chr.assign(chr, chr_length);
+        sr.line_count = 0;
+        sr.tf_size = 0;
+        sr.size = 0;
+        sr.tf_crc32c = 0;
+        sr.compressed_crc32c = 0;
+        streams->push_back(sr);
+    }
+    stream_record_t& s = streams->back();
+    /* a stream's first chunk, which is all a packed chromosome has, needs no combining */
+    if (s.chunks.empty()) {
+        s.tf_crc32c = cr.tf_crc32c;
+        s.compressed_crc32c = cr.compressed_crc32c;
+    }
+    else {
+        s.tf_crc32c = CRC32C::combine(s.tf_crc32c, cr.tf_crc32c, cr.tf_size);
+        s.compressed_crc32c = CRC32C::combine(s.compressed_crc32c, cr.compressed_crc32c, cr.size);
+    }
+    s.line_count += cr.line_count;
+    s.tf_size += cr.tf_size;
+    s.size += cr.size;
+    s.chunks.push_back(cr);
+    s.chunks.back().first_record = first_record;
+}
+
+/* whether the chunk may hold records overlapping the half-open interval [start, stop) */
+bool
+starch3::Archive::chunk_overlaps(const chunk_record_t& cr, int64_t start, int64_t stop)
+{
+    return (cr.min_start < stop) && (cr.max_stop > start);
+}
+
+size_t
+starch3::Archive::compressed_bound(size_t tf_size)
+{
+    /* bzip2 output is bounded by 1% growth plus 600 bytes, which also covers gzip's smaller bound */
+    return tf_size + (tf_size / 100) + 600;
+}
+
+/* names a compression setting as in the metadata, such as "bzip2-9" or "gzip-6" */
+std::string
+starch3::Archive::codec_name(codec_t codec, int level)
+{
+    char name[32] = {0};
+    std::snprintf(name, sizeof(name), "%s-%d", (codec == k_gzip_codec) ? "gzip" : "bzip2", level);
+    return std::string(name);
+}
+
+bool
+starch3::Archive::parse_codec_name(const char* s, codec_t* codec, int* level)
+{
+    char* end_ptr = NULL;
+    const char* dash = s ? std::strrchr(s, '-') : NULL;
+    long v = 0;
+    if (!dash) {
+        return false;
+    }
+    if ((static_cast<size_t>( dash - s ) == 5) && (std::strncmp(s, "bzip2", 5) == 0)) {
+        *codec = k_bzip2_codec;
+    }
+    else if ((static_cast<size_t>( dash - s ) == 4) && (std::strncmp(s, "gzip", 4) == 0)) {
+        *codec = k_gzip_codec;
+    }
+    else {
+        return false;
+    }
+    v = std::strtol(dash + 1, &end_ptr, 10);
+    if ((end_ptr == dash + 1) || (*end_ptr != '\0') || (v < 1) || (v > 9)) {
+        return false;
+    }
+    *level = static_cast<int>( v );
+    return true;
+}
+
+/* compresses a chunk with the given setting as a complete bzip2 or gzip stream */
+starch3::status_t
+starch3::Archive::compress_chunk(codec_t codec, int level, const char* tf, size_t tf_size, char* out, size_t out_capacity, size_t* out_size, std::string* error)
+{
+    bz_stream bzs;
+    z_stream zs;
+    status_t res = k_status_ok;
+    int deflate_res = Z_OK;
+    if (codec == k_bzip2_codec) {
+        bzs.bzalloc = NULL;
+        bzs.bzfree = NULL;
+        bzs.opaque = NULL;
+        if (BZ2_bzCompressInit(&bzs, level, 0, 30) != BZ_OK) {
+            error->assign("bzip2 compression could not be initialized");
+            return k_status_error;
+        }
+        bzs.block_close_functor = ignore_block_close;
+        res = compress_chunk(&bzs, tf, tf_size, out, out_capacity, out_size, error);
+        BZ2_bzCompressEnd(&bzs);
+        return res;
+    }
+    zs.zalloc = Z_NULL;
+    zs.zfree = Z_NULL;
+    zs.opaque = Z_NULL;
+    /* a window of 15 bits plus 16 selects a gzip wrapper */
+    if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        error->assign("gzip compression could not be initialized");
+        return k_status_error;
+    }
+    zs.next_in = reinterpret_cast<Bytef*>( const_cast<char*>( tf ) );
+    zs.avail_in = static_cast<uInt>( tf_size );
+    zs.next_out = reinterpret_cast<Bytef*>( out );
+    zs.avail_out = static_cast<uInt>( out_capacity );
+    deflate_res = deflate(&zs, Z_FINISH);
+    *out_size = out_capacity - zs.avail_out;
+    deflateEnd(&zs);
+    if (deflate_res != Z_STREAM_END) {
+        error->assign("gzip compression of transformation buffer failed");
+        return k_status_error;
+    }
+    return k_status_ok;
+}
+
+/* decompresses the first tf_size bytes of a compressed chunk into tf; the rest of the stream is not decoded */
+starch3::status_t
+starch3::Archive::decompress_chunk(codec_t codec, const char* compressed, size_t size, char* tf, size_t tf_size, std::string* error)
+{
+    bz_stream bzs;
+    z_stream zs;
+    int decompress_res = BZ_OK;
+    if (codec == k_gzip_codec) {
+        zs.zalloc = Z_NULL;
+        zs.zfree = Z_NULL;
+        zs.opaque = Z_NULL;
+        zs.next_in = reinterpret_cast<Bytef*>( const_cast<char*>( compressed ) );
+        zs.avail_in = static_cast<uInt>( size );
+        if (inflateInit2(&zs, 15 + 16) != Z_OK) {
+            error->assign("gzip decompression could not be initialized");
+            return k_status_error;
+        }
+        zs.next_out = reinterpret_cast<Bytef*>( tf );
+        zs.avail_out = static_cast<uInt>( tf_size );
+        do {
+            decompress_res = inflate(&zs, Z_NO_FLUSH);
+        } while ((decompress_res == Z_OK) && (zs.avail_out > 0) && (zs.avail_in > 0));
+        inflateEnd(&zs);
+        if (((decompress_res != Z_STREAM_END) && (decompress_res != Z_OK)) || (zs.avail_out != 0)) {
+            error->assign("gzip decompression of chunk failed");
+            return k_status_error;
+        }
+        return k_status_ok;
+    }
+    bzs.bzalloc = NULL;
+    bzs.bzfree = NULL;
+    bzs.opaque = NULL;
+    if (BZ2_bzDecompressInit(&bzs, 0, 0) != BZ_OK) {
+        error->assign("bzip2 decompression could not be initialized");
+        return k_status_error;
+    }
+    bzs.next_in = const_cast<char*>( compressed );
+    bzs.avail_in = static_cast<unsigned int>( size );
+    bzs.next_out = tf;
+    bzs.avail_out = static_cast<unsigned int>( tf_size );
+    do {
+        decompress_res = BZ2_bzDecompress(&bzs);
+    } while ((decompress_res == BZ_OK) && (bzs.avail_out > 0) && (bzs.avail_in > 0));
+    BZ2_bzDecompressEnd(&bzs);
+    if (((decompress_res != BZ_STREAM_END) && (decompress_res != BZ_OK)) || (bzs.avail_out != 0)) {
+        error->assign("bzip2 decompression of chunk failed");
+        return k_status_error;
+    }
+    return k_status_ok;
+}
+
+starch3::status_t
+starch3::Archive::compress_chunk(bz_stream* bzs, const char* tf, size_t tf_size, char* out, size_t out_capacity, size_t* out_size, std::string* error)
+{
+    int compress_res = BZ_OK;
+    bzs->next_in = const_cast<char*>( tf );
+    bzs->avail_in = static_cast<unsigned int>( tf_size );
+    bzs->next_out = out;
+    bzs->avail_out = static_cast<unsigned int>( out_capacity );
+    do {
+        compress_res = BZ2_bzCompress(bzs, BZ_FINISH);
+    } while (compress_res == BZ_FINISH_OK);
+    if (compress_res != BZ_STREAM_END) {
+        error->assign("bzip2 compression of transformation buffer failed");
+        return k_status_error;
+    }
+    *out_size = out_capacity - bzs->avail_out;
+    return k_status_ok;
+}
+
+starch3::status_t
+starch3::Archive::read_chunk(int fd, const chunk_record_t& cr, std::vector<char>* compressed, std::vector<char>* tf, std::string* error)
+{
+    compressed->resize(cr.size);
+    if (pread_fully(fd, compressed->data(), cr.size, cr.offset) != k_status_ok) {
+        error->assign("Could not read compressed chunk");
+        return k_status_error;
+    }
+    return decode_chunk(compressed->data(), cr, tf, error);
+}
+
+starch3::status_t
+starch3::Archive::read_chunk_prefix(int fd, const chunk_record_t& cr, size_t tf_end, std::vector<char>* compressed, std::vector<char>* tf, std::string* error)
+{
+    compressed->resize(cr.size);
+    if (pread_fully(fd, compressed->data(), cr.size, cr.offset) != k_status_ok) {
+        error->assign("Could not read compressed chunk");
+        return k_status_error;
+    }
+    return decode_chunk_prefix(compressed->data(), cr, tf_end, tf, error);
+}
+
+/* checks and decompresses a chunk already in memory, such as a mapped archive, leaving only the record's own bytes */
+starch3::status_t
+starch3::Archive::decode_chunk(const char* compressed, const chunk_record_t& cr, std::vector<char>* tf, std::string* error)
+{
+    if (decode_chunk_prefix(compressed, cr, cr.tf_offset + cr.tf_size, tf, error) != k_status_ok) {
+        return k_status_error;
+    }
+    if (CRC32C::update(0, tf->data() + cr.tf_offset, cr.tf_size) != cr.tf_crc32c) {
+        error->assign("Transformed chunk checksum does not match metadata");
+        return k_status_error;
+    }
+    if (cr.tf_offset > 0) {
+        tf->erase(tf->begin(), tf->begin() + static_cast<std::ptrdiff_t>( cr.tf_offset ));
+    }
+    return k_status_ok;
+}
+
+/*
+   Decompresses the first tf_end bytes of a chunk, checking only the compressed bytes. Chromosomes
+   sharing a chunk can be decoded together this way, each checking its own span; decompression stops
+   at the end of the last span that is needed.
+*/
+starch3::status_t
+starch3::Archive::decode_chunk_prefix(const char* compressed, const chunk_record_t& cr, size_t tf_end, std::vector<char>* tf, std::string* error)
+{
+    tf->resize(tf_end);
+    if (CRC32C::update(0, compressed, cr.size) != cr.compressed_crc32c) {
+        error->assign("Compressed chunk checksum does not match metadata");
+        return k_status_error;
+    }
+    return decompress_chunk(cr.codec, compressed, cr.size, tf->data(), tf_end, error);
+}
+
+// starch3::ChunkCursor
+
+starch3::ChunkCursor::ChunkCursor(const char* tf, size_t tf_size) :
+    _pos(tf),
+    _end(tf + tf_size),
+    _last_start(0),
+    _last_stop(0),
+    _coord_diff(0),
+    _mode(Encoder::k_stop_gap_mode)
+{
+}
+
+starch3::status_t
+starch3::ChunkCursor::next(int64_t* start, int64_t* stop, const char** rem, size_t* rem_length)
+{
+    const char* eol = NULL;
+    const char* p = NULL;
+    int64_t value = 0;
+    while (_pos < _end) {
+        eol = static_cast<const char*>( std::memchr(_pos, '\n', static_cast<size_t>( _end - _pos )) );
+        if (!eol) {
+            return k_status_error;
+        }
+        /* coordinate difference lines set the length of the records that follow */
+        if (*_pos == 'p') {
+            if (!parse_int64(_pos + 1, eol, &_coord_diff)) {
+                return k_status_error;
+            }
+            _pos = eol + 1;
+            continue;
+        }
+        /* mode lines say whether starts follow the previous stop or the previous start */
+        if (*_pos == 'm') {
+            if (!parse_int64(_pos + 1, eol, &value) || (value < Encoder::k_stop_gap_mode) || (value >= Encoder::k_gap_mode_undefined)) {
+                return k_status_error;
+            }
+            _mode = static_cast<Encoder::gap_mode_t>( value );
+            _pos = eol + 1;
+            continue;
+        }
+        p = parse_int64(_pos, eol, &value);
+        if (!p) {
+            return k_status_error;
+        }
+        *start = ((_mode == Encoder::k_start_delta_mode) ? _last_start : _last_stop) + value;
+        *stop = *start + _coord_diff;
+        if ((p < eol) && (*p == '\t')) {
+            *rem = p + 1;
+            *rem_length = static_cast<size_t>( eol - p - 1 );
+        }
+        else {
+            *rem = p;
+            *rem_length = 0;
+        }
+        _last_start = *start;
+        _last_stop = *stop;
+        _pos = eol + 1;
+        return k_status_ok;
+    }
+    return k_status_end;
+}
+
+// starch3::Encoder
+
+starch3::Encoder::Encoder() :
+    _last_start(0),
+    _last_stop(0),
+    _last_coord_diff(0),
+    _line_count(0),
+    _min_start(INT64_MAX),
+    _max_stop(INT64_MIN),
+    _base_count(0),
+    _unique_base_count(0),
+    _mode(k_stop_gap_mode)
+{
+}
+
+void
+starch3::Encoder::reset(void)
+{
+    _last_start = 0;
+    _last_stop = 0;
+    _last_coord_diff = 0;
+    _line_count = 0;
+    _min_start = INT64_MAX;
+    _max_stop = INT64_MIN;
+    _base_count = 0;
+    _unique_base_count = 0;
+    _mode = k_stop_gap_mode;
+}
+
+/*
+   Encodes records from index from onwards, appending to tf. Encoding stops after the
+   record that fills tf to Archive::chunk_length; the index of the next record to
+   encode is returned, so the caller can flush the chunk, reset and carry on.
+
+   Each batch is written in whichever gap mode gives fewer digits. Overlapping records
+   have negative, wide gaps from the previous stop but small deltas from the previous
+   start, so overlap-dense regions switch to start deltas.
+*/
+size_t
+starch3::Encoder::encode(const record_batch_t& batch, size_t from, std::vector<char>* tf)
+{
+    size_t n = batch.starts.size() - from;
+    size_t idx = 0;
+    size_t pos = tf->size();
+    size_t rem_length = 0;
+    char* out = NULL;
+    gap_mode_t mode = k_stop_gap_mode;
+    if (n == 0) {
+        return from;
+    }
+    _gaps.resize(n);
+    _start_deltas.resize(n);
+    _coord_diffs.resize(n);
+    _coord_diff_changes.resize(n);
+    const int64_t* __restrict__ starts = batch.starts.data() + from;
+    const int64_t* __restrict__ stops = batch.stops.data() + from;
+    int64_t* __restrict__ gaps = _gaps.data();
+    int64_t* __restrict__ start_deltas = _start_deltas.data();
+    int64_t* __restrict__ coord_diffs = _coord_diffs.data();
+    unsigned char* __restrict__ coord_diff_changes = _coord_diff_changes.data();
+    /* branch-free passes over whole arrays, which the compiler vectorizes */
+    gaps[0] = starts[0] - _last_stop;
+    for (idx = 1; idx < n; idx++) {
+        gaps[idx] = starts[idx] - stops[idx - 1];
+    }
+    start_deltas[0] = starts[0] - _last_start;
+    for (idx = 1; idx < n; idx++) {
+        start_deltas[idx] = starts[idx] - starts[idx - 1];
+    }
+    for (idx = 0; idx < n; idx++) {
+        coord_diffs[idx] = stops[idx] - starts[idx];
+    }
+    coord_diff_changes[0] = (coord_diffs[0] != _last_coord_diff);
+    for (idx = 1; idx < n; idx++) {
+        coord_diff_changes[idx] = (coord_diffs[idx] != coord_diffs[idx - 1]);
+    }
+    if (digit_cost(start_deltas, n) < digit_cost(gaps, n)) {
+        mode = k_start_delta_mode;
+    }
+    const int64_t* values = (mode == k_start_delta_mode) ? start_deltas : gaps;
+    /* worst case per record: a coordinate difference line and a gap line, each with a 20-digit value */
+    tf->resize(pos + 3 + (n * 2 * 22) + (batch.rem_offsets[from + n] - batch.rem_offsets[from]));
+    out = tf->data();
+    if (mode != _mode) {
+        out[pos++] = 'm';
+        out[pos++] = static_cast<char>( '0' + mode );
+        out[pos++] = '\n';
+        _mode = mode;
+    }
+    /* serial emission; a gap from a zero stop is the absolute start, as the decoder expects */
+    for (idx = 0; idx < n; idx++) {
+        if (coord_diff_changes[idx]) {
+            out[pos++] = 'p';
+            pos += format_int64(out + pos, coord_diffs[idx]);
+            out[pos++] = '\n';
+        }
+        pos += format_int64(out + pos, values[idx]);
+        rem_length = batch.rem_offsets[from + idx + 1] - batch.rem_offsets[from + idx];
+        if (rem_length > 0) {
+            out[pos++] = '\t';
+            std::memcpy(out + pos, batch.rem.data() + batch.rem_offsets[from + idx], rem_length);
+            pos += rem_length;
+        }
+        out[pos++] = '\n';
+        if (pos >= Archive::chunk_length) {
+            idx++;
+            break;
+        }
+    }
+    tf->resize(pos);
+    /* zone map of the chunk, which lets queries skip or summarize chunks without decompressing them */
+    for (size_t r = 0; r < idx; r++) {
+        _min_start = std::min(_min_start, starts[r]);
+        _base_count += coord_diffs[r];
+    }
+    /* starts are sorted, so coverage grows only where a stop passes the furthest stop so far */
+    for (size_t r = 0; r < idx; r++) {
+        if (stops[r] > _max_stop) {
+            _unique_base_count += stops[r] - std::max(starts[r], _max_stop);
+            _max_stop = stops[r];
+        }
+    }
+    _last_start = starts[idx - 1];
+    _last_stop = stops[idx - 1];
+    _last_coord_diff = coord_diffs[idx - 1];
+    _line_count += static_cast<int64_t>( idx );
+    return from + idx;
+}
+
+int64_t
+starch3::Encoder::line_count(void) const
+{
+    return _line_count;
+}
+
+int64_t
+starch3::Encoder::min_start(void) const
+{
+    return _min_start;
+}
+
+int64_t
+starch3::Encoder::max_stop(void) const
+{
+    return _max_stop;
+}
+
+int64_t
+starch3::Encoder::base_count(void) const
+{
+    return _base_count;
+}
+
+int64_t
+starch3::Encoder::unique_base_count(void) const
+{
+    return _unique_base_count;
+}
+
+/* compresses the chunk encoded so far and describes it, leaving its archive offset to the caller */
+starch3::status_t
+starch3::Encoder::finish_chunk(const std::vector<char>& tf, std::vector<char>* compressed, chunk_record_t* cr, std::string* error) const
+{
+    bz_stream bzs;
+    status_t res = k_status_ok;
+    bzs.bzalloc = NULL;
+    bzs.bzfree = NULL;
+    bzs.opaque = NULL;
+    if (BZ2_bzCompressInit(&bzs, Archive::default_bzip2_level, 0, 30) != BZ_OK) {
+        error->assign("bzip2 compression could not be initialized");
+        return k_status_error;
+    }
+    /* the vendored bzip2 notifies a handler when each stream is closed */
+    bzs.block_close_functor = ignore_block_close;
+    compressed->resize(Archive::compressed_bound(tf.size()));
+    res = Archive::compress_chunk(&bzs, tf.data(), tf.size(), compressed->data(), compressed->size(), &cr->size, error);
+    BZ2_bzCompressEnd(&bzs);
+    if (res != k_status_ok) {
+        return res;
+    }
+    compressed->resize(cr->size);
+    cr->offset = 0;
+    cr->tf_offset = 0;
+    cr->tf_size = tf.size();
+    cr->line_count = _line_count;
+    cr->first_record = 0;
+    cr->min_start = _min_start;
+    cr->max_stop = _max_stop;
+    cr->base_count = _base_count;
+    cr->unique_base_count = _unique_base_count;
+    cr->tf_crc32c = CRC32C::update(0, tf.data(), tf.size());
+    cr->compressed_crc32c = CRC32C::update(0, compressed->data(), compressed->size());
+    cr->tf_hash = Hash64::hash(tf.data(), tf.size());
+    cr->codec = k_bzip2_codec;
+    cr->level = Archive::default_bzip2_level;
+    return k_status_ok;
+}
+
+void
+starch3::Encoder::clear_batch(record_batch_t* batch)
+{
+    batch->starts.clear();
+    batch->stops.clear();
+    batch->rem.clear();
+    batch->rem_offsets.assign(1, 0);
+}
+
+void
+starch3::Encoder::append_to_batch(record_batch_t* batch, int64_t start, int64_t stop, const char* rem, size_t rem_length)
+{
+    if (batch->rem_offsets.empty()) {
+        batch->rem_offsets.push_back(0);
+    }
+    batch->starts.push_back(start);
+    batch->stops.push_back(stop);
+    batch->rem.insert(batch->rem.end(), rem, rem + rem_length);
+    batch->rem_offsets.push_back(batch->rem.size());
+}
+
+// starch3::Writer
+
+starch3::Writer::Writer() :
+    _fd(-1),
+    _owns_fd(false),
+    _offset(0),
+    _has_chr(false),
+    _last_start(0)
+{
+    Encoder::clear_batch(&_batch);
+}
+
+starch3::Writer::~Writer()
+{
+    if (_fd != -1) {
+        this->close();
+    }
+}
+
+starch3::status_t
+starch3::Writer::open(const std::string& fn)
+{
+    int fd = ::open(fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        _error.assign("Output file could not be created (");
+        _error.append(std::strerror(errno));
+        _error.append(")");
+        return k_status_error;
+    }
+    if (this->open(fd) != k_status_ok) {
+        ::close(fd);
+        return k_status_error;
+    }
+    _owns_fd = true;
+    return k_status_ok;
+}
+
+starch3::status_t
+starch3::Writer::open(int fd)
+{
+    _fd = fd;
+    _owns_fd = false;
+    _offset = 0;
+    _has_chr = false;
+    _chrs = ChrTable();
+    _last_start = 0;
+    _tf.clear();
+    _streams.clear();
+    Encoder::clear_batch(&_batch);
+    _encoder.reset();
+    return this->write_bytes(reinterpret_cast<const char*>( Archive::header_magic_bytes ), sizeof(Archive::header_magic_bytes));
+}
+
+void
+starch3::Writer::set_note(const std::string& s)
+{
+    _note = s;
+}
+
+starch3::status_t
+starch3::Writer::push(const char* chr, size_t chr_length, int64_t start, int64_t stop, const char* rem, size_t rem_length)
+{
+    if (_fd == -1) {
+        _error.assign("Writer is not open");
+        return k_status_error;
+    }
+    if ((start < 0) || (stop < start)) {
+        _error.assign("Record has invalid coordinates");
+        return k_status_error;
+    }
+    /* records must arrive as the client's validation expects them: chromosomes in byte order, each once, with non-decreasing starts */
+    if (!_has_chr || (_chr.compare(0, std::string::npos, chr, chr_length) != 0)) {
+        if (_chrs.find(chr, chr_length) != ChrTable::no_chr) {
+            _error.assign("Chromosome was already seen earlier in the input");
+            return k_status_error;
+        }
+        if (_has_chr && (_chr.compare(0, std::string::npos, chr, chr_length) > 0)) {
+            _error.assign("Chromosome sorts before the previous chromosome");
+            return k_status_error;
+        }
+        if ((this->encode_batch() != k_status_ok) || (this->flush_chunk() != k_status_ok)) {
+            return k_status_error;
+        }
+        _chrs.intern(chr, chr_length);
+        _chr.assign(chr, chr_length);
+        _has_chr = true;
+    }
+    else if (start < _last_start) {
+        _error.assign("Start is less than the previous start");
+        return k_status_error;
+    }
+    _last_start = start;
+    Encoder::append_to_batch(&_batch, start, stop, rem, rem_length);
+    if (_batch.starts.size() >= Encoder::batch_length) {
+        return this->encode_batch();
+    }
+    return k_status_ok;
+}
+
+starch3::status_t
+starch3::Writer::push(const record_view_t& r)
+{
+    return this->push(r.chr, r.chr_length, r.start, r.stop, r.rem, r.rem_length);
+}
+
+starch3::status_t
+starch3::Writer::close(void)
+{
+    char footer[Archive::footer_length + 1];
+    char* metadata_str = NULL;
+    json_t* metadata = NULL;
+    off_t metadata_offset = 0;
+    uint32_t metadata_crc32c = 0;
+    status_t res = k_status_ok;
+    if (_fd == -1) {
+        _error.assign("Writer is not open");
+        return k_status_error;
+    }
+    res = this->encode_batch();
+    if (res == k_status_ok) {
+        res = this->flush_chunk();
+    }
+    if (res == k_status_ok) {
+        metadata = Archive::metadata_to_json(_streams, _note);
+        metadata_str = json_dumps(metadata, JSON_COMPACT | JSON_PRESERVE_ORDER);
+        json_decref(metadata);
+        if (!metadata_str) {
+            _error.assign("Could not serialize archive metadata");
+            res = k_status_error;
+        }
+    }
+    if (res == k_status_ok) {
+        metadata_offset = _offset;
+        metadata_crc32c = CRC32C::update(0, metadata_str, std::strlen(metadata_str));
+        res = this->write_bytes(metadata_str, std::strlen(metadata_str));
+        free(metadata_str);
+    }
+    if (res == k_status_ok) {
+        Archive::format_footer(footer, metadata_offset, metadata_crc32c);
+        res = this->write_bytes(footer, Archive::footer_length);
+    }
+    if (_owns_fd && (::close(_fd) == -1) && (res == k_status_ok)) {
+        _error.assign("Output file could not be closed");
+        res = k_status_error;
+    }
+    _fd = -1;
+    return res;
+}
+
+const std::string&
+starch3::Writer::error(void) const
+{
+    return _error;
+}
+
+starch3::status_t
+starch3::Writer::write_bytes(const char* buf, size_t len)
+{
+    size_t pos = 0;
+    ssize_t res = 0;
+    while (pos < len) {
+        res = write(_fd, buf + pos, len - pos);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            _error.assign("Could not write to output (");
+            _error.append(std::strerror(errno));
+            _error.append(")");
+            return k_status_error;
+        }
+        pos += static_cast<size_t>( res );
+    }
+    _offset += static_cast<off_t>( len );
+    return k_status_ok;
+}
+
+starch3::status_t
+starch3::Writer::encode_batch(void)
+{
+    size_t from = 0;
+    while (from < _batch.starts.size()) {
+        from = _encoder.encode(_batch, from, &_tf);
+        if ((_tf.size() >= Archive::chunk_length) && (this->flush_chunk() != k_status_ok)) {
+            return k_status_error;
+        }
+    }
+    Encoder::clear_batch(&_batch);
+    return k_status_ok;
+}
+
+starch3::status_t
+starch3::Writer::flush_chunk(void)
+{
+    chunk_record_t cr;
+    if (_tf.empty()) {
+        return k_status_ok;
+    }
+    if (_encoder.finish_chunk(_tf, &_compressed, &cr, &_error) != k_status_ok) {
+        return k_status_error;
+    }
+    cr.offset = _offset;
+    if (this->write_bytes(_compressed.data(), _compressed.size()) != k_status_ok) {
+        return k_status_error;
+    }
+    Archive::append_chunk_record(&_streams, _chr.data(), _chr.size(), cr);
+    /* chunks decode independently, so transformation state starts over */
+    _tf.clear();
+    _encoder.reset();
+    return k_status_ok;
+}
+
+// starch3::Reader
+
+starch3::Reader::Reader() :
+    _fd(-1),
+    _stream_idx(0),
+    _stream_end(0),
+    _chunk_idx(0),
+    _start(INT64_MIN),
+    _stop(INT64_MAX),
+    _has_chunk(false),
+    _tf_chunk_offset(-1),
+    _cursor(NULL, 0)
+{
+}
+
+starch3::Reader::~Reader()
+{
+    this->close();
+}
+
+starch3::status_t
+starch3::Reader::open(const std::string& fn)
+{
+    this->close();
+    _fd = ::open(fn.c_str(), O_RDONLY);
+    if (_fd == -1) {
+        _error.assign("Archive could not be opened (");
+        _error.append(std::strerror(errno));
+        _error.append(")");
+        return k_status_error;
+    }
+    if (Archive::read_metadata(_fd, &_streams, &_error) != k_status_ok) {
+        this->close();
+        return k_status_error;
+    }
+    _stream_idx = 0;
+    _stream_end = _streams.size();
+    _chunk_idx = 0;
+    _start = INT64_MIN;
+    _stop = INT64_MAX;
+    _has_chunk = false;
+    return k_status_ok;
+}
+
+void
+starch3::Reader::close(void)
+{
+    if (_fd != -1) {
+        ::close(_fd);
+        _fd = -1;
+    }
+    _has_chunk = false;
+    _tf_chunk_offset = -1;
+}
+
+const std::vector<starch3::stream_record_t>&
+starch3::Reader::streams(void) const
+{
+    return _streams;
+}
+
+starch3::status_t
+starch3::Reader::select(const std::string& chr)
+{
+    return this->select(chr, INT64_MIN, INT64_MAX);
+}
+
+/* restricts iteration to records of chr overlapping [start, stop); chunks outside the range are not read */
+starch3::status_t
+starch3::Reader::select(const std::string& chr, int64_t start, int64_t stop)
+{
+    for (size_t idx = 0; idx < _streams.size(); idx++) {
+        if (_streams[idx].chr == chr) {
+            _stream_idx = idx;
+            _stream_end = idx + 1;
+            _chunk_idx = 0;
+            _start = start;
+            _stop = stop;
+            _has_chunk = false;
+            return k_status_ok;
+        }
+    }
+    _error.assign("Chromosome is not in archive (");
+    _error.append(chr);
+    _error.append(")");
+    return k_status_error;
+}
+
+starch3::status_t
+starch3::Reader::next(record_view_t* r)
+{
+    status_t res = k_status_ok;
+    if (_fd == -1) {
+        _error.assign("Reader is not open");
+        return k_status_error;
+    }
+    for (;;) {
+        if (_has_chunk) {
+            res = _cursor.next(&r->start, &r->stop, &r->rem, &r->rem_length);
+            /* records are sorted by start, so the rest of the chunk lies past the range */
+            if ((res == k_status_ok) && (r->start >= _stop)) {
+                res = k_status_end;
+            }
+            if ((res == k_status_ok) && (r->stop <= _start)) {
+                continue;
+            }
+            if (res == k_status_ok) {
+                r->chr = _streams[_stream_idx].chr.data();
+                r->chr_length = _streams[_stream_idx].chr.size();
+                return k_status_ok;
+            }
+            if (res == k_status_error) {
+                _error.assign("Malformed transformed data in chunk of ");
+                _error.append(_streams[_stream_idx].chr);
+                return k_status_error;
+            }
+            _has_chunk = false;
+            _chunk_idx++;
+        }
+        for (;;) {
+            while ((_stream_idx < _stream_end) && (_chunk_idx >= _streams[_stream_idx].chunks.size())) {
+                _stream_idx++;
+                _chunk_idx = 0;
+            }
+            if ((_stream_idx >= _stream_end) || Archive::chunk_overlaps(_streams[_stream_idx].chunks[_chunk_idx], _start, _stop)) {
+                break;
+            }
+            _chunk_idx++;
+        }
+        if (_stream_idx >= _stream_end) {
+            return k_status_end;
+        }
+        const chunk_record_t& cr = _streams[_stream_idx].chunks[_chunk_idx];
+        /* chromosomes packed into one chunk follow each other, so the chunk is decoded once, through the last of them */
+        if ((cr.offset != _tf_chunk_offset) || (cr.tf_offset + cr.tf_size > _tf.size())) {
+            size_t tf_end = cr.tf_offset + cr.tf_size;
+            for (size_t idx = _stream_idx + 1; (idx < _streams.size()) && (_streams[idx].chunks.size() > 0) && (_streams[idx].chunks[0].offset == cr.offset); idx++) {
+                tf_end = std::max(tf_end, _streams[idx].chunks[0].tf_offset + _streams[idx].chunks[0].tf_size);
+            }
+            _tf_chunk_offset = -1;
+            if (Archive::read_chunk_prefix(_fd, cr, tf_end, &_compressed, &_tf, &_error) != k_status_ok) {
+                return k_status_error;
+            }
+            _tf_chunk_offset = cr.offset;
+        }
+        if (CRC32C::update(0, _tf.data() + cr.tf_offset, cr.tf_size) != cr.tf_crc32c) {
+            _error.assign("Transformed chunk checksum does not match metadata");
+            return k_status_error;
+        }
+        _cursor = ChunkCursor(_tf.data() + cr.tf_offset, cr.tf_size);
+        _has_chunk = true;
+    }
+}
+
+const std::string&
+starch3::Reader::error(void) const
+{
+    return _error;
+}
@@ -22,45 +22,73 @@ main(int argc, char** argv)
     starch3::self = &starch;
 
     starch.initialize_command_line_options(argc, argv);
+
+    if (starch.get_client_mode() == starch3::Starch::k_verify_mode) {
+        return starch.verify_archive();
+    }
+
+    if (starch.get_client_mode() == starch3::Starch::k_extract_mode) {
+        return starch.extract_archive();
+    }
+
+    if (starch.get_client_mode() == starch3::Starch::k_summary_mode) {
+        return starch.summarize_archive();
+    }
+
+    if (starch.get_client_mode() == starch3::Starch::k_serve_mode) {
+        return starch.serve_archives();
+    }
+
+    if (starch.get_client_mode() == starch3::Starch::k_merge_mode) {
+        return starch.merge_archives();
+    }
+
+    if (starch.get_client_mode() == starch3::Starch::k_columnar_mode) {
+        return starch.export_archive();
+    }
     
     starch.test_stdin_availability();
     
     starch.initialize_in_stream();
 
-    starch.initialize_out_stream();
+    starch.resume_from_checkpoint();
 
-    starch.initialize_out_compression_stream();
+    starch.initialize_out_stream();
 
     starch.initialize_shared_buffer(&starch.buffer);
-    
-    pthread_create(&starch.produce_line_thread, 
-                   NULL, 
-                   starch3::Starch::produce_line, 
-                   &starch.buffer);
-    
-    pthread_create(&starch.consume_line_thread, 
-                   NULL, 
-                   starch3::Starch::consume_line, 
-                   &starch.buffer);
-    
-    pthread_create(&starch.update_chr_thread, 
-                   NULL, 
-                   starch3::Starch::update_chr, 
-                   &starch.buffer);
-
-    pthread_create(&starch.consume_tf_buffer_thread, 
-                   NULL, 
-                   starch3::Starch::consume_tf_buffer, 
-                   &starch.buffer);
-    
-    pthread_join(starch.produce_line_thread, NULL); 
-    pthread_join(starch.consume_line_thread, NULL); 
-    pthread_join(starch.update_chr_thread, NULL);
-    pthread_join(starch.consume_tf_buffer_thread, NULL);
+
+    /* small input is written by the encoding thread itself, with no writer stage */
+    if (!starch.is_small_input()) {
+        pthread_create(&starch.write_blocks_thread, 
+                       NULL, 
+                       starch3::Starch::write_blocks, 
+                       &starch.out_queue);
+    }
+
+    starch3::Starch::compress_input(&starch.buffer);
+
+    int64_t validation_error_count = starch.report_validation();
 
     starch.delete_shared_buffer(&starch.buffer);
 
-    starch.delete_out_compression_stream();
+    starch.write_archive_metadata();
+
+    starch.finalize_out_stream();
+
+    starch.remove_checkpoint();
+
+    if (validation_error_count > 0) {
+        std::fprintf(stderr, "Error: Input failed validation with %" PRId64 " error(s)\n", validation_error_count);
+        if (!starch.get_output_fn().empty()) {
+            unlink(starch.get_output_fn().c_str());
+        }
+        starch.delete_shards();
+        return EXIT_FAILURE;
+    }
+
+    if (!starch.get_shard_dir().empty()) {
+        starch.write_shard_manifest();
+    }
 
 #ifdef DEBUG
     std::fprintf(stderr, "--- starch3::Starch::main() - end ---\n");
@@ -72,7 +100,7 @@ main(int argc, char** argv)
 std::string
 starch3::Starch::get_client_starch_opt_string(void) 
 {
-    static std::string _s("n:bghv?");
+    static std::string _s("n:o:r:d:u:k:O:e:q:R:l:p:D:U:M:C:T:cxSmabPghv?");
     return _s;
 }
 
@@ -80,15 +108,59 @@ struct option*
 starch3::Starch::get_client_starch_long_options(void) 
 {
     static struct option _n = { "note",     required_argument,         NULL,    'n' };
+    static struct option _o = { "output",   required_argument,         NULL,    'o' };
+    static struct option _r = { "report",   required_argument,         NULL,    'r' };
+    static struct option _d = { "shard-dir", required_argument,        NULL,    'd' };
+    static struct option _u = { "reuse",    required_argument,         NULL,    'u' };
+    static struct option _k = { "checkpoint", required_argument,       NULL,    'k' };
+    static struct option _e = { "chromosome", required_argument,       NULL,    'e' };
+    static struct option _c = { "verify",         no_argument,         NULL,    'c' };
+    static struct option _x = { "extract",        no_argument,         NULL,    'x' };
+    static struct option _q = { "query",    required_argument,         NULL,    'q' };
+    static struct option _R = { "regions",  required_argument,         NULL,    'R' };
+    static struct option _l = { "records",  required_argument,         NULL,    'l' };
+    static struct option _p = { "sample",   required_argument,         NULL,    'p' };
+    static struct option _D = { "seed",     required_argument,         NULL,    'D' };
+    static struct option _S = { "summary",        no_argument,         NULL,    'S' };
+    static struct option _U = { "serve",    required_argument,         NULL,    'U' };
+    static struct option _M = { "cache-size", required_argument,       NULL,    'M' };
+    static struct option _m = { "merge",          no_argument,         NULL,    'm' };
+    static struct option _C = { "columnar", required_argument,         NULL,    'C' };
+    static struct option _a = { "auto",           no_argument,         NULL,    'a' };
+    static struct option _O = { "optimize", required_argument,         NULL,    'O' };
     static struct option _b = { "bzip2",          no_argument,         NULL,    'b' };
     static struct option _g = { "gzip",           no_argument,         NULL,    'g' };
+    static struct option _T = { "threads",  required_argument,         NULL,    'T' };
+    static struct option _P = { "pin",            no_argument,         NULL,    'P' };
     static struct option _h = { "help",           no_argument,         NULL,    'h' };
     static struct option _w = { "version",        no_argument,         NULL,    'w' };
     static struct option _0 = { NULL,             no_argument,         NULL,     0  };
     static std::vector<struct option> _s;
     _s.push_back(_n);
+    _s.push_back(_o);
+    _s.push_back(_r);
+    _s.push_back(_d);
+    _s.push_back(_u);
+    _s.push_back(_k);
+    _s.push_back(_e);
+    _s.push_back(_c);
+    _s.push_back(_x);
+    _s.push_back(_q);
+    _s.push_back(_R);
+    _s.push_back(_l);
+    _s.push_back(_p);
+    _s.push_back(_D);
+    _s.push_back(_S);
+    _s.push_back(_U);
+    _s.push_back(_M);
+    _s.push_back(_m);
+    _s.push_back(_C);
+    _s.push_back(_a);
+    _s.push_back(_O);
     _s.push_back(_b);
     _s.push_back(_g);
+    _s.push_back(_T);
+    _s.push_back(_P);
     _s.push_back(_h);
     _s.push_back(_w);
     _s.push_back(_0);
@@ -117,6 +189,81 @@ starch3::Starch::initialize_command_line_options(int argc, char** argv)
 	    case 'n':
             this->set_note(optarg);
             break;
+        case 'o':
+            this->set_output_fn(optarg);
+            break;
+        case 'r':
+            this->set_report_fn(optarg);
+            break;
+        case 'd':
+            this->set_shard_dir(optarg);
+            break;
+        case 'u':
+            this->set_reuse_fn(optarg);
+            break;
+        case 'k':
+            this->set_checkpoint_fn(optarg);
+            break;
+        case 'e':
+            this->add_selected_chr(optarg);
+            break;
+        case 'c':
+            this->set_client_mode(k_verify_mode);
+            break;
+        case 'x':
+            this->set_client_mode(k_extract_mode);
+            break;
+        case 'q':
+            this->add_query(optarg);
+            if (this->get_client_mode() == k_compress_mode) {
+                this->set_client_mode(k_extract_mode);
+            }
+            break;
+        case 'R':
+            this->read_query_regions(optarg);
+            if (this->get_client_mode() == k_compress_mode) {
+                this->set_client_mode(k_extract_mode);
+            }
+            break;
+        case 'l':
+            this->set_record_range(optarg);
+            if (this->get_client_mode() == k_compress_mode) {
+                this->set_client_mode(k_extract_mode);
+            }
+            break;
+        case 'p':
+            this->set_sample_size(optarg);
+            if (this->get_client_mode() == k_compress_mode) {
+                this->set_client_mode(k_extract_mode);
+            }
+            break;
+        case 'D':
+            this->set_sample_seed(optarg);
+            break;
+        case 'S':
+            this->set_client_mode(k_summary_mode);
+            break;
+        case 'U':
+            this->set_serve_socket_fn(optarg);
+            this->set_client_mode(k_serve_mode);
+            break;
+        case 'M':
+            this->set_cache_size(optarg);
+            break;
+        case 'm':
+            this->set_client_mode(k_merge_mode);
+            break;
+        case 'C':
+            this->set_columnar_fn(optarg);
+            this->set_client_mode(k_columnar_mode);
+            break;
+        case 'a':
+            this->set_auto(true);
+            break;
+        case 'O':
+            this->set_optimize_objective(optarg);
+            this->set_auto(true);
+            break;
         case 'b':
             this->set_compression_method(k_bzip2);
             compression_methods_set++;
@@ -125,6 +272,12 @@ starch3::Starch::initialize_command_line_options(int argc, char** argv)
             this->set_compression_method(k_gzip);
             compression_methods_set++;
             break;
+        case 'T':
+            this->set_thread_count(optarg);
+            break;
+        case 'P':
+            this->set_pinned(true);
+            break;
         case 'h':
             this->print_usage(stdout);
             std::exit(EXIT_SUCCESS);
@@ -146,7 +299,10 @@ starch3::Starch::initialize_command_line_options(int argc, char** argv)
 
     if (optind < argc) {
         do {
-            if (this->get_input_fn().empty()) {
+            if ((this->get_client_mode() == k_serve_mode) || (this->get_client_mode() == k_merge_mode)) {
+                this->add_archive_fn(argv[optind]);
+            }
+            else if (this->get_input_fn().empty()) {
                 this->set_input_fn(argv[optind]);
             }
             else {
@@ -156,6 +312,46 @@ starch3::Starch::initialize_command_line_options(int argc, char** argv)
         while (++optind < argc);
     }
 
+    if (!this->get_shard_dir().empty() && !this->get_output_fn().empty()) {
+        std::fprintf(stderr, "Error: Only one of --output and --shard-dir may be set\n");
+        this->print_usage(stderr);
+        std::exit(EXIT_FAILURE);
+    }
+
+    /* resuming seeks the input and rewrites the output in place, so neither may be a stream */
+    if (!this->get_checkpoint_fn().empty() && (this->get_input_fn().empty() || this->get_output_fn().empty())) {
+        std::fprintf(stderr, "Error: --checkpoint needs an input file and --output\n");
+        this->print_usage(stderr);
+        std::exit(EXIT_FAILURE);
+    }
+
+    /* ordinals count records across the whole archive, so they do not combine with other selections */
+    if (this->is_record_range_set() || (this->get_sample_size() >= 0)) {
+        if (this->is_record_range_set() && (this->get_sample_size() >= 0)) {
+            std::fprintf(stderr, "Error: Only one of --records and --sample may be set\n");
+            this->print_usage(stderr);
+            std::exit(EXIT_FAILURE);
+        }
+        if ((this->get_client_mode() != k_extract_mode) || !_selected_chrs.empty() || !_query_regions.empty()) {
+            std::fprintf(stderr, "Error: --records and --sample extract from the whole archive, and may not be set with --chromosome, --query, --regions or other modes\n");
+            this->print_usage(stderr);
+            std::exit(EXIT_FAILURE);
+        }
+    }
+
+    /* columnar arrays hold whole chromosomes, so only --chromosome narrows an export */
+    if ((this->get_client_mode() == k_columnar_mode) && !_query_regions.empty()) {
+        std::fprintf(stderr, "Error: --columnar exports whole chromosomes, so --query and --regions may not be set with it\n");
+        this->print_usage(stderr);
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (this->is_auto() && (compression_methods_set > 0)) {
+        std::fprintf(stderr, "Error: --auto chooses the compression method, so --bzip2 and --gzip may not be set with it\n");
+        this->print_usage(stderr);
+        std::exit(EXIT_FAILURE);
+    }
+
     if (compression_methods_set > 1) {
         std::fprintf(stderr, "Error: Only one compression method may be set\n");
         this->print_usage(stderr);
@@ -197,14 +393,47 @@ starch3::Starch::get_client_starch_usage(void)
                           "\n"                                  \
                           "  Or:\n"                             \
                           "\n"                                  \
-                          "  $ starch3 [options] input > output\n");
+                          "  $ starch3 [options] input > output\n" \
+                          "\n"                                  \
+                          "  Or:\n"                             \
+                          "\n"                                  \
+                          "  $ starch3 --verify archive\n"      \
+                          "\n"                                  \
+                          "  Or:\n"                             \
+                          "\n"                                  \
+                          "  $ starch3 --extract [--chromosome=name ...] archive > output\n" \
+                          "\n"                                  \
+                          "  Or:\n"                             \
+                          "\n"                                  \
+                          "  $ starch3 --query=chr:start-stop [--query=...] [--regions=fn] archive > output\n" \
+                          "\n"                                  \
+                          "  Or:\n"                             \
+                          "\n"                                  \
+                          "  $ starch3 --records=first-last | --sample=N [--seed=S] archive > output\n" \
+                          "\n"                                  \
+                          "  Or:\n"                             \
+                          "\n"                                  \
+                          "  $ starch3 --summary --regions=windows.bed archive > counts\n" \
+                          "\n"                                  \
+                          "  Or:\n"                             \
+                          "\n"                                  \
+                          "  $ starch3 --serve=socket [--cache-size=MiB] archive [archive ...]\n" \
+                          "\n"                                  \
+                          "  Or:\n"                             \
+                          "\n"                                  \
+                          "  $ starch3 --merge [--output=fn] archive [archive ...]\n" \
+                          "\n"                                  \
+                          "  Or:\n"                             \
+                          "\n"                                  \
+                          "  $ starch3 --columnar=fn [--chromosome=name ...] archive\n");
     return _s;
 }
 
 std::string 
 starch3::Starch::get_client_starch_description(void) 
 {
-    static std::string _s("  Compress sorted BED data to BEDOPS Starch archive format.\n");
+    static std::string _s("  Compress sorted BED data to BEDOPS Starch archive format.\n" \
+                          "  Input may be plain text or gzip-, BGZF- or bzip2-compressed.\n");
     return _s;
 }
 
@@ -212,7 +441,18 @@ std::string
 starch3::Starch::get_client_starch_io_options(void) 
 {
     static std::string _s("  General Options:\n\n"      \
-                          "  --note=\"foo bar...\"   Append note to output archive metadata (optional)\n");
+                          "  --note=\"foo bar...\"   Append note to output archive metadata (optional)\n" \
+                          "  --output=fn             Write archive to file fn with preallocated, positioned writes (optional; default is stdout)\n" \
+                          "  --report=fn             Write JSON report of input sort-order and format errors to file fn (optional)\n" \
+                          "  --shard-dir=dir         Write each chromosome to its own archive in dir, with a manifest.json index (optional)\n" \
+                          "  --reuse=fn              Copy compressed chunks from archive fn wherever the transformed data is unchanged (optional)\n" \
+                          "  --checkpoint=fn         Record progress in file fn as chunks reach disk, and resume from it after an interruption (optional; needs an input file and --output)\n" \
+                          "  --bzip2                 Compress chunks with bzip2 (default)\n" \
+                          "  --gzip                  Compress chunks with gzip, which decompresses faster at some cost in size (optional)\n" \
+                          "  --auto                  Choose the compression of each chromosome by trial-compressing a sample of it (optional)\n" \
+                          "  --optimize=goal         With --auto, choose for ratio, speed or decode-speed (optional; default is ratio)\n" \
+                          "  --threads=N             Use N threads for compression and for the parallel stages of other modes (optional; default is the CPUs allotted by affinity and cgroup quota)\n" \
+                          "  --pin                   Bind each compression thread to a CPU of its own (optional)\n");
     return _s; 
 }
         
@@ -220,6 +460,19 @@ std::string
 starch3::Starch::get_client_starch_general_options(void) 
 {
     static std::string _s("  Process Flags:\n\n"        \
+                          "  --verify                Check chunk checksums of archive without decompression, in parallel across chromosomes\n" \
+                          "  --extract               Decompress archive to BED on stdout, decoding chunks in parallel and writing them in order\n" \
+                          "  --chromosome=name       Extract or export only chromosome name; may be repeated (optional)\n" \
+                          "  --query=chr:start-stop  Extract records overlapping the 0-based, half-open region, decoding only chunks that span it; may be repeated\n" \
+                          "  --regions=fn            Extract records overlapping any region in BED file fn\n" \
+                          "  --records=first-last    Extract records first through last-1, counted from 0 across the archive, decoding only chunks that hold them\n" \
+                          "  --sample=N              Extract N records drawn uniformly without replacement, in archive order, decoding only chunks that hold them\n" \
+                          "  --seed=S                Seed for --sample, so a sample can be drawn again (optional; default is taken from the clock)\n" \
+                          "  --merge                 Merge sorted archives, in parallel across chromosomes, to BED on stdout, or to an archive with --output\n" \
+                          "  --columnar=fn           Export start and stop coordinates to file fn as per-chromosome binary arrays that can be mapped in place, decoding chunks in parallel\n" \
+                          "  --serve=socket          Answer query, streams and stats requests for the archives on Unix socket, keeping them mapped until SIGINT or SIGTERM\n" \
+                          "  --cache-size=MiB        Memory for decoded chunks shared by --serve connections (optional; default is 256)\n" \
+                          "  --summary               With --query or --regions, write each window with its overlapping record count and bases, decoding only chunks that straddle window edges\n" \
                           "  --help                  Show this usage message\n" \
                           "  --version               Show binary version\n");
     return _s;
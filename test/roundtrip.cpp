@@ -0,0 +1,378 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "libstarch3.hpp"
+#include "starch3crc32c.hpp"
+
+// round trip of sorted records through starch3::Writer, or through archives assembled from the library's parts, and back out of starch3::Reader
+
+typedef struct test_record {
+    std::string chr;
+    int64_t start;
+    int64_t stop;
+    std::string rem;
+} test_record_t;
+
+static int failure_count = 0;
+
+static void
+check(bool is_ok, const char* test, const std::string& what)
+{
+    if (!is_ok) {
+        std::fprintf(stderr, "FAIL: %s: %s\n", test, what.c_str());
+        failure_count++;
+    }
+}
+
+/* deterministic records: one chromosome long enough for several chunks, with runs of overlapping records, then a few short ones */
+static void
+make_records(std::vector<test_record_t>* records)
+{
+    uint64_t seed = 0x5eed;
+    char rem[64];
+    const char* chrs[] = { "chr1", "chr2", "chr3" };
+    const int64_t counts[] = { 250000, 1000, 1 };
+    for (size_t chr_idx = 0; chr_idx < 3; chr_idx++) {
+        int64_t start = 10000;
+        for (int64_t idx = 0; idx < counts[chr_idx]; idx++) {
+            seed = (seed * 6364136223846793005ULL) + 1442695040888963407ULL;
+            test_record_t r;
+            r.chr = chrs[chr_idx];
+            /* every eighth record overlaps the previous one */
+            start += ((seed >> 33) % 8 == 0) ? 0 : static_cast<int64_t>( (seed >> 40) % 500 );
+            r.start = start;
+            r.stop = start + 1 + static_cast<int64_t>( (seed >> 20) % 300 );
+            std::snprintf(rem, sizeof(rem), "id-%zu-%" PRId64 "\t%d", chr_idx, idx, static_cast<int>( (seed >> 50) % 1000 ));
+            r.rem = rem;
+            records->push_back(r);
+        }
+    }
+}
+
+static bool
+overlaps(const test_record_t& r, int64_t start, int64_t stop)
+{
+    return (r.stop > start) && (r.start < stop);
+}
+
+/* reads the selected records and compares them with the expected ones, in order */
+static void
+check_records(starch3::Reader* reader, const std::vector<test_record_t>& expected, const char* test)
+{
+    starch3::record_view_t r;
+    starch3::status_t res = starch3::k_status_ok;
+    size_t idx = 0;
+    while ((res = reader->next(&r)) == starch3::k_status_ok) {
+        if (idx >= expected.size()) {
+            check(false, test, "more records read than written");
+            return;
+        }
+        const test_record_t& e = expected[idx];
+        if ((e.chr != std::string(r.chr, r.chr_length)) || (e.start != r.start) || (e.stop != r.stop) || (e.rem != std::string(r.rem, r.rem_length))) {
+            check(false, test, "record " + std::to_string(idx) + " differs from " + e.chr + ":" + std::to_string(e.start) + "-" + std::to_string(e.stop));
+            return;
+        }
+        idx++;
+    }
+    check(res == starch3::k_status_end, test, "reader failed (" + reader->error() + ")");
+    check(idx == expected.size(), test, "read " + std::to_string(idx) + " of " + std::to_string(expected.size()) + " records");
+}
+
+/* selects each region and compares its records with those of a scan */
+static void
+check_selections(const std::string& fn, const std::vector<test_record_t>& records, const std::vector<test_record_t>& regions, const char* test)
+{
+    for (std::vector<test_record_t>::const_iterator q = regions.begin(); q != regions.end(); ++q) {
+        starch3::Reader reader;
+        std::vector<test_record_t> expected;
+        for (std::vector<test_record_t>::const_iterator r = records.begin(); r != records.end(); ++r) {
+            if ((r->chr == q->chr) && overlaps(*r, q->start, q->stop)) {
+                expected.push_back(*r);
+            }
+        }
+        if ((reader.open(fn) != starch3::k_status_ok) || (reader.select(q->chr, q->start, q->stop) != starch3::k_status_ok)) {
+            check(false, test, "select " + q->chr + " failed (" + reader.error() + ")");
+            continue;
+        }
+        check_records(&reader, expected, test);
+    }
+}
+
+static void
+write_records(const std::string& fn, const std::vector<test_record_t>& records)
+{
+    starch3::Writer writer;
+    bool is_ok = (writer.open(fn) == starch3::k_status_ok);
+    for (std::vector<test_record_t>::const_iterator r = records.begin(); is_ok && (r != records.end()); ++r) {
+        is_ok = (writer.push(r->chr.data(), r->chr.size(), r->start, r->stop, r->rem.data(), r->rem.size()) == starch3::k_status_ok);
+    }
+    is_ok = is_ok && (writer.close() == starch3::k_status_ok);
+    if (!is_ok) {
+        std::fprintf(stderr, "Error: Could not write test archive (%s)\n", writer.error().c_str());
+        std::exit(EXIT_FAILURE);
+    }
+}
+
+/* writes magic bytes and chunk bytes as given, then the metadata and a footer that locates it */
+static void
+write_archive(const std::string& fn, const std::vector<char>& chunks, json_t* metadata)
+{
+    char footer[starch3::Archive::footer_length + 1];
+    char* metadata_str = json_dumps(metadata, JSON_COMPACT | JSON_PRESERVE_ORDER);
+    size_t metadata_length = metadata_str ? std::strlen(metadata_str) : 0;
+    off_t metadata_offset = static_cast<off_t>( sizeof(starch3::Archive::header_magic_bytes) + chunks.size() );
+    FILE* out = std::fopen(fn.c_str(), "wb");
+    if (!metadata_str || !out) {
+        std::fprintf(stderr, "Error: Could not write test archive [%s]\n", fn.c_str());
+        std::exit(EXIT_FAILURE);
+    }
+    starch3::Archive::format_footer(footer, metadata_offset, starch3::CRC32C::update(0, metadata_str, metadata_length));
+    std::fwrite(starch3::Archive::header_magic_bytes, 1, sizeof(starch3::Archive::header_magic_bytes), out);
+    std::fwrite(chunks.data(), 1, chunks.size(), out);
+    std::fwrite(metadata_str, 1, metadata_length, out);
+    std::fwrite(footer, 1, starch3::Archive::footer_length, out);
+    std::fclose(out);
+    free(metadata_str);
+}
+
+/* chunk bytes of an archive: everything between the magic bytes and the metadata */
+static void
+read_chunk_bytes(const std::string& fn, const std::vector<starch3::stream_record_t>& streams, std::vector<char>* chunks)
+{
+    size_t end = sizeof(starch3::Archive::header_magic_bytes);
+    for (std::vector<starch3::stream_record_t>::const_iterator s = streams.begin(); s != streams.end(); ++s) {
+        for (std::vector<starch3::chunk_record_t>::const_iterator c = s->chunks.begin(); c != s->chunks.end(); ++c) {
+            end = std::max(end, static_cast<size_t>( c->offset ) + c->size);
+        }
+    }
+    FILE* in = std::fopen(fn.c_str(), "rb");
+    chunks->resize(end - sizeof(starch3::Archive::header_magic_bytes));
+    if (!in || (std::fseek(in, sizeof(starch3::Archive::header_magic_bytes), SEEK_SET) != 0) || (std::fread(chunks->data(), 1, chunks->size(), in) != chunks->size())) {
+        std::fprintf(stderr, "Error: Could not read test archive [%s]\n", fn.c_str());
+        std::exit(EXIT_FAILURE);
+    }
+    std::fclose(in);
+}
+
+/*
+   Metadata as archives before 3.4 wrote it: every chunk an object, shared chunks repeated in the
+   streams that hold them, and every stream with its totals. Without ranges, chunks also lack the
+   ordinals, ranges and base counts of later versions.
+*/
+static json_t*
+legacy_metadata(const std::vector<starch3::stream_record_t>& streams, int minor, bool has_ranges)
+{
+    json_t* metadata = json_object();
+    json_t* archive = json_object();
+    json_t* version = json_object();
+    json_t* stream_array = json_array();
+    json_object_set_new(version, "major", json_integer(3));
+    json_object_set_new(version, "minor", json_integer(minor));
+    json_object_set_new(version, "revision", json_integer(0));
+    json_object_set_new(archive, "type", json_string("starch"));
+    json_object_set_new(archive, "version", version);
+    json_object_set_new(archive, "compression_format", json_string("bzip2"));
+    for (std::vector<starch3::stream_record_t>::const_iterator s = streams.begin(); s != streams.end(); ++s) {
+        json_t* stream = json_object();
+        json_t* chunk_array = json_array();
+        for (std::vector<starch3::chunk_record_t>::const_iterator c = s->chunks.begin(); c != s->chunks.end(); ++c) {
+            json_t* chunk = json_object();
+            json_object_set_new(chunk, "offset", json_integer(static_cast<json_int_t>( c->offset )));
+            json_object_set_new(chunk, "compressed_size", json_integer(static_cast<json_int_t>( c->size )));
+            json_object_set_new(chunk, "transformed_offset", json_integer(static_cast<json_int_t>( c->tf_offset )));
+            json_object_set_new(chunk, "transformed_size", json_integer(static_cast<json_int_t>( c->tf_size )));
+            json_object_set_new(chunk, "line_count", json_integer(static_cast<json_int_t>( c->line_count )));
+            if (has_ranges) {
+                json_object_set_new(chunk, "first_record", json_integer(static_cast<json_int_t>( c->first_record )));
+                json_object_set_new(chunk, "min_start", json_integer(static_cast<json_int_t>( c->min_start )));
+                json_object_set_new(chunk, "max_stop", json_integer(static_cast<json_int_t>( c->max_stop )));
+                json_object_set_new(chunk, "base_count", json_integer(static_cast<json_int_t>( c->base_count )));
+                json_object_set_new(chunk, "unique_base_count", json_integer(static_cast<json_int_t>( c->unique_base_count )));
+            }
+            json_object_set_new(chunk, "transformed_crc32c", json_integer(static_cast<json_int_t>( c->tf_crc32c )));
+            json_object_set_new(chunk, "compressed_crc32c", json_integer(static_cast<json_int_t>( c->compressed_crc32c )));
+            json_array_append_new(chunk_array, chunk);
+        }
+        json_object_set_new(stream, "chromosome", json_string(s->chr.c_str()));
+        json_object_set_new(stream, "line_count", json_integer(static_cast<json_int_t>( s->line_count )));
+        json_object_set_new(stream, "transformed_size", json_integer(static_cast<json_int_t>( s->tf_size )));
+        json_object_set_new(stream, "compressed_size", json_integer(static_cast<json_int_t>( s->size )));
+        json_object_set_new(stream, "transformed_crc32c", json_integer(static_cast<json_int_t>( s->tf_crc32c )));
+        json_object_set_new(stream, "compressed_crc32c", json_integer(static_cast<json_int_t>( s->compressed_crc32c )));
+        json_object_set_new(stream, "chunks", chunk_array);
+        json_array_append_new(stream_array, stream);
+    }
+    json_object_set_new(metadata, "archive", archive);
+    json_object_set_new(metadata, "streams", stream_array);
+    return metadata;
+}
+
+/*
+   The client packs chromosomes too small for a chunk of their own into a shared chunk, each with its
+   own span. The Writer gives every chromosome its own chunks, so the shared chunk is assembled here
+   the way the client does it: spans encoded one after another into one tf buffer, compressed once.
+*/
+static void
+write_packed_archive(const std::string& fn, const std::vector<test_record_t>& records, std::vector<starch3::stream_record_t>* streams)
+{
+    starch3::Encoder encoder;
+    starch3::record_batch_t batch;
+    std::vector<char> tf;
+    std::vector<char> compressed;
+    std::vector<starch3::chunk_record_t> spans;
+    std::vector<std::string> span_chrs;
+    std::string error;
+    size_t compressed_size = 0;
+    starch3::Encoder::clear_batch(&batch);
+    for (size_t idx = 0; idx < records.size(); idx++) {
+        starch3::Encoder::append_to_batch(&batch, records[idx].start, records[idx].stop, records[idx].rem.data(), records[idx].rem.size());
+        if ((idx + 1 < records.size()) && (records[idx + 1].chr == records[idx].chr)) {
+            continue;
+        }
+        starch3::chunk_record_t cr;
+        cr.tf_offset = tf.size();
+        for (size_t from = 0; from < batch.starts.size(); ) {
+            from = encoder.encode(batch, from, &tf);
+        }
+        cr.tf_size = tf.size() - cr.tf_offset;
+        cr.line_count = encoder.line_count();
+        cr.min_start = encoder.min_start();
+        cr.max_stop = encoder.max_stop();
+        cr.base_count = encoder.base_count();
+        cr.unique_base_count = encoder.unique_base_count();
+        cr.tf_crc32c = starch3::CRC32C::update(0, tf.data() + cr.tf_offset, cr.tf_size);
+        cr.tf_hash = 0;
+        cr.codec = starch3::k_bzip2_codec;
+        cr.level = starch3::Archive::default_bzip2_level;
+        spans.push_back(cr);
+        span_chrs.push_back(records[idx].chr);
+        starch3::Encoder::clear_batch(&batch);
+        encoder.reset();
+    }
+    compressed.resize(starch3::Archive::compressed_bound(tf.size()));
+    if (starch3::Archive::compress_chunk(starch3::k_bzip2_codec, starch3::Archive::default_bzip2_level, tf.data(), tf.size(), compressed.data(), compressed.size(), &compressed_size, &error) != starch3::k_status_ok) {
+        std::fprintf(stderr, "Error: Could not compress packed chunk (%s)\n", error.c_str());
+        std::exit(EXIT_FAILURE);
+    }
+    compressed.resize(compressed_size);
+    streams->clear();
+    for (size_t idx = 0; idx < spans.size(); idx++) {
+        spans[idx].offset = static_cast<off_t>( sizeof(starch3::Archive::header_magic_bytes) );
+        spans[idx].size = compressed.size();
+        spans[idx].compressed_crc32c = starch3::CRC32C::update(0, compressed.data(), compressed.size());
+        starch3::Archive::append_chunk_record(streams, span_chrs[idx].data(), span_chrs[idx].size(), spans[idx]);
+    }
+    json_t* metadata = starch3::Archive::metadata_to_json(*streams, std::string());
+    write_archive(fn, compressed, metadata);
+    json_decref(metadata);
+}
+
+/* regions at the edges of every chunk of the chromosome, which select() must neither miss nor overrun */
+static void
+chunk_edge_regions(const starch3::stream_record_t& s, std::vector<test_record_t>* regions)
+{
+    for (std::vector<starch3::chunk_record_t>::const_iterator c = s.chunks.begin(); c != s.chunks.end(); ++c) {
+        test_record_t q;
+        q.chr = s.chr;
+        q.start = c->min_start - 1;
+        q.stop = c->min_start + 1;
+        regions->push_back(q);
+        q.start = c->max_stop - 1;
+        q.stop = c->max_stop + 1;
+        regions->push_back(q);
+        q.start = c->max_stop;
+        q.stop = c->max_stop + 1000;
+        regions->push_back(q);
+    }
+}
+
+int
+main(int argc, char** argv)
+{
+    char dir_template[] = "/tmp/starch3-test-XXXXXX";
+    const char* dir = mkdtemp(dir_template);
+    std::vector<test_record_t> records;
+    std::vector<test_record_t> packed_records;
+    std::vector<test_record_t> regions;
+    std::vector<starch3::stream_record_t> packed_streams;
+    std::vector<char> chunks;
+    (void) argc;
+    (void) argv;
+    if (!dir) {
+        std::fprintf(stderr, "Error: Test directory could not be created (%s)\n", std::strerror(errno));
+        return EXIT_FAILURE;
+    }
+    std::string archive_fn = std::string(dir) + "/multi.starch";
+    std::string packed_fn = std::string(dir) + "/packed.starch";
+    std::string legacy_fn = std::string(dir) + "/legacy.starch";
+    make_records(&records);
+
+    /* multi-chunk streams, read in full and by region */
+    write_records(archive_fn, records);
+    starch3::Reader reader;
+    check(reader.open(archive_fn) == starch3::k_status_ok, "multi-chunk", "open failed (" + reader.error() + ")");
+    check((reader.streams().size() == 3) && (reader.streams()[0].chunks.size() > 1), "multi-chunk", "chr1 was not split into several chunks");
+    check_records(&reader, records, "multi-chunk");
+    chunk_edge_regions(reader.streams()[0], &regions);
+    test_record_t q = { "chr2", 0, INT64_MAX, std::string() };
+    regions.push_back(q);
+    q.chr = "chr3";
+    q.start = records.back().stop;
+    regions.push_back(q);
+    check_selections(archive_fn, records, regions, "select");
+    std::vector<starch3::stream_record_t> streams = reader.streams();
+    reader.close();
+
+    /* small chromosomes sharing one chunk, each read alone and in turn: the head of chr1, then chr2 and chr3 */
+    for (std::vector<test_record_t>::const_iterator r = records.begin(); r != records.end(); ++r) {
+        if ((r->chr != "chr1") || (r - records.begin() < 400)) {
+            packed_records.push_back(*r);
+        }
+    }
+    write_packed_archive(packed_fn, packed_records, &packed_streams);
+    check(reader.open(packed_fn) == starch3::k_status_ok, "packed", "open failed (" + reader.error() + ")");
+    check((reader.streams().size() == 3) && (reader.streams()[1].chunks[0].offset == reader.streams()[0].chunks[0].offset) && (reader.streams()[1].chunks[0].tf_offset > 0), "packed", "chromosomes do not share a chunk");
+    check_records(&reader, packed_records, "packed");
+    reader.close();
+    regions.clear();
+    for (std::vector<starch3::stream_record_t>::const_iterator s = packed_streams.begin(); s != packed_streams.end(); ++s) {
+        chunk_edge_regions(*s, &regions);
+    }
+    check_selections(packed_fn, packed_records, regions, "packed select");
+
+    /* pre-3.4 metadata over the same chunks, with and without chunk ranges */
+    for (int pass = 0; pass < 4; pass++) {
+        bool is_packed = (pass >= 2);
+        bool has_ranges = ((pass % 2) == 0);
+        const std::vector<test_record_t>& expected = is_packed ? packed_records : records;
+        const std::vector<starch3::stream_record_t>& legacy_streams = is_packed ? packed_streams : streams;
+        read_chunk_bytes(is_packed ? packed_fn : archive_fn, legacy_streams, &chunks);
+        json_t* metadata = legacy_metadata(legacy_streams, has_ranges ? 3 : 0, has_ranges);
+        write_archive(legacy_fn, chunks, metadata);
+        json_decref(metadata);
+        check(reader.open(legacy_fn) == starch3::k_status_ok, "legacy", "open failed (" + reader.error() + ")");
+        check_records(&reader, expected, "legacy");
+        reader.close();
+        regions.clear();
+        chunk_edge_regions(legacy_streams[0], &regions);
+        check_selections(legacy_fn, expected, regions, "legacy select");
+    }
+
+    unlink(archive_fn.c_str());
+    unlink(packed_fn.c_str());
+    unlink(legacy_fn.c_str());
+    rmdir(dir);
+    if (failure_count > 0) {
+        std::fprintf(stderr, "%d round-trip checks failed\n", failure_count);
+        return EXIT_FAILURE;
+    }
+    std::fprintf(stderr, "All round-trip checks passed\n");
+    return EXIT_SUCCESS;
+}